@@ -0,0 +1,41 @@
+################################################################################
+#
+# libptrauth
+#
+################################################################################
+
+LIBPTRAUTH_VERSION = 1.0
+LIBPTRAUTH_SITE = package/libptrauth/src
+LIBPTRAUTH_SITE_METHOD = local
+LIBPTRAUTH_INSTALL_STAGING = YES
+LIBPTRAUTH_DEPENDENCIES = ptrauth
+
+ifeq ($(BR2_STATIC_LIBS),y)
+LIBPTRAUTH_LIBS = libptrauth.a
+else ifeq ($(BR2_SHARED_LIBS),y)
+LIBPTRAUTH_LIBS = libptrauth.so
+else
+LIBPTRAUTH_LIBS = libptrauth.a libptrauth.so
+endif
+
+define LIBPTRAUTH_BUILD_CMDS
+	$(TARGET_MAKE_ENV) $(MAKE) $(TARGET_CONFIGURE_OPTS) \
+		LIBS="$(LIBPTRAUTH_LIBS)" -C $(@D)
+endef
+
+define LIBPTRAUTH_INSTALL_STAGING_CMDS
+	$(INSTALL) -D -m 0644 $(@D)/libptrauth.h \
+		$(STAGING_DIR)/usr/include/libptrauth.h
+	for lib in $(LIBPTRAUTH_LIBS); do \
+		$(INSTALL) -D -m 0755 $(@D)/$$lib $(STAGING_DIR)/usr/lib/$$lib || exit 1; \
+	done
+endef
+
+ifneq ($(BR2_STATIC_LIBS),y)
+define LIBPTRAUTH_INSTALL_TARGET_CMDS
+	$(INSTALL) -D -m 0755 $(@D)/libptrauth.so \
+		$(TARGET_DIR)/usr/lib/libptrauth.so
+endef
+endif
+
+$(eval $(generic-package))
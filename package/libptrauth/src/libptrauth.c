@@ -0,0 +1,339 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "libptrauth.h"
+
+#define PTRAUTH_DEVICE "/dev/ptrauth"
+
+// Below this many operations the registers are cheaper than a syscall
+#define PTRAUTH_MANY_INLINE 8
+
+volatile uint64_t *__ptrauth_regs;
+const volatile uint64_t *__ptrauth_generation;
+__thread struct __ptrauth_cache_slot __ptrauth_cache[PTRAUTH_CACHE_SLOTS];
+
+static pthread_mutex_t ptrauth_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t ptrauth_atfork_once = PTHREAD_ONCE_INIT;
+
+// Set once the process is fully set up, cleared in children
+static int ptrauth_ready;
+static int ptrauth_device_fd = -1;
+static struct ptrauth_info ptrauth_info;
+static size_t ptrauth_window_size;
+
+// The child shares the open file and inherits the key, but depending on
+// the driver mode the mapping may not have been copied. Drop it and map
+// the device again on the next call. The shared page is never copied, the
+// child maps its own, holding the generation of its key: that of the
+// parent if it inherited the key, so the cache it copied stays valid.
+static void ptrauth_atfork_child(void) {
+    pthread_mutex_init(&ptrauth_lock, NULL);
+
+    if (__ptrauth_regs != NULL) {
+        munmap((void *)__ptrauth_regs, ptrauth_window_size);
+        __ptrauth_regs = NULL;
+    }
+    __ptrauth_generation = NULL;
+    ptrauth_ready = 0;
+}
+
+static void ptrauth_register_atfork(void) {
+    pthread_atfork(NULL, NULL, ptrauth_atfork_child);
+}
+
+// Must be called with ptrauth_lock held
+static int ptrauth_setup(void) {
+    if (ptrauth_device_fd < 0) {
+        int fd = open(PTRAUTH_DEVICE, O_RDWR | O_CLOEXEC);
+        if (fd < 0)
+            return -1;
+
+        // Drivers without PTRAUTH_IOC_GET_INFO always have the window
+        if (ioctl(fd, PTRAUTH_IOC_GET_INFO, &ptrauth_info) != 0) {
+            ptrauth_info.engine = PTRAUTH_ENGINE_HW;
+            ptrauth_info.flags = PTRAUTH_INFO_MAPPABLE;
+        }
+
+        ptrauth_device_fd = fd;
+    }
+
+    if (__ptrauth_regs == NULL && (ptrauth_info.flags & PTRAUTH_INFO_MAPPABLE)) {
+        size_t size = sysconf(_SC_PAGESIZE);
+        void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, ptrauth_device_fd, 0);
+
+        if (base == MAP_FAILED)
+            return -1;
+
+        ptrauth_window_size = size;
+        __atomic_store_n(&__ptrauth_regs, (volatile uint64_t *)base, __ATOMIC_RELEASE);
+    }
+
+    // Without the shared page ptrauth_sign_cached() does not cache
+    if (__ptrauth_generation == NULL && (ptrauth_info.flags & PTRAUTH_INFO_SHARED)) {
+        size_t size = sysconf(_SC_PAGESIZE);
+        void *base = mmap(NULL, size, PROT_READ, MAP_SHARED, ptrauth_device_fd,
+                          (off_t)PTRAUTH_SHARED_PGOFF * size);
+
+        if (base != MAP_FAILED) {
+            const volatile struct ptrauth_shared *shared = base;
+            __atomic_store_n(&__ptrauth_generation, &shared->generation, __ATOMIC_RELEASE);
+        }
+    }
+
+    __atomic_store_n(&ptrauth_ready, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int ptrauth_init(void) {
+    int ret;
+
+    if (__atomic_load_n(&ptrauth_ready, __ATOMIC_ACQUIRE))
+        return 0;
+
+    pthread_once(&ptrauth_atfork_once, ptrauth_register_atfork);
+
+    pthread_mutex_lock(&ptrauth_lock);
+    ret = ptrauth_setup();
+    pthread_mutex_unlock(&ptrauth_lock);
+
+    return ret;
+}
+
+int ptrauth_fd(void) {
+    if (ptrauth_init() != 0)
+        return -1;
+
+    return ptrauth_device_fd;
+}
+
+static int ptrauth_batch(unsigned long cmd, uint32_t flags, struct ptrauth_op *ops, size_t count) {
+    while (count > 0) {
+        uint32_t n = count > UINT32_MAX ? UINT32_MAX : count;
+        struct ptrauth_batch batch = {
+            .ops = (uintptr_t)ops,
+            .count = n,
+            .flags = flags,
+        };
+
+        if (ioctl(ptrauth_device_fd, cmd, &batch) != 0)
+            return -1;
+
+        ops += n;
+        count -= n;
+    }
+
+    return 0;
+}
+
+uint64_t __ptrauth_sign_slow(uint64_t ptr, uint64_t tweak) {
+    struct ptrauth_op op = { .pointer = ptr, .tweak = tweak };
+
+    if (ptrauth_init() != 0)
+        return 0;
+    if (__ptrauth_regs != NULL)
+        return ptrauth_sign(ptr, tweak);
+
+    // Software engine, only reachable through the driver
+    if (ptrauth_batch(PTRAUTH_IOC_SIGN_BATCH, 0, &op, 1) != 0)
+        return 0;
+
+    return op.result;
+}
+
+uint64_t __ptrauth_auth_slow(uint64_t signed_ptr, uint64_t tweak) {
+    struct ptrauth_op op = { .pointer = signed_ptr, .tweak = tweak };
+
+    if (ptrauth_init() != 0)
+        return 0;
+    if (__ptrauth_regs != NULL)
+        return ptrauth_auth(signed_ptr, tweak);
+
+    if (ptrauth_batch(PTRAUTH_IOC_AUTH_BATCH, 0, &op, 1) != 0)
+        return 0;
+
+    return op.result;
+}
+
+int ptrauth_sign_many(struct ptrauth_op *ops, size_t count) {
+    if (ptrauth_init() != 0)
+        return -1;
+
+    if (__ptrauth_regs != NULL && count <= PTRAUTH_MANY_INLINE) {
+        for (size_t i = 0; i < count; i++)
+            ops[i].result = ptrauth_sign(ops[i].pointer, ops[i].tweak);
+        return 0;
+    }
+
+    return ptrauth_batch(PTRAUTH_IOC_SIGN_BATCH, 0, ops, count);
+}
+
+int ptrauth_auth_many(struct ptrauth_op *ops, size_t count) {
+    if (ptrauth_init() != 0)
+        return -1;
+
+    if (__ptrauth_regs != NULL && count <= PTRAUTH_MANY_INLINE) {
+        for (size_t i = 0; i < count; i++)
+            ops[i].result = ptrauth_auth(ops[i].pointer, ops[i].tweak);
+        return 0;
+    }
+
+    return ptrauth_batch(PTRAUTH_IOC_AUTH_BATCH, 0, ops, count);
+}
+
+// ==== Key rotation ====
+
+int ptrauth_rotate_key(uint64_t *epoch) {
+    __u64 new_epoch;
+
+    if (ptrauth_init() != 0)
+        return -1;
+
+    if (ioctl(ptrauth_device_fd, PTRAUTH_IOC_ROTATE_KEY, &new_epoch) != 0)
+        return -1;
+
+    if (epoch != NULL)
+        *epoch = new_epoch;
+
+    return 0;
+}
+
+int ptrauth_resign_many(struct ptrauth_op *ops, size_t count) {
+    if (ptrauth_init() != 0)
+        return -1;
+
+    return ptrauth_batch(PTRAUTH_IOC_SIGN_BATCH, PTRAUTH_BATCH_RESIGN, ops, count);
+}
+
+uint64_t __ptrauth_auth_slot_slow(uint64_t *slot, uint64_t signed_ptr, uint64_t tweak) {
+    struct ptrauth_op op = { .pointer = signed_ptr, .tweak = tweak };
+
+    if (ptrauth_resign_many(&op, 1) != 0 || op.result == 0)
+        return 0;
+
+    // Another thread may have re-signed it first, with the same result
+    __atomic_compare_exchange_n(slot, &signed_ptr, op.result, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+
+    return op.result & PTRAUTH_ADDR_MASK;
+}
+
+// ==== Compiler instrumentation ====
+
+// Entry points of the code added by the ptrauth GCC plugin. Function
+// pointers are signed when stored to memory and authenticated when loaded
+// back, so memory only holds signed function pointers and NULL. Everything
+// fails closed: a pointer that cannot be signed, or that does not
+// authenticate (including one stored without a signature), aborts the
+// process.
+
+static void ptrauth_instrument_fail(const char *what, uint64_t ptr) {
+    fprintf(stderr, "ptrauth: cannot %s function pointer 0x%" PRIx64 "\n", what, ptr);
+    abort();
+}
+
+static int ptrauth_is_signed(uint64_t ptr) {
+    return (ptr >> PTRAUTH_PAC_SHIFT) != 0;
+}
+
+uint64_t __ptrauth_instrument_sign(uint64_t ptr, uint64_t tweak) {
+    uint64_t signed_ptr;
+
+    if (ptr == 0)
+        return 0;
+
+    signed_ptr = ptrauth_sign_cached(ptr, tweak);
+    if (signed_ptr == 0)
+        ptrauth_instrument_fail("sign", ptr);
+
+    return signed_ptr;
+}
+
+uint64_t __ptrauth_instrument_auth(uint64_t ptr, uint64_t tweak) {
+    uint64_t plain;
+
+    if (ptr == 0)
+        return 0;
+
+    // No shortcut for pointers without a signature: the device checks them
+    // like any other, and rejects them
+    plain = ptrauth_auth(ptr, tweak);
+    if (plain == 0)
+        ptrauth_instrument_fail("authenticate", ptr);
+
+    return plain;
+}
+
+// Word `i` of a section: the entry itself, or the one it points to
+static uint64_t *ptrauth_section_word(uint64_t *words, uint64_t **slots, size_t i) {
+    return slots != NULL ? slots[i] : &words[i];
+}
+
+static int ptrauth_needs_signing(uint64_t ptr) {
+    return ptr != 0 && !ptrauth_is_signed(ptr);
+}
+
+// Sign in place the `n` words of a section, skipping NULL and the words
+// already signed by the constructor of another unit. Aborts on failure.
+static void ptrauth_sign_section_words(uint64_t *words, uint64_t **slots, size_t n, uint64_t tweak) {
+    struct ptrauth_op *ops;
+    size_t count = 0;
+
+    for (size_t i = 0; i < n; i++)
+        count += ptrauth_needs_signing(*ptrauth_section_word(words, slots, i));
+    if (count == 0)
+        return;
+
+    ops = calloc(count, sizeof(*ops));
+    if (ops == NULL) {
+        fprintf(stderr, "ptrauth: out of memory\n");
+        abort();
+    }
+
+    count = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint64_t ptr = *ptrauth_section_word(words, slots, i);
+
+        if (!ptrauth_needs_signing(ptr))
+            continue;
+        ops[count].pointer = ptr;
+        ops[count].tweak = tweak;
+        count++;
+    }
+
+    if (ptrauth_sign_many(ops, count) != 0)
+        ptrauth_instrument_fail("sign", ops[0].pointer);
+
+    count = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint64_t *word = ptrauth_section_word(words, slots, i);
+
+        if (!ptrauth_needs_signing(*word))
+            continue;
+        if (ops[count].result == 0)
+            ptrauth_instrument_fail("sign", ops[count].pointer);
+        *word = ops[count].result;
+        count++;
+    }
+
+    free(ops);
+}
+
+// Called by the constructor of every instrumented unit with the bounds of
+// the `ptrauth_fns` section of its module, which holds the addresses of
+// the functions stored by batch-mode units
+void __ptrauth_instrument_sign_section(uint64_t *start, uint64_t *stop, uint64_t tweak) {
+    ptrauth_sign_section_words(start, NULL, stop - start, tweak);
+}
+
+// Same for the `ptrauth_slots` section, which holds the addresses of the
+// function pointers set by static initializers
+void __ptrauth_instrument_sign_slots(uint64_t **start, uint64_t **stop, uint64_t tweak) {
+    ptrauth_sign_section_words(NULL, start, stop - start, tweak);
+}
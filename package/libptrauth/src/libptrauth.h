@@ -0,0 +1,202 @@
+#ifndef _LIBPTRAUTH_H
+#define _LIBPTRAUTH_H
+
+// Userspace access to /dev/ptrauth.
+//
+// ptrauth_sign() and ptrauth_auth() are inlined: once the process has
+// mapped the device they are three register accesses. The device is opened
+// and mapped on the first call in each process (and again in children
+// after fork()), or explicitly with ptrauth_init(). With the software
+// engine of the driver the registers cannot be mapped and every call goes
+// through an ioctl.
+//
+// ptrauth_sign_cached() avoids the device altogether for pairs signed
+// recently by the same thread.
+//
+// Long-running processes can rotate their key with ptrauth_rotate_key().
+// Pointers stored before are re-signed lazily by ptrauth_auth_slot(), on
+// their first use during the grace epoch.
+//
+// The device holds a single request and its registers are per device, not
+// per thread: a thread that is preempted in the middle of a sequence can
+// see its request clobbered by another user of the device.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <ptrauth_ioctl.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Signatures are stored above the 48-bit address
+#define PTRAUTH_PAC_SHIFT 48
+#define PTRAUTH_ADDR_MASK ((1ULL << PTRAUTH_PAC_SHIFT) - 1)
+
+// Register indexes in the mapped window, in 64-bit words
+#define PTRAUTH_REG_PLAINTEXT  (0x10 / 8)
+#define PTRAUTH_REG_TWEAK      (0x18 / 8)
+#define PTRAUTH_REG_CIPHERTEXT (0x20 / 8)
+
+// Orders the register writes before the read that starts the operation.
+// Older drivers map the window as normal memory, so volatile is not enough.
+#if defined(__aarch64__)
+#define __ptrauth_io_barrier() __asm__ __volatile__("dmb osh" ::: "memory")
+#else
+#define __ptrauth_io_barrier() __asm__ __volatile__("" ::: "memory")
+#endif
+
+// Mapped registers, NULL until the process is set up. Internal.
+extern volatile uint64_t *__ptrauth_regs;
+
+uint64_t __ptrauth_sign_slow(uint64_t ptr, uint64_t tweak);
+uint64_t __ptrauth_auth_slow(uint64_t signed_ptr, uint64_t tweak);
+
+static inline volatile uint64_t *__ptrauth_get_regs(void) {
+    // The register accesses depend on the loaded address
+    return __atomic_load_n(&__ptrauth_regs, __ATOMIC_RELAXED);
+}
+
+// Sign `ptr` with the key of the calling process, 0 on error
+static inline uint64_t ptrauth_sign(uint64_t ptr, uint64_t tweak) {
+    volatile uint64_t *regs = __ptrauth_get_regs();
+
+    if (__builtin_expect(regs == NULL, 0))
+        return __ptrauth_sign_slow(ptr, tweak);
+
+    regs[PTRAUTH_REG_PLAINTEXT] = ptr;
+    regs[PTRAUTH_REG_TWEAK] = tweak;
+    __ptrauth_io_barrier();
+
+    return regs[PTRAUTH_REG_CIPHERTEXT];
+}
+
+// Authenticate a signed pointer, returns the plain pointer or 0 if the
+// signature does not match (the driver also signals the process)
+static inline uint64_t ptrauth_auth(uint64_t signed_ptr, uint64_t tweak) {
+    volatile uint64_t *regs = __ptrauth_get_regs();
+
+    if (__builtin_expect(regs == NULL, 0))
+        return __ptrauth_auth_slow(signed_ptr, tweak);
+
+    regs[PTRAUTH_REG_TWEAK] = tweak;
+    regs[PTRAUTH_REG_CIPHERTEXT] = signed_ptr;
+    __ptrauth_io_barrier();
+
+    return regs[PTRAUTH_REG_CIPHERTEXT];
+}
+
+// ==== Key rotation ====
+
+uint64_t __ptrauth_auth_slot_slow(uint64_t *slot, uint64_t signed_ptr, uint64_t tweak);
+
+// Authenticate the signed pointer stored at `slot`, returns the plain
+// pointer or 0 if the signature is invalid. The check signs the address
+// again and compares, so an invalid pointer is not reported to the driver
+// as an authentication failure. A pointer signed under the previous key
+// (see ptrauth_rotate_key()) is re-signed with the current key and written
+// back to `slot`, later calls take the fast path.
+static inline uint64_t ptrauth_auth_slot(uint64_t *slot, uint64_t tweak) {
+    uint64_t signed_ptr = __atomic_load_n(slot, __ATOMIC_RELAXED);
+    uint64_t ptr = signed_ptr & PTRAUTH_ADDR_MASK;
+
+    if (__builtin_expect(ptrauth_sign(ptr, tweak) == signed_ptr, 1))
+        return ptr;
+
+    return __ptrauth_auth_slot_slow(slot, signed_ptr, tweak);
+}
+
+// ==== Signed-pointer cache ====
+
+// Slots of the per-thread cache used by ptrauth_sign_cached()
+#define PTRAUTH_CACHE_BITS  7
+#define PTRAUTH_CACHE_SLOTS (1U << PTRAUTH_CACHE_BITS)
+
+struct __ptrauth_cache_slot {
+    uint64_t ptr;
+    uint64_t tweak;
+    uint64_t signed_ptr;
+    uint64_t generation;
+};
+
+// Key generation of the process, in its page shared with the driver, NULL
+// until the process is set up or if the driver has no such page. Internal.
+extern const volatile uint64_t *__ptrauth_generation;
+extern __thread struct __ptrauth_cache_slot __ptrauth_cache[PTRAUTH_CACHE_SLOTS];
+
+static inline unsigned int __ptrauth_cache_index(uint64_t ptr, uint64_t tweak) {
+    uint64_t hash = (ptr ^ (tweak * 0x9e3779b97f4a7c15ULL)) * 0xff51afd7ed558ccdULL;
+
+    return hash >> (64 - PTRAUTH_CACHE_BITS);
+}
+
+// Same as ptrauth_sign(), but remembers the last signature of each (ptr,
+// tweak) pair in a small direct-mapped cache of the calling thread, for
+// code that signs the same pointers over and over (callbacks, vtables).
+// Entries are tagged with the key generation published by the driver and
+// dropped as soon as it changes. Without the shared page it is
+// ptrauth_sign().
+static inline uint64_t ptrauth_sign_cached(uint64_t ptr, uint64_t tweak) {
+    const volatile uint64_t *shared = __atomic_load_n(&__ptrauth_generation, __ATOMIC_RELAXED);
+    struct __ptrauth_cache_slot *slot;
+    uint64_t generation, signed_ptr;
+
+    if (__builtin_expect(shared == NULL, 0))
+        return ptrauth_sign(ptr, tweak);
+
+    // Read before signing: a key change while signing makes the entry stale
+    generation = __atomic_load_n(shared, __ATOMIC_ACQUIRE);
+    slot = &__ptrauth_cache[__ptrauth_cache_index(ptr, tweak)];
+
+    if (slot->generation == generation && slot->ptr == ptr && slot->tweak == tweak)
+        return slot->signed_ptr;
+
+    signed_ptr = ptrauth_sign(ptr, tweak);
+    if (signed_ptr != 0) {
+        slot->ptr = ptr;
+        slot->tweak = tweak;
+        slot->signed_ptr = signed_ptr;
+        slot->generation = generation;
+    }
+
+    return signed_ptr;
+}
+
+// Open and map the device now instead of on the first call. Returns 0, or
+// -1 with errno set.
+int ptrauth_init(void);
+
+// File descriptor of the device for the driver ioctls, -1 with errno set
+// if it cannot be opened
+int ptrauth_fd(void);
+
+// Sign or authenticate `count` operations in one go, filling ops[].result.
+// Large batches go through PTRAUTH_IOC_{SIGN,AUTH}_BATCH. Returns 0, or -1
+// with errno set.
+int ptrauth_sign_many(struct ptrauth_op *ops, size_t count);
+int ptrauth_auth_many(struct ptrauth_op *ops, size_t count);
+
+// Give the process a fresh key, the current one stays valid for re-signing
+// until the next rotation. The new epoch is stored in `epoch` if not NULL.
+// Returns 0, or -1 with errno set.
+int ptrauth_rotate_key(uint64_t *epoch);
+
+// Re-sign signed pointers with the current key, eagerly: ops[].result is
+// the pointer signed under the current key, or 0 if it was valid under
+// neither the current nor the previous key. Returns 0, or -1 with errno
+// set.
+int ptrauth_resign_many(struct ptrauth_op *ops, size_t count);
+
+// Runtime of the ptrauth GCC plugin, called by instrumented code only.
+// They abort the process instead of returning an error.
+uint64_t __ptrauth_instrument_sign(uint64_t ptr, uint64_t tweak);
+uint64_t __ptrauth_instrument_auth(uint64_t ptr, uint64_t tweak);
+void __ptrauth_instrument_sign_section(uint64_t *start, uint64_t *stop, uint64_t tweak);
+void __ptrauth_instrument_sign_slots(uint64_t **start, uint64_t **stop, uint64_t tweak);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _LIBPTRAUTH_H */
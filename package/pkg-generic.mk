@@ -78,6 +78,24 @@ define step_check_build_dir
 endef
 GLOBAL_INSTRUMENTATION_HOOKS += step_check_build_dir
 
+# Merge the compile commands recorded by the toolchain wrapper during the
+# build step into the compilation database of the package. The shard is
+# started over whenever the package is configured again, rebuilds only
+# add the commands they run to it.
+ifeq ($(BR2_COMPILE_COMMANDS),y)
+define step_compile_commands
+	$(if $(filter configure,$(2)),$(if $(filter start,$(1)),\
+		rm -f $($(PKG)_DIR)/.compile_commands.jsonl))
+	$(if $(filter build,$(2)),$(if $(filter end,$(1)),\
+		if [ -s $($(PKG)_DIR)/.compile_commands.jsonl ]; then \
+			support/scripts/merge-compile-commands \
+				$($(PKG)_DIR)/.compile_commands.jsonl \
+				$($(PKG)_DIR)/compile_commands.json; \
+		fi))
+endef
+GLOBAL_INSTRUMENTATION_HOOKS += step_compile_commands
+endif
+
 # User-supplied script
 ifneq ($(BR2_INSTRUMENTATION_SCRIPTS),)
 define step_user
@@ -787,6 +805,16 @@ ifneq ($(1),host-skeleton)
 $(2)_DEPENDENCIES += host-skeleton
 endif
 
+# Target packages can be built with the ptrauth GCC plugin by setting
+# <PKG>_PTRAUTH_INSTRUMENT to YES or BATCH; the toolchain wrapper reads
+# the mode from BR2_PTRAUTH_INSTRUMENT, exported below.
+$(2)_PTRAUTH_INSTRUMENT ?= NO
+ifeq ($(4):$$(BR2_PACKAGE_HOST_PTRAUTH_GCC_PLUGIN),target:y)
+ifneq ($$(filter YES BATCH,$$($(2)_PTRAUTH_INSTRUMENT)),)
+$(2)_DEPENDENCIES += host-ptrauth-gcc-plugin libptrauth
+endif
+endif
+
 ifneq ($$(filter cvs git svn,$$($(2)_SITE_METHOD)),)
 $(2)_DOWNLOAD_DEPENDENCIES += \
 	$(BR2_GZIP_HOST_DEPENDENCY) \
@@ -1101,6 +1129,33 @@ $$($(2)_TARGET_ACTUAL_SOURCE):		PKGDIR=$(pkgdir)
 $$($(2)_TARGET_DIRCLEAN):		PKG=$(2)
 $$($(2)_TARGET_DIRCLEAN):		NAME=$(1)
 
+# Instrumentation mode of the ptrauth GCC plugin, for the steps that may
+# compile or link
+ifeq ($(4):$$(BR2_PACKAGE_HOST_PTRAUTH_GCC_PLUGIN),target:y)
+ifneq ($$(filter YES BATCH,$$($(2)_PTRAUTH_INSTRUMENT)),)
+$$($(2)_TARGET_CONFIGURE):		export BR2_PTRAUTH_INSTRUMENT=$$($(2)_PTRAUTH_INSTRUMENT)
+$$($(2)_TARGET_BUILD):			export BR2_PTRAUTH_INSTRUMENT=$$($(2)_PTRAUTH_INSTRUMENT)
+$$($(2)_TARGET_INSTALL_STAGING):	export BR2_PTRAUTH_INSTRUMENT=$$($(2)_PTRAUTH_INSTRUMENT)
+$$($(2)_TARGET_INSTALL_TARGET):		export BR2_PTRAUTH_INSTRUMENT=$$($(2)_PTRAUTH_INSTRUMENT)
+endif
+endif
+
+# Package name recorded by the toolchain wrapper in its timing log, when
+# BR2_WRAPPER_LOG is set
+ifneq ($$(BR2_WRAPPER_LOG),)
+$$($(2)_TARGET_CONFIGURE):		export BR2_WRAPPER_LOG_PKG=$(1)
+$$($(2)_TARGET_BUILD):			export BR2_WRAPPER_LOG_PKG=$(1)
+$$($(2)_TARGET_INSTALL_STAGING):	export BR2_WRAPPER_LOG_PKG=$(1)
+$$($(2)_TARGET_INSTALL_TARGET):		export BR2_WRAPPER_LOG_PKG=$(1)
+$$($(2)_TARGET_INSTALL_IMAGES):		export BR2_WRAPPER_LOG_PKG=$(1)
+endif
+
+# Shard of compile commands recorded by the toolchain wrapper. Only the
+# build step is recorded, to leave out the test programs of configure.
+ifeq ($$(BR2_COMPILE_COMMANDS),y)
+$$($(2)_TARGET_BUILD):			export BR2_COMPILE_COMMANDS_SHARD=$$($(2)_DIR)/.compile_commands.jsonl
+endif
+
 # Compute the name of the Kconfig option that correspond to the
 # package being enabled.
 ifeq ($(1),linux)
@@ -0,0 +1,20 @@
+################################################################################
+#
+# ptrauth-bench
+#
+################################################################################
+
+PTRAUTH_BENCH_VERSION = 1.0
+PTRAUTH_BENCH_SITE = package/ptrauth-bench/src
+PTRAUTH_BENCH_SITE_METHOD = local
+PTRAUTH_BENCH_DEPENDENCIES = libptrauth
+
+define PTRAUTH_BENCH_BUILD_CMDS
+	$(MAKE) CC="$(TARGET_CC)" LD="$(TARGET_LD)" -C $(@D)
+endef
+
+define PTRAUTH_BENCH_INSTALL_TARGET_CMDS
+	$(INSTALL) -D -m 0755 $(@D)/ptrauth-bench $(TARGET_DIR)/usr/bin
+endef
+
+$(eval $(generic-package))
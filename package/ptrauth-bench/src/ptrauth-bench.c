@@ -0,0 +1,699 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include <libptrauth.h>
+
+// Benchmark suite for the ptrauth driver, printing one JSON document so
+// that runs can be compared across driver changes.
+//
+//  latency     per-operation sign and auth latency (p50/p99/p999)
+//  throughput  sustained signs per second, one process and `-p` processes
+//              spread over the CPUs, so that boards with one device
+//              instance per core or cluster use all of them
+//  switch      context switch cost between two processes pinned on one
+//              CPU bouncing a byte over pipes, without and with keys
+//  fork        fork+exit rate of an unkeyed and of a keyed parent (the
+//              child's key is cloned and dropped every time)
+//  callback    calls through a small table of function pointers that are
+//              signed again before every call, with ptrauth_sign() and
+//              with ptrauth_sign_cached()
+//  open        open+close rate of the device, each open giving the
+//              process a fresh key, and the rate of CGI-style workers that
+//              fork, open, sign once, close and exit. Both include the
+//              driver's process_lock, taken on open and on close
+//  rotate      key rotation cost against the number of live signed
+//              pointers: the rotation itself, the first pass over the
+//              pointers re-signing them lazily with ptrauth_auth_slot(),
+//              a steady pass, and an eager ptrauth_resign_many()
+//
+// Every benchmark runs in child processes with keys of their own; the
+// parent never owns a key so that children do not inherit it.
+//
+// usage: ptrauth-bench [-b benchmark] [-n iterations] [-t seconds]
+//                      [-p processes] [-c cpu] [-o file]
+
+// Live pointer counts of the rotate benchmark
+#define ROTATE_SIZES 3
+static const long rotate_pointers[ROTATE_SIZES] = { 1000, 10000, 100000 };
+
+struct latency {
+    uint64_t samples;
+    uint64_t min, p50, p99, p999, max;
+    double mean;
+};
+
+// Results written by the benchmark children, in shared memory
+struct results {
+    struct latency timer;
+    struct latency sign;
+    struct latency auth;
+
+    uint64_t single_ops;
+    double single_seconds;
+    uint64_t multi_ops[256];
+    double multi_seconds;
+
+    double switch_unkeyed_ns;
+    double switch_keyed_ns;
+
+    double fork_unkeyed_per_sec;
+    double fork_keyed_per_sec;
+
+    double open_close_per_sec;
+    double open_worker_per_sec;
+
+    double callback_uncached_per_sec;
+    double callback_cached_per_sec;
+
+    struct {
+        long pointers;
+        double rotate_ns;
+        double lazy_pass_ns;
+        double steady_pass_ns;
+        double eager_resign_ns;
+    } rotate[ROTATE_SIZES];
+};
+
+static struct {
+    const char *benchmark;
+    long iterations;
+    int seconds;
+    int processes;
+    int cpu;
+} config = {
+    .benchmark = "all",
+    .iterations = 100000,
+    .seconds = 5,
+    .processes = 0,
+    .cpu = 0,
+};
+
+static struct results *results;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void pin(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        perror("sched_setaffinity");
+        exit(1);
+    }
+}
+
+static void init_device(void) {
+    if (ptrauth_init() != 0) {
+        perror("ptrauth_init");
+        _exit(1);
+    }
+}
+
+// Run `fn` in a child process and wait for it
+static void run_child(void (*fn)(void)) {
+    int status;
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        fn();
+        _exit(0);
+    }
+
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "benchmark child failed\n");
+        exit(1);
+    }
+}
+
+// ==== Latency ====
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void summarize(struct latency *lat, uint64_t *samples, long count) {
+    double sum = 0;
+
+    qsort(samples, count, sizeof(*samples), compare_u64);
+    for (long i = 0; i < count; i++)
+        sum += samples[i];
+
+    lat->samples = count;
+    lat->min = samples[0];
+    lat->p50 = samples[(count - 1) * 50 / 100];
+    lat->p99 = samples[(count - 1) * 99 / 100];
+    lat->p999 = samples[(count - 1) * 999 / 1000];
+    lat->max = samples[count - 1];
+    lat->mean = sum / count;
+}
+
+// Samples include the cost of reading the clock, reported as "timer" so
+// that it can be subtracted
+static void bench_latency(void) {
+    long n = config.iterations;
+    uint64_t *samples = calloc(n, sizeof(*samples));
+    uint64_t *signed_ptrs = calloc(n, sizeof(*signed_ptrs));
+
+    if (samples == NULL || signed_ptrs == NULL)
+        _exit(1);
+
+    init_device();
+    pin(config.cpu);
+
+    for (long i = 0; i < n; i++) {
+        uint64_t start = now_ns();
+        samples[i] = now_ns() - start;
+    }
+    summarize(&results->timer, samples, n);
+
+    for (long i = 0; i < n; i++) {
+        uint64_t start = now_ns();
+        signed_ptrs[i] = ptrauth_sign(0x400000 + 8 * i, i);
+        samples[i] = now_ns() - start;
+    }
+    summarize(&results->sign, samples, n);
+
+    for (long i = 0; i < n; i++) {
+        uint64_t start = now_ns();
+        uint64_t ptr = ptrauth_auth(signed_ptrs[i], i);
+        samples[i] = now_ns() - start;
+
+        if (ptr != 0x400000 + 8 * (uint64_t)i) {
+            fprintf(stderr, "auth mismatch at %ld\n", i);
+            _exit(1);
+        }
+    }
+    summarize(&results->auth, samples, n);
+}
+
+// ==== Throughput ====
+
+// Sign for the configured duration, returns the number of operations
+static uint64_t sign_for_duration(double *seconds) {
+    uint64_t deadline, start, ops = 0;
+
+    init_device();
+
+    start = now_ns();
+    deadline = start + (uint64_t)config.seconds * 1000000000ull;
+    do {
+        // Check the clock every 1024 operations only
+        for (int i = 0; i < 1024; i++, ops++)
+            (void)ptrauth_sign(0x400000 + 8 * ops, ops);
+    } while (now_ns() < deadline);
+
+    *seconds = (now_ns() - start) / 1e9;
+    return ops;
+}
+
+static void bench_throughput_single(void) {
+    results->single_ops = sign_for_duration(&results->single_seconds);
+}
+
+static void bench_throughput_multi(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int gate[2];
+    pid_t pids[256];
+    double seconds[256];
+
+    if (pipe(gate) != 0)
+        _exit(1);
+
+    for (int i = 0; i < config.processes; i++) {
+        pids[i] = fork();
+        if (pids[i] < 0)
+            _exit(1);
+        if (pids[i] == 0) {
+            char c;
+            close(gate[1]);
+            // The device is opened after pinning, on the local instance
+            if (cpus > 0)
+                pin(i % cpus);
+            // Start all processes at once
+            (void)read(gate[0], &c, 1);
+            results->multi_ops[i] = sign_for_duration(&seconds[i]);
+            _exit(0);
+        }
+    }
+    close(gate[0]);
+
+    uint64_t start = now_ns();
+    close(gate[1]);
+    for (int i = 0; i < config.processes; i++)
+        waitpid(pids[i], NULL, 0);
+    results->multi_seconds = (now_ns() - start) / 1e9;
+}
+
+// ==== Context switch ====
+
+static double ping_pong(int keyed) {
+    int ping[2], pong[2];
+    long n = config.iterations;
+    char c = 0;
+
+    if (pipe(ping) != 0 || pipe(pong) != 0)
+        _exit(1);
+
+    pin(config.cpu);
+
+    pid_t pid = fork();
+    if (pid < 0)
+        _exit(1);
+
+    if (pid == 0) {
+        if (keyed)
+            init_device();
+        for (long i = 0; i < n; i++) {
+            if (read(ping[0], &c, 1) != 1 || write(pong[1], &c, 1) != 1)
+                _exit(1);
+        }
+        _exit(0);
+    }
+
+    // A key of its own, different from the child's
+    if (keyed)
+        init_device();
+
+    // Let the child set up before timing
+    if (write(ping[1], &c, 1) != 1 || read(pong[0], &c, 1) != 1)
+        _exit(1);
+
+    uint64_t start = now_ns();
+    for (long i = 1; i < n; i++) {
+        if (write(ping[1], &c, 1) != 1 || read(pong[0], &c, 1) != 1)
+            _exit(1);
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    waitpid(pid, NULL, 0);
+
+    // Two switches per round trip
+    return (double)elapsed / (2.0 * (n - 1));
+}
+
+static void bench_switch_unkeyed(void) {
+    results->switch_unkeyed_ns = ping_pong(0);
+}
+
+static void bench_switch_keyed(void) {
+    results->switch_keyed_ns = ping_pong(1);
+}
+
+// ==== Fork ====
+
+static double fork_rate(int keyed) {
+    long n = config.iterations / 10 > 0 ? config.iterations / 10 : 1;
+
+    if (keyed)
+        init_device();
+
+    uint64_t start = now_ns();
+    for (long i = 0; i < n; i++) {
+        pid_t pid = fork();
+        if (pid < 0)
+            _exit(1);
+        if (pid == 0)
+            _exit(0);
+        waitpid(pid, NULL, 0);
+    }
+
+    return n / ((now_ns() - start) / 1e9);
+}
+
+static void bench_fork_unkeyed(void) {
+    results->fork_unkeyed_per_sec = fork_rate(0);
+}
+
+static void bench_fork_keyed(void) {
+    results->fork_keyed_per_sec = fork_rate(1);
+}
+
+// ==== Open ====
+
+// Opens the device directly, libptrauth keeps its descriptor open
+static int open_sign_close(int sign) {
+    struct ptrauth_op op = { .pointer = 0x400123, .tweak = 42 };
+    struct ptrauth_batch batch = { .ops = (uintptr_t)&op, .count = 1 };
+    int fd = open("/dev/ptrauth", O_RDWR | O_CLOEXEC);
+
+    if (fd < 0)
+        return -1;
+    if (sign && ioctl(fd, PTRAUTH_IOC_SIGN_BATCH, &batch) != 0) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    return 0;
+}
+
+static void bench_open_close(void) {
+    uint64_t deadline, start, opens = 0;
+
+    pin(config.cpu);
+
+    start = now_ns();
+    deadline = start + (uint64_t)config.seconds * 1000000000ull;
+    do {
+        for (int i = 0; i < 256; i++, opens++) {
+            if (open_sign_close(0) != 0) {
+                perror("open /dev/ptrauth");
+                _exit(1);
+            }
+        }
+    } while (now_ns() < deadline);
+
+    results->open_close_per_sec = opens / ((now_ns() - start) / 1e9);
+}
+
+static void bench_open_worker(void) {
+    long n = config.iterations / 10 > 0 ? config.iterations / 10 : 1;
+    int status;
+
+    pin(config.cpu);
+
+    uint64_t start = now_ns();
+    for (long i = 0; i < n; i++) {
+        pid_t pid = fork();
+        if (pid < 0)
+            _exit(1);
+        if (pid == 0)
+            _exit(open_sign_close(1) == 0 ? 0 : 1);
+        if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "worker failed\n");
+            _exit(1);
+        }
+    }
+
+    results->open_worker_per_sec = n / ((now_ns() - start) / 1e9);
+}
+
+// ==== Report ====
+
+// ==== Callbacks ====
+
+#define CALLBACKS 16
+
+static volatile uint64_t callback_sink;
+
+static void callback_add(uint64_t v) { callback_sink += v; }
+static void callback_xor(uint64_t v) { callback_sink ^= v; }
+static void callback_rol(uint64_t v) { callback_sink = (callback_sink << 1 | callback_sink >> 63) + v; }
+
+// Event loop pattern: every dispatch stores the handler signed, as a
+// callback registration would, then authenticates it and calls it. The
+// same few (pointer, tweak) pairs are signed over and over.
+static double callback_rate(uint64_t (*sign)(uint64_t, uint64_t)) {
+    void (*handlers[CALLBACKS])(uint64_t);
+    uint64_t deadline, start, calls = 0;
+
+    for (int i = 0; i < CALLBACKS; i++)
+        handlers[i] = i % 3 == 0 ? callback_add : i % 3 == 1 ? callback_xor : callback_rol;
+
+    start = now_ns();
+    deadline = start + (uint64_t)config.seconds * 1000000000ull;
+    do {
+        for (int i = 0; i < 1024; i++, calls++) {
+            int slot = calls % CALLBACKS;
+            uint64_t signed_ptr = sign((uintptr_t)handlers[slot], slot);
+            void (*fn)(uint64_t) = (void (*)(uint64_t))(uintptr_t)ptrauth_auth(signed_ptr, slot);
+
+            if (fn == NULL) {
+                fprintf(stderr, "callback %d failed to authenticate\n", slot);
+                _exit(1);
+            }
+            fn(calls);
+        }
+    } while (now_ns() < deadline);
+
+    return calls / ((now_ns() - start) / 1e9);
+}
+
+static void bench_callback(void) {
+    init_device();
+    pin(config.cpu);
+
+    results->callback_uncached_per_sec = callback_rate(ptrauth_sign);
+    results->callback_cached_per_sec = callback_rate(ptrauth_sign_cached);
+}
+
+// ==== Key rotation ====
+
+static uint64_t rotate(void) {
+    uint64_t start = now_ns();
+
+    if (ptrauth_rotate_key(NULL) != 0) {
+        perror("ptrauth_rotate_key");
+        _exit(1);
+    }
+
+    return now_ns() - start;
+}
+
+// Authenticate every slot, returns the time taken
+static uint64_t auth_pass(uint64_t *slots, const uint64_t *pointers, long count) {
+    uint64_t start = now_ns();
+
+    for (long i = 0; i < count; i++) {
+        if (ptrauth_auth_slot(&slots[i], i) != pointers[i]) {
+            fprintf(stderr, "pointer %ld failed to authenticate\n", i);
+            _exit(1);
+        }
+    }
+
+    return now_ns() - start;
+}
+
+static void bench_rotate(void) {
+    init_device();
+    pin(config.cpu);
+
+    for (int size = 0; size < ROTATE_SIZES; size++) {
+        long count = rotate_pointers[size];
+        uint64_t *pointers = malloc(count * sizeof(*pointers));
+        uint64_t *slots = malloc(count * sizeof(*slots));
+        struct ptrauth_op *ops = malloc(count * sizeof(*ops));
+
+        if (pointers == NULL || slots == NULL || ops == NULL) {
+            perror("malloc");
+            _exit(1);
+        }
+
+        // Distinct pointers, as a table of objects would hold
+        for (long i = 0; i < count; i++) {
+            pointers[i] = 0x400000 + i * 64;
+            ops[i] = (struct ptrauth_op){ .pointer = pointers[i], .tweak = i };
+        }
+        if (ptrauth_sign_many(ops, count) != 0) {
+            perror("ptrauth_sign_many");
+            _exit(1);
+        }
+        for (long i = 0; i < count; i++)
+            slots[i] = ops[i].result;
+
+        results->rotate[size].pointers = count;
+        results->rotate[size].rotate_ns = rotate();
+        results->rotate[size].lazy_pass_ns = auth_pass(slots, pointers, count);
+        results->rotate[size].steady_pass_ns = auth_pass(slots, pointers, count);
+
+        // Eagerly, everything is re-signed right after the rotation
+        rotate();
+        uint64_t start = now_ns();
+        for (long i = 0; i < count; i++)
+            ops[i] = (struct ptrauth_op){ .pointer = slots[i], .tweak = i };
+        if (ptrauth_resign_many(ops, count) != 0) {
+            perror("ptrauth_resign_many");
+            _exit(1);
+        }
+        for (long i = 0; i < count; i++)
+            slots[i] = ops[i].result;
+        results->rotate[size].eager_resign_ns = now_ns() - start;
+
+        // Exits if any pointer was lost
+        auth_pass(slots, pointers, count);
+
+        free(ops);
+        free(slots);
+        free(pointers);
+    }
+}
+
+static void print_latency(FILE *out, const char *name, const struct latency *lat, int last) {
+    fprintf(out, "    \"%s\": { \"samples\": %llu, \"min_ns\": %llu, \"p50_ns\": %llu, "
+                 "\"p99_ns\": %llu, \"p999_ns\": %llu, \"max_ns\": %llu, \"mean_ns\": %.1f }%s\n",
+            name, (unsigned long long)lat->samples, (unsigned long long)lat->min,
+            (unsigned long long)lat->p50, (unsigned long long)lat->p99,
+            (unsigned long long)lat->p999, (unsigned long long)lat->max,
+            lat->mean, last ? "" : ",");
+}
+
+static int enabled(const char *name) {
+    return strcmp(config.benchmark, "all") == 0 || strcmp(config.benchmark, name) == 0;
+}
+
+int main(int argc, char **argv) {
+    const char *output = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:n:t:p:c:o:")) != -1) {
+        switch (opt) {
+        case 'b': config.benchmark = optarg; break;
+        case 'n': config.iterations = atol(optarg); break;
+        case 't': config.seconds = atoi(optarg); break;
+        case 'p': config.processes = atoi(optarg); break;
+        case 'c': config.cpu = atoi(optarg); break;
+        case 'o': output = optarg; break;
+        default:
+            fprintf(stderr, "usage: %s [-b all|latency|throughput|switch|fork|open|callback|rotate] [-n iterations]\n"
+                            "       [-t seconds] [-p processes] [-c cpu] [-o file]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (config.processes <= 0)
+        config.processes = cpus;
+    if (config.processes > 256)
+        config.processes = 256;
+    if (config.iterations < 2)
+        config.iterations = 2;
+
+    results = mmap(NULL, sizeof(*results), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (results == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    // Query the driver without keeping a key
+    struct ptrauth_info info = { .engine = PTRAUTH_ENGINE_HW };
+    int fd = open("/dev/ptrauth", O_RDWR);
+    if (fd < 0) {
+        perror("open /dev/ptrauth");
+        return 1;
+    }
+    (void)ioctl(fd, PTRAUTH_IOC_GET_INFO, &info);
+    close(fd);
+
+    if (enabled("latency"))
+        run_child(bench_latency);
+    if (enabled("throughput")) {
+        run_child(bench_throughput_single);
+        run_child(bench_throughput_multi);
+    }
+    if (enabled("switch")) {
+        run_child(bench_switch_unkeyed);
+        run_child(bench_switch_keyed);
+    }
+    if (enabled("fork")) {
+        run_child(bench_fork_unkeyed);
+        run_child(bench_fork_keyed);
+    }
+    if (enabled("open")) {
+        run_child(bench_open_close);
+        run_child(bench_open_worker);
+    }
+    if (enabled("callback"))
+        run_child(bench_callback);
+    if (enabled("rotate"))
+        run_child(bench_rotate);
+
+    FILE *out = stdout;
+    if (output != NULL && (out = fopen(output, "w")) == NULL) {
+        perror(output);
+        return 1;
+    }
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"engine\": \"%s\",\n", info.engine == PTRAUTH_ENGINE_SOFT ? "soft" : "hw");
+    fprintf(out, "  \"lazy_keys\": %s,\n", info.flags & PTRAUTH_INFO_LAZY_KEYS ? "true" : "false");
+    fprintf(out, "  \"cpus\": %ld,\n", cpus);
+    fprintf(out, "  \"iterations\": %ld,\n", config.iterations);
+
+    if (enabled("latency")) {
+        fprintf(out, "  \"latency\": {\n");
+        print_latency(out, "timer", &results->timer, 0);
+        print_latency(out, "sign", &results->sign, 0);
+        print_latency(out, "auth", &results->auth, 1);
+        fprintf(out, "  },\n");
+    }
+
+    if (enabled("throughput")) {
+        uint64_t multi_ops = 0;
+        for (int i = 0; i < config.processes; i++)
+            multi_ops += results->multi_ops[i];
+
+        fprintf(out, "  \"throughput\": {\n");
+        fprintf(out, "    \"single\": { \"ops\": %llu, \"seconds\": %.3f, \"ops_per_sec\": %.0f },\n",
+                (unsigned long long)results->single_ops, results->single_seconds,
+                results->single_ops / results->single_seconds);
+        fprintf(out, "    \"multi\": { \"processes\": %d, \"ops\": %llu, \"seconds\": %.3f, \"ops_per_sec\": %.0f }\n",
+                config.processes, (unsigned long long)multi_ops, results->multi_seconds,
+                multi_ops / results->multi_seconds);
+        fprintf(out, "  },\n");
+    }
+
+    if (enabled("switch")) {
+        fprintf(out, "  \"switch\": { \"unkeyed_ns\": %.1f, \"keyed_ns\": %.1f, \"overhead_ns\": %.1f },\n",
+                results->switch_unkeyed_ns, results->switch_keyed_ns,
+                results->switch_keyed_ns - results->switch_unkeyed_ns);
+    }
+
+    if (enabled("fork")) {
+        fprintf(out, "  \"fork\": { \"unkeyed_per_sec\": %.0f, \"keyed_per_sec\": %.0f },\n",
+                results->fork_unkeyed_per_sec, results->fork_keyed_per_sec);
+    }
+
+    if (enabled("open")) {
+        fprintf(out, "  \"open\": { \"open_close_per_sec\": %.0f, \"worker_per_sec\": %.0f },\n",
+                results->open_close_per_sec, results->open_worker_per_sec);
+    }
+
+    if (enabled("callback")) {
+        fprintf(out, "  \"callback\": { \"uncached_per_sec\": %.0f, \"cached_per_sec\": %.0f, \"speedup\": %.2f },\n",
+                results->callback_uncached_per_sec, results->callback_cached_per_sec,
+                results->callback_cached_per_sec / results->callback_uncached_per_sec);
+    }
+
+    if (enabled("rotate")) {
+        fprintf(out, "  \"rotate\": [\n");
+        for (int size = 0; size < ROTATE_SIZES; size++) {
+            long count = results->rotate[size].pointers;
+
+            fprintf(out, "    { \"pointers\": %ld, \"rotate_ns\": %.0f, \"lazy_pass_ns\": %.0f, "
+                         "\"steady_pass_ns\": %.0f, \"eager_resign_ns\": %.0f, \"lazy_per_pointer_ns\": %.1f }%s\n",
+                    count, results->rotate[size].rotate_ns, results->rotate[size].lazy_pass_ns,
+                    results->rotate[size].steady_pass_ns, results->rotate[size].eager_resign_ns,
+                    (results->rotate[size].lazy_pass_ns - results->rotate[size].steady_pass_ns) / count,
+                    size == ROTATE_SIZES - 1 ? "" : ",");
+        }
+        fprintf(out, "  ],\n");
+    }
+
+    fprintf(out, "  \"benchmark\": \"%s\"\n", config.benchmark);
+    fprintf(out, "}\n");
+
+    if (out != stdout)
+        fclose(out);
+
+    return 0;
+}
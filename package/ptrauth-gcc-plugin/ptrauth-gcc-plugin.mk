@@ -0,0 +1,27 @@
+################################################################################
+#
+# ptrauth-gcc-plugin
+#
+################################################################################
+
+PTRAUTH_GCC_PLUGIN_VERSION = 1.0
+PTRAUTH_GCC_PLUGIN_SITE = package/ptrauth-gcc-plugin/src
+PTRAUTH_GCC_PLUGIN_SITE_METHOD = local
+PTRAUTH_GCC_PLUGIN_LICENSE = GPL-3.0+
+
+# Built against the plugin headers of the cross-compiler, and installed in
+# its plugin directory so that -fplugin=ptrauth finds it by name. Packages
+# opt in with <PKG>_PTRAUTH_INSTRUMENT, see pkg-generic.mk.
+HOST_PTRAUTH_GCC_PLUGIN_DEPENDENCIES = toolchain
+
+define HOST_PTRAUTH_GCC_PLUGIN_BUILD_CMDS
+	$(HOST_MAKE_ENV) $(MAKE) $(HOST_CONFIGURE_OPTS) \
+		PLUGIN_DIR="`$(TARGET_CC) -print-file-name=plugin`" -C $(@D)
+endef
+
+define HOST_PTRAUTH_GCC_PLUGIN_INSTALL_CMDS
+	$(INSTALL) -D -m 0755 $(@D)/ptrauth.so \
+		"`$(TARGET_CC) -print-file-name=plugin`/ptrauth.so"
+endef
+
+$(eval $(host-generic-package))
@@ -0,0 +1,696 @@
+// GCC plugin signing function pointers with /dev/ptrauth.
+//
+// Function pointers are kept signed in memory and plain in registers. On
+// GIMPLE, right after the functions are put in SSA form:
+//
+//  - every store of a function pointer to memory (`s->cb = handler;`,
+//    `*slot = fp;`) stores __ptrauth_instrument_sign(value, tweak) instead,
+//  - every load of a function pointer from memory goes through
+//    __ptrauth_instrument_auth(value, tweak),
+//  - function pointers set by static initializers are listed in the
+//    `ptrauth_slots` section, and signed in place by a constructor,
+//  - function pointer parameters whose address is taken are signed on
+//    entry, as they live in memory from then on.
+//
+// Indirect calls thus use the authenticated value. Only pointers to
+// functions are concerned: C++ vtables and pointers to member functions
+// are left alone. Vtable entries have the type of `int (*)()`, they are
+// told apart by where they are loaded from and how they are called.
+//
+// The runtime fails closed: a pointer stored without a signature, by
+// uninstrumented code or through another type (e.g. the
+// `*(void **)&fp = dlsym(...)` idiom), aborts the process when loaded. For
+// the same reason a signed pointer must not be loaded by uninstrumented
+// code, which is why the instrumentation is enabled per package.
+//
+// With -fplugin-arg-ptrauth-batch, stores of a function address do not
+// sign: every function whose address is stored gets a hidden variable in
+// the `ptrauth_fns` section holding its address, the constructor signs the
+// whole section at startup with one batched request, and stores copy the
+// signed value from there.
+//
+// Options, as -fplugin-arg-ptrauth-<option>:
+//  batch        sign address-taken functions from a constructor
+//  tweak=<n>    tweak used for function pointers (default 0x6670)
+//  verbose      report the number of rewritten statements per unit
+//
+// Functions with __attribute__((no_instrument_function)) are left alone.
+
+#include "gcc-plugin.h"
+#include "plugin-version.h"
+#include "tree.h"
+#include "function.h"
+#include "basic-block.h"
+#include "tree-pass.h"
+#include "context.h"
+#include "stringpool.h"
+#include "attribs.h"
+#include "fold-const.h"
+#include "varasm.h"
+#include "tree-ssa-alias.h"
+#include "gimple-expr.h"
+#include "gimple.h"
+#include "gimple-iterator.h"
+#include "gimple-ssa.h"
+#include "tree-ssanames.h"
+#include "ssa-iterators.h"
+#include "tree-into-ssa.h"
+#include "tree-iterator.h"
+#include "tree-cfg.h"
+#include "cgraph.h"
+#include "ipa-utils.h"
+#include "diagnostic.h"
+
+int plugin_is_GPL_compatible;
+
+#define PTRAUTH_FNPTR_TWEAK 0x6670
+#define PTRAUTH_FNS_SECTION "ptrauth_fns"
+#define PTRAUTH_SLOTS_SECTION "ptrauth_slots"
+// The first priority available to programs: static tables are signed
+// before the constructors of the program may call through them
+#define PTRAUTH_INIT_PRIORITY 101
+
+static struct plugin_info ptrauth_plugin_info = {
+    "1.0",
+    "Sign function pointers with /dev/ptrauth\n"
+    "  -fplugin-arg-ptrauth-batch      sign address-taken functions at startup\n"
+    "  -fplugin-arg-ptrauth-tweak=<n>  tweak of function pointers\n"
+    "  -fplugin-arg-ptrauth-verbose    report rewritten statements\n",
+};
+
+static struct {
+    bool batch;
+    bool verbose;
+    unsigned HOST_WIDE_INT tweak;
+} config = {
+    false,
+    false,
+    PTRAUTH_FNPTR_TWEAK,
+};
+
+// ==== Runtime ====
+
+// Entry points in libptrauth, see "Compiler instrumentation" there
+static tree sign_decl;
+static tree auth_decl;
+static tree sign_section_decl;
+static tree sign_slots_decl;
+
+static tree ptrauth_runtime_decl(const char *name, tree type) {
+    tree decl = build_fn_decl(name, type);
+
+    // The calls never throw, so they do not end their basic block
+    TREE_NOTHROW(decl) = 1;
+    DECL_VISIBILITY(decl) = VISIBILITY_DEFAULT;
+
+    return decl;
+}
+
+static void ptrauth_build_runtime(void) {
+    tree u64 = uint64_type_node;
+    tree u64_ptr = build_pointer_type(u64);
+
+    sign_decl = ptrauth_runtime_decl("__ptrauth_instrument_sign",
+                                     build_function_type_list(u64, u64, u64, NULL_TREE));
+    auth_decl = ptrauth_runtime_decl("__ptrauth_instrument_auth",
+                                     build_function_type_list(u64, u64, u64, NULL_TREE));
+    sign_section_decl = ptrauth_runtime_decl("__ptrauth_instrument_sign_section",
+                                             build_function_type_list(void_type_node, u64_ptr, u64_ptr,
+                                                                      u64, NULL_TREE));
+    sign_slots_decl = ptrauth_runtime_decl("__ptrauth_instrument_sign_slots",
+                                           build_function_type_list(void_type_node, build_pointer_type(u64_ptr),
+                                                                    build_pointer_type(u64_ptr), u64, NULL_TREE));
+}
+
+// ==== Rewriting ====
+
+struct ptrauth_counts {
+    unsigned int stores;
+    unsigned int loads;
+    unsigned int slots;
+};
+
+static tree ptrauth_tweak(void) {
+    return build_int_cst(uint64_type_node, config.tweak);
+}
+
+// Pointers to functions, which are signed in memory. Pointers to member
+// functions (METHOD_TYPE) are not, vtable entries are by their type but
+// never signed, see ptrauth_is_vtable_load().
+static bool ptrauth_is_fnptr_type(tree type) {
+    return TREE_CODE(type) == POINTER_TYPE && TREE_CODE(TREE_TYPE(type)) == FUNCTION_TYPE;
+}
+
+// Whether the address `addr` points into a vtable: the address of a vtable,
+// or the vtable pointer of an object (`this->_vptr.A`), possibly moved to
+// one of its entries
+static bool ptrauth_is_vtable_address(tree addr) {
+    for (;;) {
+        if (TREE_CODE(addr) == ADDR_EXPR) {
+            tree base = get_base_address(TREE_OPERAND(addr, 0));
+
+            return base != NULL_TREE && VAR_P(base) && DECL_VIRTUAL_P(base);
+        }
+        if (TREE_CODE(addr) != SSA_NAME)
+            return false;
+
+        gimple *def = SSA_NAME_DEF_STMT(addr);
+
+        if (!is_gimple_assign(def))
+            return false;
+
+        switch (gimple_assign_rhs_code(def)) {
+        case POINTER_PLUS_EXPR:
+        case SSA_NAME:
+        CASE_CONVERT:
+            addr = gimple_assign_rhs1(def);
+            break;
+        case COMPONENT_REF:
+            return DECL_VIRTUAL_P(TREE_OPERAND(gimple_assign_rhs1(def), 1));
+        default:
+            return false;
+        }
+    }
+}
+
+// Loads of vtable entries, which are never signed. The C++ front end gives
+// them the type of `int (*)()`, shared with the function pointers of the
+// program, so they are recognized by the memory they are loaded from, or
+// else by the virtual call (OBJ_TYPE_REF) they are used in.
+static bool ptrauth_is_vtable_load(gimple *stmt) {
+    tree base = get_base_address(gimple_assign_rhs1(stmt));
+    tree lhs = gimple_assign_lhs(stmt);
+    imm_use_iterator iter;
+    use_operand_p use;
+
+    if (base != NULL_TREE && VAR_P(base) && DECL_VIRTUAL_P(base))
+        return true;
+    if (base != NULL_TREE && TREE_CODE(base) == MEM_REF && ptrauth_is_vtable_address(TREE_OPERAND(base, 0)))
+        return true;
+
+    if (TREE_CODE(lhs) != SSA_NAME)
+        return false;
+
+    FOR_EACH_IMM_USE_FAST(use, iter, lhs) {
+        gimple *use_stmt = USE_STMT(use);
+
+        if (is_gimple_call(use_stmt) && gimple_call_fn(use_stmt) != NULL_TREE &&
+            TREE_CODE(gimple_call_fn(use_stmt)) == OBJ_TYPE_REF)
+            return true;
+    }
+
+    return false;
+}
+
+// Append `result = (type)value` to seq, with a new SSA name if result is
+// NULL_TREE
+static tree ptrauth_convert(gimple_seq *seq, location_t loc, tree type, tree value, tree result) {
+    if (result == NULL_TREE)
+        result = make_ssa_name(type);
+
+    gassign *assign = gimple_build_assign(result, NOP_EXPR, value);
+
+    gimple_set_location(assign, loc);
+    gimple_seq_add_stmt(seq, assign);
+
+    return result;
+}
+
+// Append `result = (type)fn((uint64_t)value, tweak)` to seq
+static tree ptrauth_runtime_call(gimple_seq *seq, location_t loc, tree fn, tree value, tree result) {
+    tree type = TREE_TYPE(value);
+    tree ret = make_ssa_name(uint64_type_node);
+    gcall *call = gimple_build_call(fn, 2, ptrauth_convert(seq, loc, uint64_type_node, value, NULL_TREE),
+                                    ptrauth_tweak());
+
+    gimple_call_set_lhs(call, ret);
+    gimple_set_location(call, loc);
+    gimple_seq_add_stmt(seq, call);
+
+    return ptrauth_convert(seq, loc, type, ret, result);
+}
+
+// Batch mode: hidden variable holding the address of `fndecl`, signed by
+// the constructor. One per function and unit.
+static hash_map<tree, tree> *signed_vars;
+static unsigned int signed_var_count;
+
+static tree ptrauth_signed_var(tree fndecl) {
+    tree *slot = signed_vars->get(fndecl);
+    char name[32];
+
+    if (slot != NULL)
+        return *slot;
+
+    snprintf(name, sizeof(name), "__ptrauth_fn.%u", signed_var_count++);
+
+    tree type = build_pointer_type(TREE_TYPE(fndecl));
+    tree var = build_decl(DECL_SOURCE_LOCATION(fndecl), VAR_DECL, get_identifier(name), type);
+
+    TREE_STATIC(var) = 1;
+    TREE_PUBLIC(var) = 0;
+    TREE_USED(var) = 1;
+    DECL_ARTIFICIAL(var) = 1;
+    DECL_IGNORED_P(var) = 1;
+    // Kept even once no store refers to it, the section is walked as a whole
+    DECL_PRESERVE_P(var) = 1;
+    // The section is read as an array of 64-bit words
+    SET_DECL_ALIGN(var, TYPE_ALIGN(uint64_type_node));
+    DECL_USER_ALIGN(var) = 1;
+    DECL_INITIAL(var) = build_fold_addr_expr(fndecl);
+    set_decl_section_name(var, PTRAUTH_FNS_SECTION);
+
+    varpool_node::finalize_decl(var);
+    signed_vars->put(fndecl, var);
+
+    return var;
+}
+
+static bool ptrauth_is_function_address(tree t) {
+    return TREE_CODE(t) == ADDR_EXPR && TREE_CODE(TREE_OPERAND(t, 0)) == FUNCTION_DECL;
+}
+
+// Append to seq the computation of the value to store instead of `value`
+static tree ptrauth_signed_value(gimple_seq *seq, location_t loc, tree value) {
+    if (!config.batch || !ptrauth_is_function_address(value))
+        return ptrauth_runtime_call(seq, loc, sign_decl, value, NULL_TREE);
+
+    tree var = ptrauth_signed_var(TREE_OPERAND(value, 0));
+    tree signed_value = make_ssa_name(TREE_TYPE(var));
+    gassign *load = gimple_build_assign(signed_value, var);
+
+    gimple_set_location(load, loc);
+    gimple_seq_add_stmt(seq, load);
+
+    if (!useless_type_conversion_p(TREE_TYPE(value), TREE_TYPE(signed_value)))
+        signed_value = ptrauth_convert(seq, loc, TREE_TYPE(value), signed_value, NULL_TREE);
+
+    return signed_value;
+}
+
+// Insert seq right after the statement at gsi, which is left on the last
+// inserted statement. Statements that can throw end their basic block, the
+// code then goes on the fall-through edge.
+static void ptrauth_insert_after(gimple_stmt_iterator *gsi, gimple_seq seq) {
+    gimple *stmt = gsi_stmt(*gsi);
+
+    if (!stmt_ends_bb_p(stmt)) {
+        gsi_insert_seq_after(gsi, seq, GSI_CONTINUE_LINKING);
+        return;
+    }
+
+    gsi_insert_seq_on_edge_immediate(find_fallthru_edge(gimple_bb(stmt)->succs), seq);
+}
+
+static bool ptrauth_instrument_stmt(gimple_stmt_iterator *gsi, struct ptrauth_counts *counts) {
+    gimple *stmt = gsi_stmt(*gsi);
+    location_t loc = gimple_location(stmt);
+    gimple_seq seq = NULL;
+
+    if (!gimple_assign_single_p(stmt) || gimple_clobber_p(stmt) ||
+        !ptrauth_is_fnptr_type(TREE_TYPE(gimple_assign_lhs(stmt))))
+        return false;
+
+    // s->cb = fp;
+    if (gimple_store_p(stmt)) {
+        tree rhs = gimple_assign_rhs1(stmt);
+
+        // NULL is stored as it is
+        if (integer_zerop(rhs))
+            return false;
+
+        gimple_assign_set_rhs1(stmt, ptrauth_signed_value(&seq, loc, rhs));
+        gsi_insert_seq_before(gsi, seq, GSI_SAME_STMT);
+        update_stmt(stmt);
+        counts->stores++;
+        return true;
+    }
+
+    // fp = s->cb;
+    if (gimple_assign_load_p(stmt) && !ptrauth_is_vtable_load(stmt)) {
+        tree lhs = gimple_assign_lhs(stmt);
+        tree loaded = make_ssa_name(TREE_TYPE(lhs));
+
+        gimple_assign_set_lhs(stmt, loaded);
+        update_stmt(stmt);
+        ptrauth_runtime_call(&seq, loc, auth_decl, loaded, lhs);
+        ptrauth_insert_after(gsi, seq);
+        counts->loads++;
+        return true;
+    }
+
+    return false;
+}
+
+// A parameter whose address is taken lives in memory, where it must be
+// signed like any other function pointer: sign the value passed by the
+// caller on entry
+static bool ptrauth_sign_parms(struct ptrauth_counts *counts) {
+    gimple_seq seq = NULL;
+
+    for (tree parm = DECL_ARGUMENTS(current_function_decl); parm != NULL_TREE; parm = DECL_CHAIN(parm)) {
+        if (!TREE_ADDRESSABLE(parm) || !ptrauth_is_fnptr_type(TREE_TYPE(parm)))
+            continue;
+
+        location_t loc = DECL_SOURCE_LOCATION(parm);
+        tree value = make_ssa_name(TREE_TYPE(parm));
+        gassign *load = gimple_build_assign(value, parm);
+
+        gimple_set_location(load, loc);
+        gimple_seq_add_stmt(&seq, load);
+
+        gassign *store = gimple_build_assign(parm, ptrauth_runtime_call(&seq, loc, sign_decl, value, NULL_TREE));
+
+        gimple_set_location(store, loc);
+        gimple_seq_add_stmt(&seq, store);
+        counts->stores++;
+    }
+
+    if (seq == NULL)
+        return false;
+
+    gsi_insert_seq_on_edge_immediate(single_succ_edge(ENTRY_BLOCK_PTR_FOR_FN(cfun)), seq);
+
+    return true;
+}
+
+static bool ptrauth_instrument_function(struct ptrauth_counts *counts) {
+    basic_block bb;
+    bool changed = false;
+
+    FOR_EACH_BB_FN(bb, cfun) {
+        for (gimple_stmt_iterator gsi = gsi_start_bb(bb); !gsi_end_p(gsi); gsi_next(&gsi)) {
+            if (ptrauth_instrument_stmt(&gsi, counts))
+                changed = true;
+        }
+    }
+
+    // Last, the loads of the parameters on entry are not authenticated
+    if (ptrauth_sign_parms(counts))
+        changed = true;
+
+    return changed;
+}
+
+// ==== Static initializers ====
+
+// Offsets in bytes, from the start of the variable, of the function
+// pointers other than NULL set by `init`, the initializer of an object of
+// type `type` at `offset`
+static void ptrauth_collect_fnptrs(tree type, tree init, HOST_WIDE_INT offset, vec<HOST_WIDE_INT> *offsets) {
+    if (init == NULL_TREE || init == error_mark_node)
+        return;
+
+    if (TREE_CODE(init) != CONSTRUCTOR) {
+        if (ptrauth_is_fnptr_type(type) && !integer_zerop(init))
+            offsets->safe_push(offset);
+        return;
+    }
+
+    unsigned HOST_WIDE_INT i;
+    tree index, value;
+
+    if (TREE_CODE(type) == ARRAY_TYPE) {
+        tree elt_type = TREE_TYPE(type);
+        tree domain = TYPE_DOMAIN(type);
+        HOST_WIDE_INT size = int_size_in_bytes(elt_type);
+        HOST_WIDE_INT min = 0, next = 0;
+
+        if (size <= 0)
+            return;
+        if (domain != NULL_TREE && TYPE_MIN_VALUE(domain) != NULL_TREE && tree_fits_shwi_p(TYPE_MIN_VALUE(domain)))
+            min = tree_to_shwi(TYPE_MIN_VALUE(domain));
+
+        FOR_EACH_CONSTRUCTOR_ELT(CONSTRUCTOR_ELTS(init), i, index, value) {
+            HOST_WIDE_INT low = next, high = next;
+
+            // Elements without index follow the previous one, ranges come
+            // from designated initializers ([0 ... 3] = fn)
+            if (index != NULL_TREE && TREE_CODE(index) == RANGE_EXPR) {
+                if (!tree_fits_shwi_p(TREE_OPERAND(index, 0)) || !tree_fits_shwi_p(TREE_OPERAND(index, 1)))
+                    continue;
+                low = tree_to_shwi(TREE_OPERAND(index, 0)) - min;
+                high = tree_to_shwi(TREE_OPERAND(index, 1)) - min;
+            } else if (index != NULL_TREE) {
+                if (!tree_fits_shwi_p(index))
+                    continue;
+                low = high = tree_to_shwi(index) - min;
+            }
+
+            for (HOST_WIDE_INT j = low; j <= high; j++)
+                ptrauth_collect_fnptrs(elt_type, value, offset + j * size, offsets);
+            next = high + 1;
+        }
+        return;
+    }
+
+    // Structures and unions
+    FOR_EACH_CONSTRUCTOR_ELT(CONSTRUCTOR_ELTS(init), i, index, value) {
+        if (index == NULL_TREE || TREE_CODE(index) != FIELD_DECL || DECL_BIT_FIELD(index))
+            continue;
+
+        HOST_WIDE_INT position = int_byte_position(index);
+
+        if (position >= 0)
+            ptrauth_collect_fnptrs(TREE_TYPE(index), value, offset + position, offsets);
+    }
+}
+
+// Sections walked by the C library or the dynamic loader, which call what
+// they hold without authentication
+static bool ptrauth_is_runtime_section(tree decl) {
+    static const char *const prefixes[] = { ".init_array", ".fini_array", ".preinit_array", ".ctors", ".dtors" };
+    const char *section = DECL_SECTION_NAME(decl);
+
+    if (section == NULL)
+        return false;
+
+    for (size_t i = 0; i < ARRAY_SIZE(prefixes); i++) {
+        if (!strncmp(section, prefixes[i], strlen(prefixes[i])))
+            return true;
+    }
+
+    return false;
+}
+
+// Hidden variable of the `ptrauth_slots` section holding the address of
+// the function pointer at `offset` in `decl`
+static unsigned int slot_var_count;
+
+static void ptrauth_slot_var(tree decl, HOST_WIDE_INT offset) {
+    char name[32];
+
+    snprintf(name, sizeof(name), "__ptrauth_slot.%u", slot_var_count++);
+
+    tree var = build_decl(DECL_SOURCE_LOCATION(decl), VAR_DECL, get_identifier(name), ptr_type_node);
+
+    TREE_STATIC(var) = 1;
+    TREE_PUBLIC(var) = 0;
+    TREE_USED(var) = 1;
+    DECL_ARTIFICIAL(var) = 1;
+    DECL_IGNORED_P(var) = 1;
+    DECL_PRESERVE_P(var) = 1;
+    SET_DECL_ALIGN(var, TYPE_ALIGN(ptr_type_node));
+    DECL_USER_ALIGN(var) = 1;
+    DECL_INITIAL(var) = fold_build_pointer_plus_hwi(fold_convert(ptr_type_node, build_fold_addr_expr(decl)), offset);
+    set_decl_section_name(var, PTRAUTH_SLOTS_SECTION);
+
+    varpool_node::finalize_decl(var);
+}
+
+// List the function pointers set by the initializers of the variables
+// defined in the unit, for the constructor to sign them
+static void ptrauth_sign_initializers(struct ptrauth_counts *counts) {
+    auto_vec<tree> decls;
+    varpool_node *vnode;
+    unsigned int i;
+    tree decl;
+
+    // Collected first, the slot variables are added to the same list
+    FOR_EACH_DEFINED_VARIABLE(vnode) {
+        if (!vnode->alias)
+            decls.safe_push(vnode->decl);
+    }
+
+    FOR_EACH_VEC_ELT(decls, i, decl) {
+        auto_vec<HOST_WIDE_INT> offsets;
+        HOST_WIDE_INT offset;
+        unsigned int j;
+
+        // Vtables are never signed
+        if (DECL_VIRTUAL_P(decl) || ptrauth_is_runtime_section(decl))
+            continue;
+
+        ptrauth_collect_fnptrs(TREE_TYPE(decl), DECL_INITIAL(decl), 0, &offsets);
+        if (offsets.is_empty())
+            continue;
+
+        if (DECL_THREAD_LOCAL_P(decl)) {
+            sorry_at(DECL_SOURCE_LOCATION(decl), "ptrauth: function pointers in the initializer of thread-local %qD",
+                     decl);
+            continue;
+        }
+
+        // Signed in place at startup: out of read-only data, and never
+        // folded to the unsigned initializer
+        TREE_READONLY(decl) = 0;
+        TREE_ADDRESSABLE(decl) = 1;
+
+        FOR_EACH_VEC_ELT(offsets, j, offset)
+            ptrauth_slot_var(decl, offset);
+        counts->slots += offsets.length();
+    }
+}
+
+// Address of the symbol the linker defines at the start or the end of
+// `section`, in each module
+static tree ptrauth_section_bound(const char *prefix, const char *section, tree type) {
+    char name[64];
+
+    snprintf(name, sizeof(name), "%s%s", prefix, section);
+
+    tree decl = build_decl(UNKNOWN_LOCATION, VAR_DECL, get_identifier(name), type);
+
+    DECL_EXTERNAL(decl) = 1;
+    TREE_PUBLIC(decl) = 1;
+    TREE_STATIC(decl) = 0;
+    DECL_ARTIFICIAL(decl) = 1;
+    // Never resolved in another module
+    DECL_VISIBILITY(decl) = VISIBILITY_HIDDEN;
+    DECL_VISIBILITY_SPECIFIED(decl) = 1;
+
+    return build_fold_addr_expr(decl);
+}
+
+// Constructor signing the `ptrauth_slots` section and, in batch mode, the
+// `ptrauth_fns` section of the module the unit is linked into. Every unit
+// emits one; the runtime skips the entries that are already signed.
+static void ptrauth_build_constructor(void) {
+    tree body = NULL_TREE;
+
+    if (slot_var_count > 0) {
+        tree type = build_pointer_type(uint64_type_node);
+
+        append_to_statement_list(build_call_expr(sign_slots_decl, 3,
+                                                 ptrauth_section_bound("__start_", PTRAUTH_SLOTS_SECTION, type),
+                                                 ptrauth_section_bound("__stop_", PTRAUTH_SLOTS_SECTION, type),
+                                                 ptrauth_tweak()),
+                                 &body);
+    }
+
+    if (signed_var_count > 0) {
+        append_to_statement_list(build_call_expr(sign_section_decl, 3,
+                                                 ptrauth_section_bound("__start_", PTRAUTH_FNS_SECTION, uint64_type_node),
+                                                 ptrauth_section_bound("__stop_", PTRAUTH_FNS_SECTION, uint64_type_node),
+                                                 ptrauth_tweak()),
+                                 &body);
+    }
+
+    if (body != NULL_TREE)
+        cgraph_build_static_cdtor('I', body, PTRAUTH_INIT_PRIORITY);
+}
+
+// ==== Pass ====
+
+namespace {
+
+const pass_data ptrauth_pass_data = {
+    SIMPLE_IPA_PASS,    // type
+    "ptrauth",          // name
+    OPTGROUP_NONE,      // optinfo_flags
+    TV_NONE,            // tv_id
+    0,                  // properties_required
+    0,                  // properties_provided
+    0,                  // properties_destroyed
+    0,                  // todo_flags_start
+    0,                  // todo_flags_finish
+};
+
+class ptrauth_pass : public simple_ipa_opt_pass {
+public:
+    ptrauth_pass(gcc::context *ctxt) : simple_ipa_opt_pass(ptrauth_pass_data, ctxt) {}
+
+    bool gate(function *) final override { return !seen_error(); }
+    unsigned int execute(function *) final override;
+};
+
+unsigned int ptrauth_pass::execute(function *) {
+    struct ptrauth_counts counts = { 0, 0, 0 };
+    cgraph_node *node;
+
+    ptrauth_build_runtime();
+    signed_vars = new hash_map<tree, tree>;
+    signed_var_count = 0;
+    slot_var_count = 0;
+
+    // Before the functions, which add the hidden variables of batch mode
+    ptrauth_sign_initializers(&counts);
+
+    FOR_EACH_FUNCTION_WITH_GIMPLE_BODY(node) {
+        function *fn = DECL_STRUCT_FUNCTION(node->decl);
+
+        if (fn == NULL || !gimple_in_ssa_p(fn) || DECL_NO_INSTRUMENT_FUNCTION_ENTRY_EXIT(node->decl))
+            continue;
+
+        push_cfun(fn);
+        if (ptrauth_instrument_function(&counts)) {
+            // The runtime calls need virtual operands, and call graph edges
+            mark_virtual_operands_for_renaming(cfun);
+            update_ssa(TODO_update_ssa_only_virtuals);
+            cgraph_edge::rebuild_edges();
+        }
+        pop_cfun();
+    }
+
+    ptrauth_build_constructor();
+
+    if (config.verbose)
+        inform(UNKNOWN_LOCATION,
+               "ptrauth: %u stores and %u loads instrumented, %u initializers and %u functions signed at startup",
+               counts.stores, counts.loads, counts.slots, signed_var_count);
+
+    delete signed_vars;
+    signed_vars = NULL;
+
+    return 0;
+}
+
+} // namespace
+
+int plugin_init(struct plugin_name_args *plugin_info, struct plugin_gcc_version *version) {
+    const char *plugin_name = plugin_info->base_name;
+    struct register_pass_info pass_info;
+
+    if (!plugin_default_version_check(version, &gcc_version)) {
+        error("%s: built for a different version of GCC", plugin_name);
+        return 1;
+    }
+
+    for (int i = 0; i < plugin_info->argc; i++) {
+        const char *key = plugin_info->argv[i].key;
+        const char *value = plugin_info->argv[i].value;
+
+        if (!strcmp(key, "batch")) {
+            config.batch = true;
+        } else if (!strcmp(key, "verbose")) {
+            config.verbose = true;
+        } else if (!strcmp(key, "tweak") && value != NULL) {
+            config.tweak = strtoull(value, NULL, 0);
+        } else {
+            error("%s: unknown option %<-fplugin-arg-%s-%s%>", plugin_name, plugin_name, key);
+            return 1;
+        }
+    }
+
+    register_callback(plugin_name, PLUGIN_INFO, NULL, &ptrauth_plugin_info);
+
+    // After build_ssa_passes every function is in SSA form, and the early
+    // optimizations have not run yet
+    pass_info.pass = new ptrauth_pass(g);
+    pass_info.reference_pass_name = "build_ssa_passes";
+    pass_info.ref_pass_instance_number = 1;
+    pass_info.pos_op = PASS_POS_INSERT_AFTER;
+    register_callback(plugin_name, PLUGIN_PASS_MANAGER_SETUP, NULL, &pass_info);
+
+    return 0;
+}
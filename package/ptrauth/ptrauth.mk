@@ -8,6 +8,17 @@ PTRAUTH_VERSION = 1.0.0
 PTRAUTH_SITE = package/ptrauth/src
 PTRAUTH_SITE_METHOD = local
 PTRAUTH_LICENSE = GPL-2.0
+PTRAUTH_INSTALL_STAGING = YES
+
+ifeq ($(BR2_PACKAGE_PTRAUTH_DEBUG),y)
+PTRAUTH_MODULE_MAKE_OPTS += PTRAUTH_DEBUG=y
+endif
+
+# Userspace interface of the driver, for the packages using /dev/ptrauth
+define PTRAUTH_INSTALL_STAGING_CMDS
+	$(INSTALL) -D -m 0644 $(@D)/ptrauth_ioctl.h \
+		$(STAGING_DIR)/usr/include/ptrauth_ioctl.h
+endef
 
 $(eval $(kernel-module))
 $(eval $(generic-package))
@@ -1,9 +1,12 @@
 #include "linux/interrupt.h"
 #include "linux/ioport.h"
 #include "linux/irqreturn.h"
+#include "linux/kfifo.h"
+#include "linux/ratelimit.h"
 #include "linux/platform_device.h"
 #include "linux/random.h"
 #include "linux/sched/signal.h"
+#include <linux/binfmts.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
 
@@ -20,14 +23,41 @@
 
 // mmap
 #include <linux/mm.h>
+#include <linux/mount.h>
+#include <linux/pseudo_fs.h>
+#include <linux/vmalloc.h>
 #include <asm/io.h>
 
-// Kprobes
-#include <linux/kprobes.h>
+// ioctl
+#include <linux/uaccess.h>
+#include <linux/mutex.h>
+#include "ptrauth_ioctl.h"
+
+// Tracepoints
+#include <linux/tracepoint.h>
+#include <linux/percpu.h>
+
+// Key store
+#include <linux/rhashtable.h>
+#include <linux/slab.h>
+#include <linux/atomic.h>
+#include <linux/local_lock.h>
+
+// Statistics
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+// Software engine
+#include <linux/siphash.h>
+#include <linux/jump_label.h>
+#include <linux/workqueue.h>
 
 // Utilities
 #include <linux/errno.h>
 
+#define CREATE_TRACE_POINTS
+#include "ptrauth_trace.h"
+
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Pietro");
@@ -38,21 +68,28 @@ MODULE_VERSION("0.1");
 #define DEVICE_NAME "ptrauth"
 #define CLASS_NAME "cfi_devices"
 
-#define PTRAUTH_DEBUG
-
+// PTRAUTH_DEBUG is set by the build (BR2_PACKAGE_PTRAUTH_DEBUG). Hot paths
+// use the tracepoints of ptrauth_trace.h instead of logging.
 #ifdef PTRAUTH_DEBUG
     #define pa_info(...) pr_info(DRIVER_NAME ": " __VA_ARGS__)
 #else
     // If debug is disabled, simply do nothing
-    #define pa_info(...)
+    #define pa_info(...) no_printk(DRIVER_NAME ": " __VA_ARGS__)
 #endif
 
 #define pa_err(...) pr_err(DRIVER_NAME ": " __VA_ARGS__)
 
 // ==== Forward Declarations ====
 
-static void ptrauth_set_key(uint64_t key_low, uint64_t key_high);
-static void ptrauth_clear_ciphertext(void);
+struct ptrauth_device;
+
+// Device instances, see the Character Device section
+#define PTRAUTH_MAX_INSTANCES 32
+
+static void ptrauth_set_key(struct ptrauth_device *dev, uint64_t key_low, uint64_t key_high);
+static void ptrauth_clear_ciphertext(struct ptrauth_device *dev);
+
+static void ptrauth_new_key(uint64_t *key_low, uint64_t *key_high);
 
 static int ptrauth_probe(struct platform_device *pdev);
 static int ptrauth_remove(struct platform_device *pdev);
@@ -62,29 +99,629 @@ static ssize_t ptrauth_read(struct file*, char*, size_t, loff_t*);
 static ssize_t ptrauth_write(struct file*, const char*, size_t, loff_t*);
 static int ptrauth_release(struct inode*, struct file*);
 static int ptrauth_mmap(struct file *fp, struct vm_area_struct *vma);
+static long ptrauth_ioctl(struct file *fp, unsigned int cmd, unsigned long arg);
 
 static irqreturn_t ptrauth_irq_handler(int irq, void *data);
+static irqreturn_t ptrauth_irq_thread(int irq, void *data);
 
-void ptrauth_sched_switch_probe(void *ignore, bool preempt, struct task_struct *prev, struct task_struct *next);
+static void ptrauth_sched_switch_probe(void *ignore, bool preempt, struct task_struct *prev, struct task_struct *next, unsigned int prev_state);
+static void ptrauth_sched_fork_probe(void *ignore, struct task_struct *parent, struct task_struct *child);
+static void ptrauth_sched_exec_probe(void *ignore, struct task_struct *p, pid_t old_pid, struct linux_binprm *bprm);
+static void ptrauth_sched_exit_probe(void *ignore, struct task_struct *p);
 
 static char *ptrauth_devnode(const struct device *dev, umode_t *mode);
 
-// ==== Test ====
+// ==== Key Store ====
 
 struct ptrauth_process_info {
-    pid_t pid;
+    pid_t tgid;
     uint64_t key_low;
     uint64_t key_high;
-    bool valid;
+    // Key replaced by the last rotation, valid for re-signing until the
+    // next one. `epoch` counts the rotations.
+    uint64_t prev_key_low;
+    uint64_t prev_key_high;
+    bool has_prev;
+    u32 epoch;
+    // PTRAUTH_POLICY_* flags, which may change once published, under
+    // process_lock
+    u32 policy;
+    // Mappings of the register window held by the process, under
+    // process_lock. Keys are only loaded for processes that have one.
+    unsigned int mappings;
+    // Files the process opened on the device, under process_lock. The key
+    // is dropped once the last one is closed and no mapping is left.
+    unsigned int files;
+    // Mappings of the window of each instance, under process_lock, and the
+    // instances with at least one: the ones the switch path loads the key
+    // into
+    unsigned int instance_mappings[PTRAUTH_MAX_INSTANCES];
+    unsigned long instances;
+    atomic_t auth_failures;
+    // Key generation of the process, and the page exporting it, allocated
+    // by the first mmap of PTRAUTH_SHARED_PGOFF. Both under process_lock.
+    u64 generation;
+    struct ptrauth_shared *shared;
+    struct rhash_head node;
+    struct rcu_head rcu;
+};
+
+// Keyed processes indexed by thread group id, so all the threads of a
+// process share one key and switching between them never touches the
+// device. Entries come from a dedicated slab cache and the table resizes
+// itself, so the number of keyed processes is only bounded by memory.
+//
+// The context switch path is a lock-free reader: it looks entries up under
+// RCU and copies the key out. Keys are never modified once published, a
+// rekey replaces the whole entry. Writers (open, release, fork, exec and
+// exit) serialize on process_lock, and removed entries are only freed after
+// a grace period.
+static struct kmem_cache *process_cache;
+static struct rhashtable process_hash;
+static DEFINE_SPINLOCK(process_lock);
+
+static const struct rhashtable_params process_params = {
+    .key_len = sizeof(pid_t),
+    .key_offset = offsetof(struct ptrauth_process_info, tgid),
+    .head_offset = offsetof(struct ptrauth_process_info, node),
+    .automatic_shrinking = true,
 };
 
-#define MAX_PROCESS 256
+// Occupancy of the key store, exported through sysfs
+static atomic_t process_count = ATOMIC_INIT(0);
+static atomic_t process_peak = ATOMIC_INIT(0);
+
+// Key generations, exported to each process through its own page mapped
+// read-only at PTRAUTH_SHARED_PGOFF, so that userspace caches of signed
+// pointers know when to drop their entries. A process gets a new one with
+// every new key, and only its own caches are invalidated. They are never
+// reused, a child that inherits the key keeps the generation of its parent
+// along with the caches it copied. Zero is never handed out, so zeroed
+// cache entries are invalid.
+static atomic64_t generation_seq = ATOMIC64_INIT(0);
+
+// Must be called with process_lock held
+static void ptrauth_new_generation(struct ptrauth_process_info *info) {
+    info->generation = atomic64_inc_return(&generation_seq);
+    if (info->shared != NULL)
+        smp_store_release(&info->shared->generation, info->generation);
+}
+
+// Must be called under rcu_read_lock()
+static struct ptrauth_process_info *ptrauth_find_process(pid_t tgid) {
+    return rhashtable_lookup(&process_hash, &tgid, process_params);
+}
+
+// Copy the key of a process, returns false if it has none. `policy` may be
+// NULL.
+static bool ptrauth_lookup_key(pid_t tgid, uint64_t *key_low, uint64_t *key_high, u32 *policy) {
+    struct ptrauth_process_info *info;
+    bool found = false;
+
+    rcu_read_lock();
+    info = ptrauth_find_process(tgid);
+    if (info != NULL) {
+        *key_low = info->key_low;
+        *key_high = info->key_high;
+        if (policy != NULL)
+            *policy = READ_ONCE(info->policy);
+        found = true;
+    }
+    rcu_read_unlock();
+
+    return found;
+}
+
+static struct ptrauth_process_info *ptrauth_alloc_process(pid_t tgid, uint64_t key_low, uint64_t key_high, u32 policy, gfp_t gfp) {
+    struct ptrauth_process_info *info = kmem_cache_alloc(process_cache, gfp);
+
+    if (info == NULL)
+        return NULL;
+
+    info->tgid = tgid;
+    info->key_low = key_low;
+    info->key_high = key_high;
+    info->policy = policy;
+    info->prev_key_low = 0;
+    info->prev_key_high = 0;
+    info->has_prev = false;
+    info->epoch = 0;
+    info->mappings = 0;
+    info->files = 0;
+    memset(info->instance_mappings, 0, sizeof(info->instance_mappings));
+    info->instances = 0;
+    atomic_set(&info->auth_failures, 0);
+    info->generation = atomic64_inc_return(&generation_seq);
+    info->shared = NULL;
+
+    return info;
+}
+
+// Publish a fully initialized entry, must be called with process_lock held
+static int ptrauth_insert_process(struct ptrauth_process_info *info) {
+    int count, peak, ret;
+
+    lockdep_assert_held(&process_lock);
+
+    ret = rhashtable_lookup_insert_fast(&process_hash, &info->node, process_params);
+    if (ret != 0)
+        return ret;
+
+    count = atomic_inc_return(&process_count);
+    peak = atomic_read(&process_peak);
+    while (count > peak && !atomic_try_cmpxchg(&process_peak, &peak, count))
+        ;
+
+    return 0;
+}
+
+// The shared page stays around while userspace still has it mapped
+static void ptrauth_free_process(struct ptrauth_process_info *info) {
+    if (info->shared != NULL)
+        free_page((unsigned long)info->shared);
+    kmem_cache_free(process_cache, info);
+}
+
+static void ptrauth_free_process_rcu(struct rcu_head *head) {
+    ptrauth_free_process(container_of(head, struct ptrauth_process_info, rcu));
+}
+
+// Must be called with process_lock held
+static void ptrauth_unlink_process(struct ptrauth_process_info *info) {
+    lockdep_assert_held(&process_lock);
+
+    if (rhashtable_remove_fast(&process_hash, &info->node, process_params) == 0) {
+        atomic_dec(&process_count);
+        call_rcu(&info->rcu, ptrauth_free_process_rcu);
+    }
+}
+
+static void ptrauth_remove_process(pid_t tgid) {
+    struct ptrauth_process_info *info;
+
+    spin_lock(&process_lock);
+    rcu_read_lock();
+
+    info = ptrauth_find_process(tgid);
+    if (info != NULL)
+        ptrauth_unlink_process(info);
+
+    rcu_read_unlock();
+    spin_unlock(&process_lock);
+}
+
+// Count one more open file for a process that already has a key, returns
+// false if it has none
+static bool ptrauth_hold_process(pid_t tgid) {
+    struct ptrauth_process_info *info;
+
+    spin_lock(&process_lock);
+    rcu_read_lock();
+
+    info = ptrauth_find_process(tgid);
+    if (info != NULL)
+        info->files++;
+
+    rcu_read_unlock();
+    spin_unlock(&process_lock);
+
+    return info != NULL;
+}
+
+// Count a file of the process out. Closing one of several descriptors
+// must not drop the key while another one is open, or while the window is
+// still mapped. Returns true if the key was dropped.
+static bool ptrauth_release_process(pid_t tgid) {
+    struct ptrauth_process_info *info;
+    bool dropped = false;
+
+    spin_lock(&process_lock);
+    rcu_read_lock();
+
+    info = ptrauth_find_process(tgid);
+    if (info != NULL && info->files > 0)
+        info->files--;
+    if (info != NULL && info->files == 0 && info->mappings == 0) {
+        ptrauth_unlink_process(info);
+        dropped = true;
+    }
+
+    rcu_read_unlock();
+    spin_unlock(&process_lock);
+
+    return dropped;
+}
+
+// Count a mapping of the register window of `instance` in or out, returns
+// false if the process has no key
+static bool ptrauth_account_mapping(pid_t tgid, int instance, bool mapped) {
+    struct ptrauth_process_info *info;
+
+    spin_lock(&process_lock);
+    rcu_read_lock();
+
+    info = ptrauth_find_process(tgid);
+    if (info != NULL) {
+        if (mapped) {
+            if (info->instance_mappings[instance]++ == 0)
+                WRITE_ONCE(info->instances, info->instances | BIT(instance));
+            WRITE_ONCE(info->mappings, info->mappings + 1);
+        } else if (info->instance_mappings[instance] > 0) {
+            if (--info->instance_mappings[instance] == 0)
+                WRITE_ONCE(info->instances, info->instances & ~BIT(instance));
+            WRITE_ONCE(info->mappings, info->mappings - 1);
+        }
+    }
+
+    rcu_read_unlock();
+    spin_unlock(&process_lock);
+
+    return info != NULL;
+}
+
+// Copy the previous key of a process, returns false if it has none
+static bool ptrauth_lookup_previous_key(pid_t tgid, uint64_t *key_low, uint64_t *key_high) {
+    struct ptrauth_process_info *info;
+    bool found = false;
+
+    rcu_read_lock();
+    info = ptrauth_find_process(tgid);
+    if (info != NULL && info->has_prev) {
+        *key_low = info->prev_key_low;
+        *key_high = info->prev_key_high;
+        found = true;
+    }
+    rcu_read_unlock();
+
+    return found;
+}
+
+// Copy the key of a process that has the register window mapped, and the
+// mask of the instances it mapped. Returns false if it has no key or
+// cannot reach the device.
+static bool ptrauth_lookup_mapped_key(pid_t tgid, uint64_t *key_low, uint64_t *key_high, unsigned long *instances) {
+    struct ptrauth_process_info *info;
+    bool found = false;
+
+    rcu_read_lock();
+    info = ptrauth_find_process(tgid);
+    if (info != NULL && READ_ONCE(info->mappings) > 0) {
+        *key_low = info->key_low;
+        *key_high = info->key_high;
+        *instances = READ_ONCE(info->instances);
+        found = true;
+    }
+    rcu_read_unlock();
+
+    return found;
+}
+
+// Give a process a fresh random key. The entry is replaced rather than
+// updated in place, so lock-free readers see either the old key or the new
+// one, never a mix of both. A rotation keeps the old key as the previous
+// one and starts a new epoch, any other rekey drops the previous key. The
+// new key is returned through key_low and key_high, the epoch through
+// `epoch` if not NULL.
+static int ptrauth_rekey_process(pid_t tgid, bool rotate, uint64_t *key_low, uint64_t *key_high, u32 *epoch, gfp_t gfp) {
+    struct ptrauth_process_info *old, *info;
+    uint64_t new_low, new_high;
+    int ret = -ENOENT;
+
+    ptrauth_new_key(&new_low, &new_high);
+    info = ptrauth_alloc_process(tgid, new_low, new_high, 0, gfp);
+    if (info == NULL)
+        return -ENOMEM;
+
+    spin_lock(&process_lock);
+    rcu_read_lock();
+
+    old = ptrauth_find_process(tgid);
+    if (old != NULL) {
+        info->policy = READ_ONCE(old->policy);
+        info->epoch = old->epoch;
+        if (rotate) {
+            info->prev_key_low = old->key_low;
+            info->prev_key_high = old->key_high;
+            info->has_prev = true;
+            info->epoch++;
+        }
+        info->mappings = old->mappings;
+        info->files = old->files;
+        memcpy(info->instance_mappings, old->instance_mappings, sizeof(info->instance_mappings));
+        info->instances = old->instances;
+        atomic_set(&info->auth_failures, atomic_read(&old->auth_failures));
+        // Signatures cached under the old key are stale
+        info->shared = old->shared;
+        ptrauth_new_generation(info);
+
+        ret = rhashtable_replace_fast(&process_hash, &old->node, &info->node, process_params);
+        if (ret == 0) {
+            old->shared = NULL;
+            call_rcu(&old->rcu, ptrauth_free_process_rcu);
+        }
+    }
+
+    rcu_read_unlock();
+    spin_unlock(&process_lock);
+
+    if (ret != 0) {
+        kmem_cache_free(process_cache, info);
+        return ret;
+    }
 
-static struct ptrauth_process_info process_table[MAX_PROCESS] = {0};
+    *key_low = info->key_low;
+    *key_high = info->key_high;
+    if (epoch != NULL)
+        *epoch = info->epoch;
+
+    return 0;
+}
+
+static void ptrauth_destroy_process(void *ptr, void *arg) {
+    ptrauth_free_process(ptr);
+}
+
+static int ptrauth_init_key_store(void) {
+    int ret;
+
+    process_cache = KMEM_CACHE(ptrauth_process_info, 0);
+    if (process_cache == NULL)
+        return -ENOMEM;
+
+    ret = rhashtable_init(&process_hash, &process_params);
+    if (ret != 0) {
+        kmem_cache_destroy(process_cache);
+        return ret;
+    }
+
+    return 0;
+}
+
+static void ptrauth_destroy_key_store(void) {
+    // Wait for entries that are still waiting for a grace period
+    rcu_barrier();
+
+    rhashtable_free_and_destroy(&process_hash, ptrauth_destroy_process, NULL);
+    kmem_cache_destroy(process_cache);
+    atomic_set(&process_count, 0);
+}
+
+static ssize_t keys_in_use_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    return sysfs_emit(buf, "%d\n", atomic_read(&process_count));
+}
+static DEVICE_ATTR_RO(keys_in_use);
+
+static ssize_t keys_peak_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    return sysfs_emit(buf, "%d\n", atomic_read(&process_peak));
+}
+static DEVICE_ATTR_RO(keys_peak);
+
+static struct attribute *ptrauth_attrs[] = {
+    &dev_attr_keys_in_use.attr,
+    &dev_attr_keys_peak.attr,
+    NULL,
+};
+ATTRIBUTE_GROUPS(ptrauth);
+
+// ==== Statistics ====
+
+// Event counters, kept per CPU so that the switch path never shares a
+// cache line with another CPU. They are summed and reset through
+// /sys/kernel/debug/ptrauth/stats.
+struct ptrauth_stats {
+    u64 switches;
+    u64 key_writes;
+    u64 key_skips;
+    u64 ciphertext_clears;
+    u64 forks_cloned;
+    u64 exec_rekeys;
+    u64 auth_failures;
+    u64 faults_dropped;
+    u64 lazy_faults;
+    u64 unmapped_skips;
+    u64 key_rotations;
+    u64 resigns;
+    u64 resign_failures;
+    u64 pool_hits;
+    u64 pool_misses;
+};
+
+static DEFINE_PER_CPU(struct ptrauth_stats, ptrauth_stats);
+
+#define ptrauth_stat_inc(field) this_cpu_inc(ptrauth_stats.field)
+
+static struct dentry *ptrauth_debugfs;
+
+static int ptrauth_stats_show(struct seq_file *m, void *v) {
+    struct ptrauth_stats sum = {0};
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        struct ptrauth_stats *stats = per_cpu_ptr(&ptrauth_stats, cpu);
+
+        sum.switches += READ_ONCE(stats->switches);
+        sum.key_writes += READ_ONCE(stats->key_writes);
+        sum.key_skips += READ_ONCE(stats->key_skips);
+        sum.ciphertext_clears += READ_ONCE(stats->ciphertext_clears);
+        sum.forks_cloned += READ_ONCE(stats->forks_cloned);
+        sum.exec_rekeys += READ_ONCE(stats->exec_rekeys);
+        sum.auth_failures += READ_ONCE(stats->auth_failures);
+        sum.faults_dropped += READ_ONCE(stats->faults_dropped);
+        sum.lazy_faults += READ_ONCE(stats->lazy_faults);
+        sum.unmapped_skips += READ_ONCE(stats->unmapped_skips);
+        sum.key_rotations += READ_ONCE(stats->key_rotations);
+        sum.resigns += READ_ONCE(stats->resigns);
+        sum.resign_failures += READ_ONCE(stats->resign_failures);
+        sum.pool_hits += READ_ONCE(stats->pool_hits);
+        sum.pool_misses += READ_ONCE(stats->pool_misses);
+    }
+
+    seq_printf(m, "switches %llu\n", sum.switches);
+    seq_printf(m, "key_writes %llu\n", sum.key_writes);
+    seq_printf(m, "key_skips %llu\n", sum.key_skips);
+    seq_printf(m, "ciphertext_clears %llu\n", sum.ciphertext_clears);
+    seq_printf(m, "forks_cloned %llu\n", sum.forks_cloned);
+    seq_printf(m, "exec_rekeys %llu\n", sum.exec_rekeys);
+    seq_printf(m, "auth_failures %llu\n", sum.auth_failures);
+    seq_printf(m, "faults_dropped %llu\n", sum.faults_dropped);
+    seq_printf(m, "lazy_faults %llu\n", sum.lazy_faults);
+    seq_printf(m, "unmapped_skips %llu\n", sum.unmapped_skips);
+    seq_printf(m, "key_rotations %llu\n", sum.key_rotations);
+    seq_printf(m, "resigns %llu\n", sum.resigns);
+    seq_printf(m, "resign_failures %llu\n", sum.resign_failures);
+    seq_printf(m, "pool_hits %llu\n", sum.pool_hits);
+    seq_printf(m, "pool_misses %llu\n", sum.pool_misses);
+    seq_printf(m, "keys_in_use %d\n", atomic_read(&process_count));
+    seq_printf(m, "keys_peak %d\n", atomic_read(&process_peak));
+
+    return 0;
+}
+
+static int ptrauth_stats_open(struct inode *inode, struct file *file) {
+    return single_open(file, ptrauth_stats_show, NULL);
+}
+
+// Any write resets the counters, the peak restarts from the current
+// occupancy.
+static ssize_t ptrauth_stats_write(struct file *file, const char __user *buf, size_t len, loff_t *off) {
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        memset(per_cpu_ptr(&ptrauth_stats, cpu), 0, sizeof(struct ptrauth_stats));
+    }
+    atomic_set(&process_peak, atomic_read(&process_count));
+
+    return len;
+}
+
+static const struct file_operations ptrauth_stats_fops = {
+    .owner = THIS_MODULE,
+    .open = ptrauth_stats_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .write = ptrauth_stats_write,
+    .release = single_release,
+};
+
+static void ptrauth_init_debugfs(void) {
+    ptrauth_debugfs = debugfs_create_dir(DRIVER_NAME, NULL);
+    debugfs_create_file("stats", 0600, ptrauth_debugfs, NULL, &ptrauth_stats_fops);
+}
+
+// ==== Key Pool ====
+
+// Fresh keys come from a per-CPU pool of pre-generated ones, so that
+// short-lived processes opening the device or forking with a fresh key do
+// not pay for the random number generator. A pool is refilled by a work
+// item on its CPU once it runs low, and callers fall back to
+// get_random_u64() if it ran dry. Keys are wiped as they leave the pool.
+#define PTRAUTH_POOL_KEYS 32
+#define PTRAUTH_POOL_LOW 8
+
+struct ptrauth_key_pool {
+    local_lock_t lock;
+    unsigned int count;
+    uint64_t keys[PTRAUTH_POOL_KEYS][2];
+    struct work_struct refill;
+};
+
+static DEFINE_PER_CPU(struct ptrauth_key_pool, key_pool) = {
+    .lock = INIT_LOCAL_LOCK(lock),
+};
+
+// Tops up the pool of the CPU the work runs on, which is the one that
+// queued it unless that CPU went offline in between
+static void ptrauth_refill_key_pool(struct work_struct *work) {
+    uint64_t keys[PTRAUTH_POOL_KEYS][2];
+    struct ptrauth_key_pool *pool;
+    unsigned int n;
+
+    // Generated outside the lock, the pool stays usable meanwhile
+    get_random_bytes(keys, sizeof(keys));
+
+    local_lock(&key_pool.lock);
+    pool = this_cpu_ptr(&key_pool);
+    n = PTRAUTH_POOL_KEYS - pool->count;
+    memcpy(pool->keys[pool->count], keys, n * sizeof(keys[0]));
+    pool->count += n;
+    local_unlock(&key_pool.lock);
+
+    memzero_explicit(keys, sizeof(keys));
+}
+
+static void ptrauth_new_key(uint64_t *key_low, uint64_t *key_high) {
+    struct ptrauth_key_pool *pool;
+    bool found = false;
+
+    local_lock(&key_pool.lock);
+    pool = this_cpu_ptr(&key_pool);
+    if (pool->count > 0) {
+        pool->count--;
+        *key_low = pool->keys[pool->count][0];
+        *key_high = pool->keys[pool->count][1];
+        memzero_explicit(pool->keys[pool->count], sizeof(pool->keys[0]));
+        found = true;
+    }
+    if (pool->count < PTRAUTH_POOL_LOW)
+        schedule_work_on(smp_processor_id(), &pool->refill);
+    local_unlock(&key_pool.lock);
+
+    if (found) {
+        ptrauth_stat_inc(pool_hits);
+        return;
+    }
+
+    ptrauth_stat_inc(pool_misses);
+    *key_low = get_random_u64();
+    *key_high = get_random_u64();
+}
+
+// Pools start full, nothing takes keys before the module is initialized
+static void ptrauth_init_key_pool(void) {
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        struct ptrauth_key_pool *pool = per_cpu_ptr(&key_pool, cpu);
+
+        INIT_WORK(&pool->refill, ptrauth_refill_key_pool);
+        get_random_bytes(pool->keys, sizeof(pool->keys));
+        pool->count = PTRAUTH_POOL_KEYS;
+    }
+}
+
+// Called once nothing can take keys anymore
+static void ptrauth_destroy_key_pool(void) {
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        struct ptrauth_key_pool *pool = per_cpu_ptr(&key_pool, cpu);
+
+        cancel_work_sync(&pool->refill);
+        memzero_explicit(pool->keys, sizeof(pool->keys));
+        pool->count = 0;
+    }
+}
 
 // ==== Character Device ====
 
-static struct ptrauth_device {
+// A board may have one PtrauthDevice per cluster or per core. Each instance
+// is local to a set of CPUs, and the ioctls of a task drive the instance of
+// the CPU it runs on, so cores do not serialize behind one register file.
+// Instance N is also exposed as /dev/ptrauthN, whose window maps that
+// instance; /dev/ptrauth maps the instance local to the CPU that opened it.
+//
+// Devicetree nodes name their CPUs with a "cpus" list of phandles. A node
+// without one takes every CPU that no other instance claimed, which is
+// what a single device board gets.
+struct ptrauth_soft_device;
+
+struct ptrauth_device {
+    int id;
+    struct platform_device *pdev;
+
+    // CPUs this instance is local to
+    struct cpumask cpus;
+
     uint64_t priviledged_start;
     uint64_t priviledged_size;
 
@@ -100,8 +737,101 @@ static struct ptrauth_device {
     void __iomem *plaintext;
     void __iomem *tweak;
     void __iomem *ciphertext;
-} global_device;
 
+    int irq;
+
+    // Serializes the key writes with the register sequences that depend on
+    // the key, a batch chunk included, from every CPU sharing the instance.
+    // Raw, as the switch path takes it.
+    raw_spinlock_t key_lock;
+
+    // CPU that issued the last key write, see ptrauth_switch_key()
+    int key_cpu;
+
+    // Keyed task last switched in, authentication failures are blamed on
+    // it. Zero when an untracked task is running.
+    pid_t owner;
+
+    // Lazy mode only: the process whose mapping of the window is currently
+    // populated, and the key it runs with. Updated under lazy_lock.
+    struct mutex lazy_lock;
+    pid_t lazy_owner;
+    uint64_t lazy_key_low;
+    uint64_t lazy_key_high;
+
+    // Register file of the software engine, NULL for a PtrauthDevice
+    struct ptrauth_soft_device *soft;
+
+    // Files opened on the instance use the address space of this inode, see
+    // ptrauth_mnt
+    struct inode *inode;
+};
+
+// Instances by id. Only probe and remove change them, under
+// instances_lock; the switch path and open read them without locking, an
+// instance cannot go away while a process has its window mapped or the
+// device open. `default_device` is any of them, for CPUs without a local
+// one.
+static struct ptrauth_device *ptrauth_instances[PTRAUTH_MAX_INSTANCES];
+static struct ptrauth_device *default_device;
+static DEFINE_MUTEX(instances_lock);
+
+// CPU to instance map, published once the instance is ready
+static DEFINE_PER_CPU(struct ptrauth_device *, local_device);
+
+// Instance local to the running CPU, `fallback` for CPUs that no instance
+// claimed. Must be called with preemption disabled.
+static struct ptrauth_device *ptrauth_cpu_device(struct ptrauth_device *fallback) {
+    struct ptrauth_device *dev = this_cpu_read(local_device);
+
+    return dev != NULL ? dev : fallback;
+}
+
+// Every instance has an address space of its own, that of an inode of this
+// internal filesystem, which the files opened on it use instead of the one
+// of their device node. Revoking the window of an instance then reaches all
+// of its mappings, through /dev/ptrauth and /dev/ptrauthN alike, and none
+// of the other instances opened through /dev/ptrauth.
+#define PTRAUTH_FS_MAGIC 0x70747261
+
+static struct vfsmount *ptrauth_mnt;
+
+static int ptrauth_fs_init_fs_context(struct fs_context *fc) {
+    return init_pseudo(fc, PTRAUTH_FS_MAGIC) != NULL ? 0 : -ENOMEM;
+}
+
+// No owner, the internal mount would pin the module
+static struct file_system_type ptrauth_fs_type = {
+    .name = "ptrauth",
+    .init_fs_context = ptrauth_fs_init_fs_context,
+    .kill_sb = kill_anon_super,
+};
+
+// Lazy key loading. Instead of writing the key of every task switched in,
+// the device window is mapped on demand: only the process that last
+// touched it has it populated, and the first access by any other process
+// faults, revokes the window from everybody else and loads the faulting
+// process' key. Switches between processes that do not use the device in
+// their timeslice then cost no MMIO at all.
+//
+// Mappings are not inherited across fork() in this mode, children have to
+// map the device again.
+static bool lazy_keys;
+module_param(lazy_keys, bool, 0444);
+MODULE_PARM_DESC(lazy_keys, "Load keys on the first access to the device instead of on every context switch");
+
+// Key each CPU last wrote, and the instance it wrote it into. Only
+// meaningful while that CPU is also the last one that wrote the instance
+// (ptrauth_device.key_cpu).
+struct ptrauth_loaded_key {
+    struct ptrauth_device *dev;
+    uint64_t key_low;
+    uint64_t key_high;
+};
+
+static DEFINE_PER_CPU(struct ptrauth_loaded_key, loaded_key);
+
+// Minor 0 is /dev/ptrauth, minor N + 1 is instance N
 static struct char_dev {
     struct class *driver_class;
     dev_t device_number;
@@ -111,103 +841,901 @@ static struct char_dev {
     .driver_class = NULL,
 };
 
+#define PTRAUTH_MINORS (PTRAUTH_MAX_INSTANCES + 1)
+
+static ssize_t cpus_show(struct device *d, struct device_attribute *attr, char *buf) {
+    struct ptrauth_device *dev = dev_get_drvdata(d);
+
+    return cpumap_print_to_pagebuf(true, buf, &dev->cpus);
+}
+static DEVICE_ATTR_RO(cpus);
+
+static struct attribute *ptrauth_instance_attrs[] = {
+    &dev_attr_cpus.attr,
+    NULL,
+};
+ATTRIBUTE_GROUPS(ptrauth_instance);
+
+// Per open file state
+struct ptrauth_file {
+    // Instance whose window this file maps
+    struct ptrauth_device *dev;
+
+    // Process that opened the file, its files are counted in its key store
+    // entry. Not necessarily the one closing it, after fork().
+    pid_t tgid;
+
+    // Shared request ring, allocated by the first mmap of PTRAUTH_RING_PGOFF
+    struct mutex ring_lock;
+    struct ptrauth_ring_header *ring;
+    size_t ring_bytes;
+    uint32_t ring_entries;
+    uint32_t ring_tail;
+};
+
+// Open files, and the mappings holding them, pin the module
 static struct file_operations fops = {
+    .owner = THIS_MODULE,
     .read = ptrauth_read,
     .write = ptrauth_write,
     .open = ptrauth_open,
     .release = ptrauth_release,
-    .mmap = ptrauth_mmap
+    .mmap = ptrauth_mmap,
+    .unlocked_ioctl = ptrauth_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+};
+
+// ==== Software Engine ====
+
+// Reference implementation of the device, selected with engine=soft.
+// Emulated platform devices are registered instead of binding to the
+// devicetree nodes, and their registers live in memory with the same
+// layout, so everything above the register accessors is shared with the
+// hardware path. soft_instances splits the CPUs evenly between several
+// of them.
+//
+// The PAC is SipHash-2-4 of the (48-bit) address and the tweak under the
+// 128-bit key, stored in the top 16 bits. It is not bit-compatible with
+// the hardware, only with itself. The window cannot be mapped in this
+// mode: userspace goes through the ioctls.
+static char *engine = "hw";
+module_param(engine, charp, 0444);
+MODULE_PARM_DESC(engine, "Sign/auth engine: \"hw\" for the PtrauthDevice (default), \"soft\" for the in-kernel reference implementation");
+
+static unsigned int soft_instances = 1;
+module_param(soft_instances, uint, 0444);
+MODULE_PARM_DESC(soft_instances, "Number of emulated devices with engine=soft, each local to an equal share of the CPUs (default 1)");
+
+static DEFINE_STATIC_KEY_FALSE(ptrauth_soft_engine);
+
+#define PTRAUTH_SOFT_VA_BITS 48
+#define PTRAUTH_SOFT_REGS 8
+
+struct ptrauth_soft_device {
+    struct ptrauth_device *dev;
+
+    u64 priviledged[PTRAUTH_SOFT_REGS];
+    u64 unpriviledged[PTRAUTH_SOFT_REGS];
+
+    // The last write went to ciphertext: the next read authenticates
+    bool auth_pending;
+
+    // Runs the IRQ thread for failures raised by the engine
+    struct work_struct fault_work;
 };
 
-static void ptrauth_set_key(uint64_t key_low, uint64_t key_high) {
-    if (key_low != 0) {
-        // pa_info("[set_key] setting key 0x%016llx%016llx (pid = %d)", key_low, key_high, current->pid);
+static struct platform_device *soft_pdevs[PTRAUTH_MAX_INSTANCES];
+
+static uint64_t ptrauth_soft_pac(struct ptrauth_soft_device *soft, uint64_t ptr, uint64_t tweak) {
+    const siphash_key_t key = {{ soft->priviledged[0], soft->priviledged[1] }};
+    uint64_t addr = ptr & GENMASK_ULL(PTRAUTH_SOFT_VA_BITS - 1, 0);
+
+    return addr | (siphash_2u64(addr, tweak, &key) << PTRAUTH_SOFT_VA_BITS);
+}
+
+static void ptrauth_soft_fault_work(struct work_struct *work) {
+    struct ptrauth_soft_device *soft = container_of(work, struct ptrauth_soft_device, fault_work);
+
+    ptrauth_irq_thread(0, soft->dev);
+}
+
+// Same as the device raising its interrupt
+static void ptrauth_soft_raise_fault(struct ptrauth_device *dev) {
+    if (ptrauth_irq_handler(0, dev) == IRQ_WAKE_THREAD)
+        schedule_work(&dev->soft->fault_work);
+}
+
+static void ptrauth_soft_write(struct ptrauth_device *dev, uint64_t value, void __iomem *reg) {
+    *(u64 __force *)reg = value;
+
+    if (reg == dev->ciphertext)
+        dev->soft->auth_pending = true;
+    else if (reg == dev->plaintext)
+        dev->soft->auth_pending = false;
+}
+
+static uint64_t ptrauth_soft_read(struct ptrauth_device *dev, void __iomem *reg) {
+    struct ptrauth_soft_device *soft = dev->soft;
+    uint64_t result;
+
+    if (reg != dev->ciphertext)
+        return *(u64 __force *)reg;
+
+    if (!soft->auth_pending) {
+        result = ptrauth_soft_pac(soft, *(u64 __force *)dev->plaintext, *(u64 __force *)dev->tweak);
+    } else {
+        uint64_t signed_ptr = *(u64 __force *)dev->ciphertext;
+        uint64_t tweak = *(u64 __force *)dev->tweak;
+
+        result = signed_ptr & GENMASK_ULL(PTRAUTH_SOFT_VA_BITS - 1, 0);
+        if (ptrauth_soft_pac(soft, result, tweak) != signed_ptr) {
+            result = 0;
+            ptrauth_soft_raise_fault(dev);
+        }
+        soft->auth_pending = false;
+    }
+
+    *(u64 __force *)reg = result;
+    return result;
+}
+
+// Register accessors, the engine test is a static branch so the hardware
+// path only pays for a nop
+static inline void ptrauth_writeq(struct ptrauth_device *dev, uint64_t value, void __iomem *reg) {
+    if (static_branch_unlikely(&ptrauth_soft_engine))
+        ptrauth_soft_write(dev, value, reg);
+    else
+        writeq(value, reg);
+}
+
+static inline void ptrauth_writeq_relaxed(struct ptrauth_device *dev, uint64_t value, void __iomem *reg) {
+    if (static_branch_unlikely(&ptrauth_soft_engine))
+        ptrauth_soft_write(dev, value, reg);
+    else
+        writeq_relaxed(value, reg);
+}
+
+static inline uint64_t ptrauth_readq(struct ptrauth_device *dev, void __iomem *reg) {
+    if (static_branch_unlikely(&ptrauth_soft_engine))
+        return ptrauth_soft_read(dev, reg);
+    return readq(reg);
+}
+
+static inline uint64_t ptrauth_readq_relaxed(struct ptrauth_device *dev, void __iomem *reg) {
+    if (static_branch_unlikely(&ptrauth_soft_engine))
+        return ptrauth_soft_read(dev, reg);
+    return readq_relaxed(reg);
+}
+
+// ==== Device Access ====
+
+static void ptrauth_set_key(struct ptrauth_device *dev, uint64_t key_low, uint64_t key_high) {
+    struct ptrauth_loaded_key *loaded = get_cpu_ptr(&loaded_key);
+
+    ptrauth_stat_inc(key_writes);
+
+    ptrauth_writeq(dev, key_low, dev->key_low);
+    ptrauth_writeq(dev, key_high, dev->key_high);
+
+    loaded->dev = dev;
+    loaded->key_low = key_low;
+    loaded->key_high = key_high;
+    WRITE_ONCE(dev->key_cpu, smp_processor_id());
+
+    put_cpu_ptr(&loaded_key);
+}
+
+static void ptrauth_clear_ciphertext(struct ptrauth_device *dev) {
+    ptrauth_stat_inc(ciphertext_clears);
+    (void)ptrauth_readq(dev, dev->ciphertext);
+}
+
+// Whether `key` is the last one written into the instance, from whichever
+// CPU wrote it
+static bool ptrauth_holds_key(struct ptrauth_device *dev, uint64_t key_low, uint64_t key_high) {
+    int cpu = READ_ONCE(dev->key_cpu);
+    struct ptrauth_loaded_key *loaded;
+
+    if (cpu < 0)
+        return false;
+
+    loaded = per_cpu_ptr(&loaded_key, cpu);
+    return READ_ONCE(loaded->dev) == dev && READ_ONCE(loaded->key_low) == key_low &&
+           READ_ONCE(loaded->key_high) == key_high;
+}
+
+// Load a key on the context switch path, which runs with preemption
+// disabled. The MMIO accesses are skipped when the instance already holds
+// the same key, e.g. switching between tasks sharing a key or between
+// tasks that have none, whichever CPU loaded it. Must be called with
+// key_lock held, under which the last key written is exact.
+static void __ptrauth_switch_key(struct ptrauth_device *dev, pid_t pid, uint64_t key_low, uint64_t key_high) {
+    lockdep_assert_held(&dev->key_lock);
+
+    if (ptrauth_holds_key(dev, key_low, key_high)) {
+        ptrauth_stat_inc(key_skips);
+        trace_ptrauth_key_skip(pid);
+        return;
+    }
+
+    ptrauth_clear_ciphertext(dev);
+    ptrauth_set_key(dev, key_low, key_high);
+    trace_ptrauth_key_load(pid);
+}
+
+static void ptrauth_switch_key(struct ptrauth_device *dev, pid_t pid, uint64_t key_low, uint64_t key_high) {
+    raw_spin_lock(&dev->key_lock);
+    __ptrauth_switch_key(dev, pid, key_low, key_high);
+    raw_spin_unlock(&dev->key_lock);
+}
+
+// Drop whatever key the instance holds
+static void ptrauth_wipe_key(struct ptrauth_device *dev) {
+    raw_spin_lock(&dev->key_lock);
+    ptrauth_clear_ciphertext(dev);
+    ptrauth_set_key(dev, 0, 0);
+    raw_spin_unlock(&dev->key_lock);
+}
+
+// Load the key of a process into every instance it mapped a window of,
+// starting with the one local to the CPU, through local_device. Windows on
+// the other instances are reachable from this CPU as well, so they get the
+// key too; they share their register file with the CPUs local to them,
+// which only pinning avoids. Must be called with preemption disabled.
+static void ptrauth_load_mapped_key(pid_t tgid, uint64_t key_low, uint64_t key_high, unsigned long instances) {
+    struct ptrauth_device *dev = this_cpu_read(local_device);
+    int i;
+
+    if (dev != NULL && (instances & BIT(dev->id))) {
+        WRITE_ONCE(dev->owner, tgid);
+        ptrauth_switch_key(dev, tgid, key_low, key_high);
+        instances &= ~BIT(dev->id);
     }
-    writeq(key_low, global_device.key_low);
-    writeq(key_high, global_device.key_high);
+
+    for_each_set_bit(i, &instances, PTRAUTH_MAX_INSTANCES) {
+        dev = READ_ONCE(ptrauth_instances[i]);
+        WRITE_ONCE(dev->owner, tgid);
+        ptrauth_switch_key(dev, tgid, key_low, key_high);
+    }
+}
+
+// Sign and authenticate through the unprivileged registers. An instance
+// holds a single request, so callers keep preemption disabled across a
+// sequence to avoid interleaving with another task using it.
+static uint64_t ptrauth_sign(struct ptrauth_device *dev, uint64_t ptr, uint64_t tweak) {
+    ptrauth_writeq_relaxed(dev, ptr, dev->plaintext);
+    ptrauth_writeq_relaxed(dev, tweak, dev->tweak);
+
+    return ptrauth_readq_relaxed(dev, dev->ciphertext);
 }
 
-static void ptrauth_clear_ciphertext(void) {
-    (void)readq(global_device.ciphertext);
+static uint64_t ptrauth_auth(struct ptrauth_device *dev, uint64_t ptr, uint64_t tweak) {
+    ptrauth_writeq_relaxed(dev, tweak, dev->tweak);
+    ptrauth_writeq_relaxed(dev, ptr, dev->ciphertext);
+
+    return ptrauth_readq_relaxed(dev, dev->ciphertext);
+}
+
+// /dev/ptrauthN is bound to instance N, /dev/ptrauth to the instance local
+// to the opening CPU or, on a CPU without one, to any instance. NULL when
+// there is none.
+static struct ptrauth_device *ptrauth_file_device(unsigned int minor) {
+    struct ptrauth_device *dev;
+
+    if (minor > 0)
+        return smp_load_acquire(&ptrauth_instances[minor - 1]);
+
+    dev = raw_cpu_read(local_device);
+    if (dev == NULL)
+        dev = smp_load_acquire(&default_device);
+
+    return dev;
+}
+
+static int ptrauth_open(struct inode *inod, struct file *fp) {
+    pa_info("[open] fp open\n");
+    struct ptrauth_process_info *info, *existing;
+    struct ptrauth_device *dev;
+    struct ptrauth_file *ctx;
+    uint64_t key_low, key_high;
+
+    dev = ptrauth_file_device(iminor(inod));
+    if (dev == NULL && iminor(inod) > 0)
+        return -ENODEV;
+
+    ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+    if (ctx == NULL)
+        return -ENOMEM;
+
+    ctx->dev = dev;
+    ctx->tgid = current->tgid;
+    mutex_init(&ctx->ring_lock);
+
+    // Mappings of the instance, whichever node they come from, share its
+    // address space
+    if (dev != NULL)
+        fp->f_mapping = dev->inode->i_mapping;
+
+    // The key is only loaded once the process can reach the device: when it
+    // maps the window, faults it in (lazy mode) or issues an ioctl. Reopening
+    // the device, from any thread, keeps the key the process already has.
+    //
+    // Open is not lock-free: the instance lookup is, but counting the file
+    // in and inserting a new entry take process_lock, and so does release.
+    // The key is generated outside of it.
+    if (ptrauth_hold_process(current->tgid)) {
+        fp->private_data = ctx;
+        return 0;
+    }
+
+    ptrauth_new_key(&key_low, &key_high);
+
+    info = ptrauth_alloc_process(current->tgid, key_low, key_high, PTRAUTH_POLICY_DEFAULT, GFP_KERNEL);
+    if (info == NULL) {
+        trace_ptrauth_table_full(current->tgid, atomic_read(&process_count));
+        pa_err("[open] cannot allocate a key for process %d\n", current->tgid);
+        kfree(ctx);
+        return -ENOMEM;
+    }
+    info->files = 1;
+
+    spin_lock(&process_lock);
+    rcu_read_lock();
+
+    // Another thread may have opened it meanwhile
+    existing = ptrauth_find_process(current->tgid);
+    if (existing == NULL) {
+        if (ptrauth_insert_process(info) != 0) {
+            rcu_read_unlock();
+            spin_unlock(&process_lock);
+            kmem_cache_free(process_cache, info);
+            kfree(ctx);
+            trace_ptrauth_table_full(current->tgid, atomic_read(&process_count));
+            pa_err("[open] cannot insert a key for process %d\n", current->tgid);
+            return -ENOMEM;
+        }
+        pa_info("[open] assigned a key to process %d\n", current->tgid);
+        info = NULL;
+    } else {
+        existing->files++;
+    }
+
+    rcu_read_unlock();
+    spin_unlock(&process_lock);
+
+    fp->private_data = ctx;
+
+    if (info != NULL)
+        kmem_cache_free(process_cache, info);
+
+    return 0;
+}
+
+static int ptrauth_release(struct inode *inod, struct file *fp) {
+    struct ptrauth_file *ctx = fp->private_data;
+    struct ptrauth_device *dev = ctx->dev;
+    pid_t tgid = ctx->tgid;
+    uint64_t key_low, key_high;
+    bool has_key;
+
+    // Mappings hold a reference to the file, so the ring is no longer mapped
+    vfree(ctx->ring);
+    kfree(ctx);
+
+    if (dev != NULL && lazy_keys) {
+        // Leave the instance alone if another process owns the window
+        mutex_lock(&dev->lazy_lock);
+        if (dev->lazy_owner == tgid) {
+            // Windows the process mapped through its other files fault
+            // and get the key back
+            unmap_mapping_range(dev->inode->i_mapping, 0, PAGE_SIZE, 1);
+            ptrauth_wipe_key(dev);
+            dev->lazy_owner = 0;
+            dev->lazy_key_low = 0;
+            dev->lazy_key_high = 0;
+        }
+        mutex_unlock(&dev->lazy_lock);
+
+        pa_info("[release] freeing process %d\n", tgid);
+        ptrauth_release_process(tgid);
+        return 0;
+    }
+
+    // Only wipe the instances still holding the dropped key: the one of the
+    // file and the one the ioctls of this CPU use. Processes that never
+    // reached the device close without any MMIO.
+    has_key = ptrauth_lookup_key(tgid, &key_low, &key_high, NULL);
+
+    pa_info("[release] freeing process %d\n", tgid);
+    if (ptrauth_release_process(tgid) && has_key && dev != NULL) {
+        struct ptrauth_device *candidates[2];
+
+        preempt_disable();
+        candidates[0] = dev;
+        candidates[1] = ptrauth_cpu_device(dev);
+        for (int i = 0; i < ARRAY_SIZE(candidates); i++) {
+            if (ptrauth_holds_key(candidates[i], key_low, key_high))
+                ptrauth_wipe_key(candidates[i]);
+        }
+        preempt_enable();
+    }
+
+    return 0;
+}
+
+static ssize_t ptrauth_read(struct file *fp, char *user_buffer, size_t user_len, loff_t *off) {
+    struct ptrauth_device *dev = ((struct ptrauth_file *)fp->private_data)->dev;
+
+    pa_info("[read] entering read\n");
+
+    if (dev == NULL)
+        return -ENODEV;
+
+    uint64_t key_high = ptrauth_readq(dev, dev->key_high);
+    uint64_t key_low = ptrauth_readq(dev, dev->key_low);
+
+    pa_info("[read] key: %016llx%016llx\n", key_high, key_low);
+    return 0;
+}
+
+static ssize_t ptrauth_write(struct file *fp, const char *user_buffer, size_t user_len, loff_t *off) {
+    pa_info("[write] entering write\n");
+    return 0;
+}
+
+// ==== Batched Operations ====
+
+// Operations processed per preemption-disabled section
+#define PTRAUTH_BATCH_CHUNK (PAGE_SIZE / sizeof(struct ptrauth_op))
+
+// Batched operations run on the instance local to the CPU and use the
+// caller's key, which the instance does not hold if the caller has not
+// mapped its window. In lazy mode the key of the window owner is put back
+// once the chunk is done.
+//
+// The instance may be shared with other CPUs: key_lock is held from
+// ptrauth_batch_begin() to ptrauth_batch_end(), so that neither their
+// switch path nor their batches load another key in the middle of the
+// chunk. In lazy mode lazy_lock is held as well, for the window owner and
+// its key to stay the ones put back. The chunk runs with preemption
+// disabled, from the spinlock. Callers without a key get -EACCES instead
+// of signing with whatever key is loaded.
+static int ptrauth_batch_begin(struct ptrauth_device *dev) {
+    uint64_t key_low, key_high;
+
+    if (!ptrauth_lookup_key(current->tgid, &key_low, &key_high, NULL))
+        return -EACCES;
+
+    if (lazy_keys)
+        mutex_lock(&dev->lazy_lock);
+    raw_spin_lock(&dev->key_lock);
+    WRITE_ONCE(dev->owner, current->tgid);
+    __ptrauth_switch_key(dev, current->tgid, key_low, key_high);
+
+    return 0;
+}
+
+static void ptrauth_batch_end(struct ptrauth_device *dev) {
+    if (lazy_keys) {
+        WRITE_ONCE(dev->owner, dev->lazy_owner);
+        __ptrauth_switch_key(dev, dev->lazy_owner, dev->lazy_key_low, dev->lazy_key_high);
+    }
+
+    raw_spin_unlock(&dev->key_lock);
+    if (lazy_keys)
+        mutex_unlock(&dev->lazy_lock);
+}
+
+// Instance of a batch chunk, the one local to the CPU the caller runs on.
+// Taken before the locks, a migration meanwhile only costs locality.
+static struct ptrauth_device *ptrauth_batch_device(struct ptrauth_device *fallback) {
+    struct ptrauth_device *dev = raw_cpu_read(local_device);
+
+    return dev != NULL ? dev : fallback;
+}
+
+// Signatures are stored above the 48-bit address
+#define PTRAUTH_VA_MASK GENMASK_ULL(47, 0)
+
+// Re-sign a chunk with the current key, which ptrauth_batch_begin() loaded.
+// Pointers that do not match are checked against the previous key in a
+// second pass, so the key is switched at most twice per chunk.
+static void ptrauth_resign_chunk(struct ptrauth_device *dev, struct ptrauth_op *ops, uint32_t n) {
+    uint64_t key_low = 0, key_high = 0, prev_low, prev_high;
+    uint32_t stale = 0;
+    bool has_prev;
+
+    for (uint32_t i = 0; i < n; i++) {
+        ops[i].result = ptrauth_sign(dev, ops[i].pointer & PTRAUTH_VA_MASK, ops[i].tweak);
+        stale += ops[i].result != ops[i].pointer;
+    }
+    if (stale == 0)
+        return;
+
+    has_prev = ptrauth_lookup_previous_key(current->tgid, &prev_low, &prev_high);
+    if (has_prev) {
+        ptrauth_lookup_key(current->tgid, &key_low, &key_high, NULL);
+        __ptrauth_switch_key(dev, current->tgid, prev_low, prev_high);
+    }
+
+    for (uint32_t i = 0; i < n; i++) {
+        if (ops[i].result == ops[i].pointer)
+            continue;
+
+        if (has_prev && ptrauth_sign(dev, ops[i].pointer & PTRAUTH_VA_MASK, ops[i].tweak) == ops[i].pointer) {
+            ptrauth_stat_inc(resigns);
+        } else {
+            ops[i].result = 0;
+            ptrauth_stat_inc(resign_failures);
+        }
+    }
+
+    if (has_prev)
+        __ptrauth_switch_key(dev, current->tgid, key_low, key_high);
+}
+
+static long ptrauth_ioctl_batch(struct ptrauth_file *ctx, unsigned long arg, bool sign) {
+    struct ptrauth_device *dev;
+    struct ptrauth_batch batch;
+    struct ptrauth_op __user *user_ops;
+    struct ptrauth_op *ops;
+    bool resign;
+    long ret = 0;
+
+    if (copy_from_user(&batch, (void __user *)arg, sizeof(batch)))
+        return -EFAULT;
+
+    if (batch.flags & ~PTRAUTH_BATCH_RESIGN)
+        return -EINVAL;
+
+    resign = batch.flags & PTRAUTH_BATCH_RESIGN;
+    if (resign && !sign)
+        return -EINVAL;
+
+    user_ops = u64_to_user_ptr(batch.ops);
+
+    ops = (struct ptrauth_op *)__get_free_page(GFP_KERNEL);
+    if (ops == NULL)
+        return -ENOMEM;
+
+    for (uint32_t done = 0; done < batch.count; ) {
+        uint32_t n = min_t(uint32_t, batch.count - done, PTRAUTH_BATCH_CHUNK);
+
+        if (copy_from_user(ops, user_ops + done, n * sizeof(*ops))) {
+            ret = -EFAULT;
+            break;
+        }
+
+        // Drive the device back-to-back
+        dev = ptrauth_batch_device(ctx->dev);
+        ret = ptrauth_batch_begin(dev);
+        if (ret != 0)
+            break;
+        if (resign) {
+            ptrauth_resign_chunk(dev, ops, n);
+        } else {
+            for (uint32_t i = 0; i < n; i++) {
+                ops[i].result = sign ? ptrauth_sign(dev, ops[i].pointer, ops[i].tweak)
+                                     : ptrauth_auth(dev, ops[i].pointer, ops[i].tweak);
+            }
+        }
+        ptrauth_batch_end(dev);
+
+        if (copy_to_user(user_ops + done, ops, n * sizeof(*ops))) {
+            ret = -EFAULT;
+            break;
+        }
+
+        done += n;
+        cond_resched();
+    }
+
+    free_page((unsigned long)ops);
+    return ret;
+}
+
+// Process the ring entries published by userspace, returns how many were
+// processed.
+static long ptrauth_ioctl_ring_submit(struct ptrauth_file *ctx) {
+    struct ptrauth_ring_header *ring;
+    struct ptrauth_device *dev;
+    uint32_t head, pending, done;
+    long ret = 0;
+
+    mutex_lock(&ctx->ring_lock);
+
+    ring = ctx->ring;
+    if (ring == NULL) {
+        mutex_unlock(&ctx->ring_lock);
+        return -ENXIO;
+    }
+
+    // Pairs with the release store of head in userspace
+    head = smp_load_acquire(&ring->head);
+    pending = head - ctx->ring_tail;
+    if (pending > ctx->ring_entries) {
+        mutex_unlock(&ctx->ring_lock);
+        return -EINVAL;
+    }
+
+    for (done = 0; done < pending; ) {
+        uint32_t n = min_t(uint32_t, pending - done, PTRAUTH_BATCH_CHUNK);
+
+        dev = ptrauth_batch_device(ctx->dev);
+        ret = ptrauth_batch_begin(dev);
+        if (ret != 0)
+            break;
+        for (uint32_t i = 0; i < n; i++) {
+            struct ptrauth_ring_entry *entry = &ring->entries[(ctx->ring_tail + done + i) % ctx->ring_entries];
+            uint64_t pointer = READ_ONCE(entry->pointer);
+            uint64_t tweak = READ_ONCE(entry->tweak);
+
+            switch (READ_ONCE(entry->op)) {
+            case PTRAUTH_OP_SIGN:
+                WRITE_ONCE(entry->result, ptrauth_sign(dev, pointer, tweak));
+                WRITE_ONCE(entry->status, 0);
+                break;
+            case PTRAUTH_OP_AUTH:
+                WRITE_ONCE(entry->result, ptrauth_auth(dev, pointer, tweak));
+                WRITE_ONCE(entry->status, 0);
+                break;
+            default:
+                WRITE_ONCE(entry->result, 0);
+                WRITE_ONCE(entry->status, EINVAL);
+                break;
+            }
+        }
+        ptrauth_batch_end(dev);
+
+        done += n;
+        cond_resched();
+    }
+
+    // Only the entries processed are consumed
+    ctx->ring_tail += done;
+    // Results are visible before the new tail
+    smp_store_release(&ring->tail, ctx->ring_tail);
+
+    mutex_unlock(&ctx->ring_lock);
+
+    return done > 0 ? done : ret;
 }
 
-static int ptrauth_open(struct inode *inod, struct file *fp) {
-    pa_info("[open] fp open\n");
-    int process_index = -1;
+static long ptrauth_ioctl_get_auth_failures(unsigned long arg) {
+    struct ptrauth_process_info *info;
+    __u64 failures = 0;
 
-    for (int i = 0; i < MAX_PROCESS; i++) {
-        if (!process_table[i].valid) {
-            process_table[i].valid = true;
-            process_index = i;
-            break;
-        }
-    }
+    rcu_read_lock();
+    info = ptrauth_find_process(current->tgid);
+    if (info != NULL)
+        failures = atomic_read(&info->auth_failures);
+    rcu_read_unlock();
 
-    if (process_index == -1) {
-        pa_err("[open] too many processess open, cannot allocate new one.");
-        return -EMFILE;
-    }
+    if (copy_to_user((void __user *)arg, &failures, sizeof(failures)))
+        return -EFAULT;
 
-    pa_info("[open] assigning index %d to process %d\n", process_index, current->pid);
+    return 0;
+}
 
-    // Generate a new random key
-    get_random_bytes(&process_table[process_index].key_low, sizeof(uint64_t));
-    get_random_bytes(&process_table[process_index].key_high, sizeof(uint64_t));
+static long ptrauth_ioctl_get_policy(unsigned long arg) {
+    struct ptrauth_process_info *info;
+    __u32 policy;
 
-    process_table[process_index].pid = current->pid;
+    rcu_read_lock();
+    info = ptrauth_find_process(current->tgid);
+    if (info == NULL) {
+        rcu_read_unlock();
+        return -ENOENT;
+    }
+    policy = READ_ONCE(info->policy);
+    rcu_read_unlock();
 
-    ptrauth_set_key(process_table[process_index].key_low, process_table[process_index].key_high);
+    if (copy_to_user((void __user *)arg, &policy, sizeof(policy)))
+        return -EFAULT;
 
     return 0;
 }
 
-static int ptrauth_release(struct inode *inod, struct file *fp) {
-    ptrauth_clear_ciphertext();
-    ptrauth_set_key(0, 0);
+static long ptrauth_ioctl_set_policy(unsigned long arg) {
+    struct ptrauth_process_info *info;
+    __u32 policy;
+    long ret = 0;
+
+    if (copy_from_user(&policy, (void __user *)arg, sizeof(policy)))
+        return -EFAULT;
+    if (policy & ~PTRAUTH_POLICY_MASK)
+        return -EINVAL;
+
+    // Under process_lock: a rekey racing with the update (exec, rotation)
+    // copies the policy into the entry replacing this one, and would copy
+    // the old one
+    spin_lock(&process_lock);
+    rcu_read_lock();
+    info = ptrauth_find_process(current->tgid);
+    if (info != NULL)
+        WRITE_ONCE(info->policy, policy);
+    else
+        ret = -ENOENT;
+    rcu_read_unlock();
+    spin_unlock(&process_lock);
+
+    return ret;
+}
 
-    pa_info("[release] freeing process %d\n", current->pid);
-    for (int i = 0; i < MAX_PROCESS; i++) {
-        if (process_table[i].pid == current->pid && process_table[i].valid) {
-            process_table[i].valid = false;
-            process_table[i].key_high = 0;
-            process_table[i].key_low = 0;
+// The instances still holding the previous key of the caller get the new
+// one: the instance its window is mapped on, or in lazy mode the ones whose
+// window it owns. Batches load the key themselves.
+static void ptrauth_reload_key(pid_t tgid, uint64_t key_low, uint64_t key_high) {
+    struct ptrauth_device *dev;
+    uint64_t mapped_low, mapped_high;
+    unsigned long instances;
+
+    if (!lazy_keys) {
+        if (!ptrauth_lookup_mapped_key(tgid, &mapped_low, &mapped_high, &instances))
+            return;
+
+        preempt_disable();
+        ptrauth_load_mapped_key(tgid, key_low, key_high, instances);
+        preempt_enable();
+        return;
+    }
 
-            pa_info("[release] freed index %d\n", i);
-            break;
+    mutex_lock(&instances_lock);
+    for (int i = 0; i < PTRAUTH_MAX_INSTANCES; i++) {
+        dev = ptrauth_instances[i];
+        if (dev == NULL)
+            continue;
+
+        mutex_lock(&dev->lazy_lock);
+        if (dev->lazy_owner == tgid) {
+            WRITE_ONCE(dev->lazy_key_low, key_low);
+            WRITE_ONCE(dev->lazy_key_high, key_high);
+            preempt_disable();
+            ptrauth_switch_key(dev, tgid, key_low, key_high);
+            preempt_enable();
         }
+        mutex_unlock(&dev->lazy_lock);
     }
+    mutex_unlock(&instances_lock);
+}
+
+static long ptrauth_ioctl_rotate_key(unsigned long arg) {
+    uint64_t key_low, key_high;
+    __u64 user_epoch;
+    u32 epoch;
+    int ret;
+
+    ret = ptrauth_rekey_process(current->tgid, true, &key_low, &key_high, &epoch, GFP_KERNEL);
+    if (ret != 0)
+        return ret;
+
+    ptrauth_reload_key(current->tgid, key_low, key_high);
+
+    ptrauth_stat_inc(key_rotations);
+    trace_ptrauth_key_rotate(current->tgid, epoch);
+
+    user_epoch = epoch;
+    if (copy_to_user((void __user *)arg, &user_epoch, sizeof(user_epoch)))
+        return -EFAULT;
 
     return 0;
 }
 
-static ssize_t ptrauth_read(struct file *fp, char *user_buffer, size_t user_len, loff_t *off) {
-    pa_info("[read] entering read\n");
+static long ptrauth_ioctl_get_info(unsigned long arg) {
+    struct ptrauth_info info = {
+        .engine = PTRAUTH_ENGINE_HW,
+        .flags = PTRAUTH_INFO_MAPPABLE | PTRAUTH_INFO_SHARED | PTRAUTH_INFO_ROTATE,
+    };
+
+    if (static_branch_unlikely(&ptrauth_soft_engine)) {
+        info.engine = PTRAUTH_ENGINE_SOFT;
+        info.flags &= ~PTRAUTH_INFO_MAPPABLE;
+    }
+    if (lazy_keys)
+        info.flags |= PTRAUTH_INFO_LAZY_KEYS;
 
-    uint64_t key_high = readq(global_device.key_high);
-    uint64_t key_low = readq(global_device.key_low);
+    if (copy_to_user((void __user *)arg, &info, sizeof(info)))
+        return -EFAULT;
 
-    pa_info("[read] key: %016llx%016llx\n", key_high, key_low);
     return 0;
 }
 
-static ssize_t ptrauth_write(struct file *fp, const char *user_buffer, size_t user_len, loff_t *off) {
-    pa_info("[write] entering write\n");
-    return 0;
+static long ptrauth_ioctl(struct file *fp, unsigned int cmd, unsigned long arg) {
+    struct ptrauth_file *ctx = fp->private_data;
+
+    if (ctx->dev == NULL)
+        return -ENODEV;
+
+    switch (cmd) {
+    case PTRAUTH_IOC_SIGN_BATCH:
+        return ptrauth_ioctl_batch(ctx, arg, true);
+    case PTRAUTH_IOC_AUTH_BATCH:
+        return ptrauth_ioctl_batch(ctx, arg, false);
+    case PTRAUTH_IOC_RING_SUBMIT:
+        return ptrauth_ioctl_ring_submit(ctx);
+    case PTRAUTH_IOC_GET_AUTH_FAILURES:
+        return ptrauth_ioctl_get_auth_failures(arg);
+    case PTRAUTH_IOC_GET_POLICY:
+        return ptrauth_ioctl_get_policy(arg);
+    case PTRAUTH_IOC_SET_POLICY:
+        return ptrauth_ioctl_set_policy(arg);
+    case PTRAUTH_IOC_GET_INFO:
+        return ptrauth_ioctl_get_info(arg);
+    case PTRAUTH_IOC_ROTATE_KEY:
+        return ptrauth_ioctl_rotate_key(arg);
+    default:
+        return -ENOTTY;
+    }
 }
 
 // ==== Interrupts ====
+
+// Signal delivered to a task whose authentication failed
+static int fault_signal = SIGUSR1;
+module_param(fault_signal, int, 0644);
+MODULE_PARM_DESC(fault_signal, "Signal sent to a task on authentication failure (default SIGUSR1, 0 to disable)");
+
+// Owners of the failures raised by the device, queued by the hard IRQ
+// handler and consumed by the IRQ thread. Failures past the fifo capacity
+// are only counted.
+static DEFINE_KFIFO(fault_fifo, pid_t, 64);
+static DEFINE_SPINLOCK(fault_fifo_lock);
+
+static DEFINE_RATELIMIT_STATE(fault_ratelimit, 5 * HZ, 10);
+
 static irqreturn_t ptrauth_irq_handler(int irq, void *data) {
-    pa_info("[irq_handler] invalid pointer found.\n");
+    struct ptrauth_device *dev = data;
+    pid_t owner = READ_ONCE(dev->owner);
 
     // Clear interrupt
-    writeq(1, global_device.control);
+    ptrauth_writeq(dev, 1, dev->control);
 
-    // Send SIGUSR1
-    kill_pid(find_vpid(current->pid), SIGUSR1, 0);
+    ptrauth_stat_inc(auth_failures);
+    if (!kfifo_in_spinlocked(&fault_fifo, &owner, 1, &fault_fifo_lock))
+        ptrauth_stat_inc(faults_dropped);
 
-    return IRQ_HANDLED;
+    return IRQ_WAKE_THREAD;
 }
 
+static irqreturn_t ptrauth_irq_thread(int irq, void *data) {
+    struct ptrauth_process_info *info;
+    int signal = READ_ONCE(fault_signal);
+    struct pid *pid;
+    pid_t owner;
+
+    while (kfifo_out_spinlocked(&fault_fifo, &owner, 1, &fault_fifo_lock)) {
+        int failures = 0;
+
+        if (__ratelimit(&fault_ratelimit)) {
+            pa_err("[irq] invalid pointer authenticated by pid %d\n", owner);
+        }
+
+        // An untracked task was running, nobody to blame
+        if (owner == 0) {
+            trace_ptrauth_auth_failure(owner, failures);
+            continue;
+        }
+
+        rcu_read_lock();
+        info = ptrauth_find_process(owner);
+        if (info != NULL)
+            failures = atomic_inc_return(&info->auth_failures);
+        rcu_read_unlock();
+
+        trace_ptrauth_auth_failure(owner, failures);
+
+        if (signal <= 0 || !valid_signal(signal))
+            continue;
+
+        pid = find_get_pid(owner);
+        if (pid != NULL) {
+            kill_pid(pid, signal, 1);
+            put_pid(pid);
+        }
+    }
+
+    return IRQ_HANDLED;
+}
 
 // ==== Platform Device ====
 
@@ -224,167 +1752,719 @@ static struct platform_driver pa_driver = {
         .name = DRIVER_NAME,
         .owner = THIS_MODULE,
         .of_match_table = pa_driver_of_match,
+        // Unbinding under running processes is not supported, the device
+        // goes away with the module, see ptrauth_remove()
+        .suppress_bind_attrs = true,
     },
     .probe = ptrauth_probe,
     .remove = ptrauth_remove
 };
 
 
+static void ptrauth_setup_registers(struct ptrauth_device *dev) {
+    dev->key_low  = dev->priviledged_base;
+    dev->key_high = dev->priviledged_base + 0x8;
+    dev->control  = dev->priviledged_base + 0x10;
+
+    dev->plaintext  = dev->unpriviledged_base + 0x10;
+    dev->tweak      = dev->unpriviledged_base + 0x18;
+    dev->ciphertext = dev->unpriviledged_base + 0x20;
+
+    // Device content is unknown, force the first switch to load a key
+    dev->key_cpu = -1;
+}
+
+// CPUs listed in the "cpus" property of the node, or every CPU that is not
+// local to another instance yet. Called with instances_lock held.
+static int ptrauth_of_cpus(struct ptrauth_device *dev) {
+    struct device_node *np = dev_of_node(&dev->pdev->dev);
+    int count = of_count_phandle_with_args(np, "cpus", NULL);
+    int cpu;
+
+    if (count <= 0) {
+        for_each_possible_cpu(cpu) {
+            if (per_cpu(local_device, cpu) == NULL)
+                cpumask_set_cpu(cpu, &dev->cpus);
+        }
+        return cpumask_empty(&dev->cpus) ? -EBUSY : 0;
+    }
+
+    for (int i = 0; i < count; i++) {
+        struct device_node *cpu_np = of_parse_phandle(np, "cpus", i);
+
+        cpu = of_cpu_node_to_id(cpu_np);
+        of_node_put(cpu_np);
+
+        if (cpu < 0) {
+            pa_err("[probe] invalid cpu at index %d\n", i);
+            return -EINVAL;
+        }
+        if (per_cpu(local_device, cpu) != NULL) {
+            pa_err("[probe] cpu %d already has an instance\n", cpu);
+            return -EBUSY;
+        }
+        cpumask_set_cpu(cpu, &dev->cpus);
+    }
+
+    return 0;
+}
+
+// Emulated instance N is local to the Nth share of the CPUs
+static int ptrauth_soft_cpus(struct ptrauth_device *dev) {
+    unsigned int instances = min(soft_instances, nr_cpu_ids);
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        if (cpu * instances / nr_cpu_ids == dev->pdev->id)
+            cpumask_set_cpu(cpu, &dev->cpus);
+    }
+
+    return cpumask_empty(&dev->cpus) ? -ENODEV : 0;
+}
+
+// Give a probed instance an id, its CPUs and its /dev/ptrauthN, then
+// publish it to the switch path
+static int ptrauth_add_instance(struct ptrauth_device *dev) {
+    struct device *char_device;
+    int cpu, id, ret;
+
+    mutex_lock(&instances_lock);
+
+    for (id = 0; id < PTRAUTH_MAX_INSTANCES && ptrauth_instances[id] != NULL; id++)
+        ;
+    if (id == PTRAUTH_MAX_INSTANCES) {
+        pa_err("[probe] too many instances\n");
+        ret = -ENOSPC;
+        goto out;
+    }
+
+    ret = dev->soft != NULL ? ptrauth_soft_cpus(dev) : ptrauth_of_cpus(dev);
+    if (ret != 0)
+        goto out;
+
+    dev->inode = alloc_anon_inode(ptrauth_mnt->mnt_sb);
+    if (IS_ERR(dev->inode)) {
+        ret = PTR_ERR(dev->inode);
+        goto out;
+    }
+
+    char_device = device_create_with_groups(
+        pa_drvr_data.driver_class,
+        &dev->pdev->dev,
+        MKDEV(MAJOR(pa_drvr_data.device_number), id + 1),
+        dev,
+        ptrauth_instance_groups,
+        DEVICE_NAME "%d", id
+    );
+    if (IS_ERR(char_device)) {
+        ret = PTR_ERR(char_device);
+        iput(dev->inode);
+        goto out;
+    }
+
+    dev->id = id;
+    WRITE_ONCE(ptrauth_instances[id], dev);
+    for_each_cpu(cpu, &dev->cpus)
+        smp_store_release(per_cpu_ptr(&local_device, cpu), dev);
+    if (default_device == NULL)
+        smp_store_release(&default_device, dev);
+
+    pa_info("[probe] instance %d on cpus %*pbl\n", id, cpumask_pr_args(&dev->cpus));
+
+out:
+    mutex_unlock(&instances_lock);
+    return ret;
+}
+
+// Nothing uses the instance anymore, see ptrauth_remove()
+static void ptrauth_del_instance(struct ptrauth_device *dev) {
+    int cpu;
+
+    mutex_lock(&instances_lock);
+
+    for_each_cpu(cpu, &dev->cpus)
+        WRITE_ONCE(per_cpu(local_device, cpu), NULL);
+    WRITE_ONCE(ptrauth_instances[dev->id], NULL);
+
+    if (default_device == dev) {
+        struct ptrauth_device *other = NULL;
+
+        for (int i = 0; other == NULL && i < PTRAUTH_MAX_INSTANCES; i++)
+            other = ptrauth_instances[i];
+        WRITE_ONCE(default_device, other);
+    }
+
+    device_destroy(pa_drvr_data.driver_class, MKDEV(MAJOR(pa_drvr_data.device_number), dev->id + 1));
+    iput(dev->inode);
+
+    mutex_unlock(&instances_lock);
+}
+
+// The emulated device has no resources: its registers are in a
+// ptrauth_soft_device
+static int ptrauth_soft_probe(struct platform_device *pdev) {
+    struct ptrauth_soft_device *soft;
+    struct ptrauth_device *dev;
+    int ret;
+
+    pa_info("[probe] using the software engine\n");
+
+    dev = kzalloc(sizeof(*dev), GFP_KERNEL);
+    soft = kzalloc(sizeof(*soft), GFP_KERNEL);
+    if (dev == NULL || soft == NULL) {
+        ret = -ENOMEM;
+        goto err;
+    }
+
+    soft->dev = dev;
+    INIT_WORK(&soft->fault_work, ptrauth_soft_fault_work);
+
+    dev->pdev = pdev;
+    dev->soft = soft;
+    raw_spin_lock_init(&dev->key_lock);
+    mutex_init(&dev->lazy_lock);
+
+    dev->priviledged_base = (void __iomem __force *)soft->priviledged;
+    dev->unpriviledged_base = (void __iomem __force *)soft->unpriviledged;
+    dev->priviledged_size = sizeof(soft->priviledged);
+    dev->unpriviledged_size = sizeof(soft->unpriviledged);
+
+    ptrauth_setup_registers(dev);
+
+    ret = ptrauth_add_instance(dev);
+    if (ret != 0)
+        goto err;
+
+    platform_set_drvdata(pdev, dev);
+
+    return 0;
+
+err:
+    kfree(soft);
+    kfree(dev);
+    return ret;
+}
+
 static int ptrauth_probe(struct platform_device *pdev) {
     struct resource *regs_first, *regs_second;
-    int irq;
+    struct ptrauth_device *dev;
+    int irq, ret;
+
+    // With engine=soft only the emulated devices, which have no devicetree
+    // node, are driven
+    if (static_branch_unlikely(&ptrauth_soft_engine)) {
+        if (dev_of_node(&pdev->dev) != NULL)
+            return -ENODEV;
+        return ptrauth_soft_probe(pdev);
+    }
 
     pa_info("[probe] device found\n");
 
     regs_first  = platform_get_resource(pdev, IORESOURCE_MEM, 0);
     regs_second = platform_get_resource(pdev, IORESOURCE_MEM, 1);
+    if (regs_first == NULL || regs_second == NULL) {
+        pa_err("[probe] missing register regions\n");
+        return -ENODEV;
+    }
 
     irq = platform_get_irq(pdev, 0);
+    if (irq < 0)
+        return irq;
+
+    dev = kzalloc(sizeof(*dev), GFP_KERNEL);
+    if (dev == NULL)
+        return -ENOMEM;
 
-    global_device.priviledged_start = regs_first->start;
-    global_device.priviledged_size  = regs_first->end - regs_first->start + 1;
+    dev->pdev = pdev;
+    raw_spin_lock_init(&dev->key_lock);
+    mutex_init(&dev->lazy_lock);
 
-    global_device.unpriviledged_start = regs_second->start;
-    global_device.unpriviledged_size  = regs_second->end - regs_second->start + 1;
+    dev->priviledged_start = regs_first->start;
+    dev->priviledged_size  = resource_size(regs_first);
 
-    global_device.priviledged_base = ioremap(global_device.priviledged_start, global_device.priviledged_size);
-    global_device.unpriviledged_base = ioremap(global_device.unpriviledged_start, global_device.unpriviledged_size);
+    dev->unpriviledged_start = regs_second->start;
+    dev->unpriviledged_size  = resource_size(regs_second);
 
-    global_device.key_low  = global_device.priviledged_base;
-    global_device.key_high = global_device.priviledged_base + 0x8;
-    global_device.control  = global_device.priviledged_base + 0x10;
+    dev->priviledged_base = ioremap(dev->priviledged_start, dev->priviledged_size);
+    if (dev->priviledged_base == NULL) {
+        ret = -ENOMEM;
+        goto err;
+    }
+
+    dev->unpriviledged_base = ioremap(dev->unpriviledged_start, dev->unpriviledged_size);
+    if (dev->unpriviledged_base == NULL) {
+        ret = -ENOMEM;
+        goto err_unmap_priviledged;
+    }
 
-    global_device.plaintext  = global_device.unpriviledged_base + 0x10;
-    global_device.tweak      = global_device.unpriviledged_base + 0x18;
-    global_device.ciphertext = global_device.unpriviledged_base + 0x20;
+    ptrauth_setup_registers(dev);
 
     pa_info("[probe] priv: { start: %llx, size: %llx }, unpriv: {start: %llx, size: %llx }\n",
-            global_device.priviledged_start, global_device.priviledged_size,
-            global_device.unpriviledged_start, global_device.unpriviledged_size);
+            dev->priviledged_start, dev->priviledged_size,
+            dev->unpriviledged_start, dev->unpriviledged_size);
 
     // register the interrupt
-    int rc = request_irq(irq, ptrauth_irq_handler, 0, DEVICE_NAME, &global_device);
-
-    if (rc) {
-        pa_err("[probe] cannot register request: %d\n", rc);
-        return -EIO;
+    ret = request_threaded_irq(irq, ptrauth_irq_handler, ptrauth_irq_thread, 0, DEVICE_NAME, dev);
+    if (ret != 0) {
+        pa_err("[probe] cannot register request: %d\n", ret);
+        goto err_unmap_unpriviledged;
     }
+    dev->irq = irq;
+
+    ret = ptrauth_add_instance(dev);
+    if (ret != 0)
+        goto err_free_irq;
+
+    platform_set_drvdata(pdev, dev);
+
     return 0;
+
+err_free_irq:
+    free_irq(irq, dev);
+err_unmap_unpriviledged:
+    iounmap(dev->unpriviledged_base);
+err_unmap_priviledged:
+    iounmap(dev->priviledged_base);
+err:
+    kfree(dev);
+    return ret;
 }
 
-// TODO: Implement
+// Only called on module unload: bind attributes are suppressed, and the
+// tracepoints are gone and no file is open by the time the driver is
+// unregistered, so nothing can touch the registers concurrently.
 static int ptrauth_remove(struct platform_device *pdev) {
+    struct ptrauth_device *dev = platform_get_drvdata(pdev);
+
+    pa_info("[remove] releasing instance %d\n", dev->id);
+
+    ptrauth_del_instance(dev);
+
+    // Do not leave the last key behind in the device
+    ptrauth_writeq(dev, 0, dev->key_low);
+    ptrauth_writeq(dev, 0, dev->key_high);
+
+    if (dev->soft != NULL) {
+        // The fault work runs the IRQ thread
+        cancel_work_sync(&dev->soft->fault_work);
+        kfree(dev->soft);
+    } else {
+        // Waits for a running handler and IRQ thread
+        free_irq(dev->irq, dev);
+        iounmap(dev->unpriviledged_base);
+        iounmap(dev->priviledged_base);
+    }
+
+    kfree(dev);
+
     return 0;
 }
 
-static int ptrauth_mmap(struct file *fp, struct vm_area_struct *vma) {
+static int ptrauth_mmap_ring(struct ptrauth_file *ctx, struct vm_area_struct *vma) {
+    size_t len = vma->vm_end - vma->vm_start;
     int status;
 
-    vma->vm_pgoff = global_device.unpriviledged_start >> PAGE_SHIFT;
-    pa_info("[mmap] address: %lx\n", vma->vm_pgoff);
+    mutex_lock(&ctx->ring_lock);
 
-    status = remap_pfn_range(vma, vma->vm_start, vma->vm_pgoff, vma->vm_end - vma->vm_start,vma->vm_page_prot);
+    // The first mapping decides the size of the ring
+    if (ctx->ring == NULL) {
+        if (len > PTRAUTH_RING_MAX_PAGES * PAGE_SIZE) {
+            mutex_unlock(&ctx->ring_lock);
+            return -EINVAL;
+        }
+
+        ctx->ring = vmalloc_user(len);
+        if (ctx->ring == NULL) {
+            mutex_unlock(&ctx->ring_lock);
+            return -ENOMEM;
+        }
+
+        ctx->ring_bytes = len;
+        ctx->ring_entries = (len - sizeof(*ctx->ring)) / sizeof(ctx->ring->entries[0]);
+        ctx->ring_tail = 0;
+        ctx->ring->size = ctx->ring_entries;
+    } else if (len > ctx->ring_bytes) {
+        mutex_unlock(&ctx->ring_lock);
+        return -EINVAL;
+    }
+
+    status = remap_vmalloc_range(vma, ctx->ring, 0);
+
+    mutex_unlock(&ctx->ring_lock);
 
     if (status != 0) {
-        pa_err("[mmap] cannot remap address space: %d\n", status);
-        return -EAGAIN;
+        pa_err("[mmap] cannot map the request ring: %d\n", status);
     }
-    return 0;
+    return status;
 }
 
-// ==== Kprobes ====
+// First access to the window by a process in lazy mode
+static vm_fault_t ptrauth_lazy_fault(struct vm_fault *vmf) {
+    struct vm_area_struct *vma = vmf->vma;
+    struct ptrauth_device *dev = ((struct ptrauth_file *)vma->vm_file->private_data)->dev;
+    uint64_t key_low, key_high;
+    pid_t tgid = current->tgid;
+    vm_fault_t ret;
+
+    ptrauth_stat_inc(lazy_faults);
+
+    mutex_lock(&dev->lazy_lock);
+
+    // Checked by mmap already, but a task sharing the address space may
+    // have no key of its own. Looked up under lazy_lock, which a rotation
+    // takes to update the key of the owner.
+    if (!ptrauth_lookup_key(tgid, &key_low, &key_high, NULL)) {
+        mutex_unlock(&dev->lazy_lock);
+        return VM_FAULT_SIGBUS;
+    }
+
+    // Revoke the window from the previous owner, it faults on its next
+    // access and gets its own key back. The address space of the instance
+    // holds every mapping of its window, through /dev/ptrauth or
+    // /dev/ptrauthN, and none of another instance.
+    if (dev->lazy_owner != tgid) {
+        unmap_mapping_range(dev->inode->i_mapping, 0, PAGE_SIZE, 1);
+        dev->lazy_owner = tgid;
+    }
+
+    WRITE_ONCE(dev->lazy_key_low, key_low);
+    WRITE_ONCE(dev->lazy_key_high, key_high);
+    WRITE_ONCE(dev->owner, tgid);
 
-static int ptrauth_sched_ret(struct kretprobe_instance *ri, struct pt_regs *regs);
-static int ptrauth_sched_entry(struct kretprobe_instance *ri, struct pt_regs *regs);
+    preempt_disable();
+    ptrauth_switch_key(dev, tgid, key_low, key_high);
+    preempt_enable();
 
-static struct kretprobe kret_sched = {
-    .handler = ptrauth_sched_ret,
-    .entry_handler = ptrauth_sched_entry,
-    .maxactive = MAX_PROCESS,
+    ret = vmf_insert_pfn(vma, vmf->address, dev->unpriviledged_start >> PAGE_SHIFT);
+
+    mutex_unlock(&dev->lazy_lock);
+
+    return ret;
+}
+
+static const struct vm_operations_struct ptrauth_lazy_vm_ops = {
+    .fault = ptrauth_lazy_fault,
 };
 
-static int ptrauth_fork_ret(struct kretprobe_instance *ri, struct pt_regs *regs);
+// The window is mapped eagerly otherwise, and the mappings are counted in
+// the key store so that the switch path skips the processes without one
+// and knows which instances to load the key into, counted per instance.
+// vm_private_data holds the process that mapped it.
+static int ptrauth_window_instance(struct vm_area_struct *vma) {
+    return ((struct ptrauth_file *)vma->vm_file->private_data)->dev->id;
+}
+
+static void ptrauth_window_open(struct vm_area_struct *vma) {
+    ptrauth_account_mapping((pid_t)(long)vma->vm_private_data, ptrauth_window_instance(vma), true);
+}
+
+static void ptrauth_window_close(struct vm_area_struct *vma) {
+    ptrauth_account_mapping((pid_t)(long)vma->vm_private_data, ptrauth_window_instance(vma), false);
+}
 
-static struct kretprobe kret_fork = {
-    .handler = ptrauth_fork_ret,
-    .maxactive = MAX_PROCESS,
+static const struct vm_operations_struct ptrauth_window_vm_ops = {
+    .open = ptrauth_window_open,
+    .close = ptrauth_window_close,
 };
 
-static int ptrauth_sched_ret(struct kretprobe_instance *ri, struct pt_regs *regs) {
-    ptrauth_clear_ciphertext();
+// The switch path loads the key into the instance local to the CPU when
+// the process mapped it, and into any other instance it mapped, see
+// ptrauth_load_mapped_key(). Only pinning processes to the CPUs of the
+// instance they map (see /sys/class/cfi_devices/ptrauthN/cpus) keeps
+// every key write local.
+static int ptrauth_mmap_window(struct ptrauth_device *dev, struct vm_area_struct *vma) {
+    uint64_t key_low = 0, key_high = 0;
+    pid_t tgid = current->tgid;
+    int status;
+
+    // Processes without a key would run with whatever key is loaded
+    if (!ptrauth_account_mapping(tgid, dev->id, true))
+        return -EACCES;
+
+    vma->vm_private_data = (void *)(long)tgid;
+    vma->vm_ops = &ptrauth_window_vm_ops;
 
-    if (kret_sched.nmissed > 0) {
-        pa_info("[sched_ret] missed %d schedules\n", kret_sched.nmissed);
+    status = io_remap_pfn_range(vma, vma->vm_start, dev->unpriviledged_start >> PAGE_SHIFT,
+                                PAGE_SIZE, vma->vm_page_prot);
+    if (status != 0) {
+        // A failed mmap is not closed
+        ptrauth_account_mapping(tgid, dev->id, false);
+        pa_err("[mmap] cannot remap address space: %d\n", status);
+        return status;
     }
 
-    for (int i = 0; i < MAX_PROCESS; i++) {
-        if (process_table[i].pid == current->pid && process_table[i].valid) {
-            ptrauth_set_key(process_table[i].key_low, process_table[i].key_high);
+    // From now on the switch path loads the key, until then it is ours
+    ptrauth_lookup_key(tgid, &key_low, &key_high, NULL);
+    preempt_disable();
+    WRITE_ONCE(dev->owner, tgid);
+    ptrauth_switch_key(dev, tgid, key_low, key_high);
+    preempt_enable();
+
+    return 0;
+}
 
-            return 0;
+// The shared page of the calling process, read-only for userspace. It is
+// not inherited: a child has a generation of its own and maps its page
+// again.
+static int ptrauth_mmap_shared(struct vm_area_struct *vma) {
+    struct ptrauth_process_info *info;
+    struct ptrauth_shared *page;
+    struct page *shared = NULL;
+    int ret;
+
+    if (vma->vm_end - vma->vm_start != PAGE_SIZE || (vma->vm_flags & VM_WRITE))
+        return -EINVAL;
+
+    // Allocated outside the lock, in case the process has no page yet
+    page = (struct ptrauth_shared *)get_zeroed_page(GFP_KERNEL);
+    if (page == NULL)
+        return -ENOMEM;
+
+    spin_lock(&process_lock);
+    rcu_read_lock();
+
+    info = ptrauth_find_process(current->tgid);
+    if (info != NULL) {
+        if (info->shared == NULL) {
+            page->generation = info->generation;
+            info->shared = page;
+            page = NULL;
         }
+        // The entry may be dropped as soon as the lock is released
+        shared = virt_to_page(info->shared);
+        get_page(shared);
     }
 
-    ptrauth_set_key(0, 0);
+    rcu_read_unlock();
+    spin_unlock(&process_lock);
 
-    return 0;
+    if (page != NULL)
+        free_page((unsigned long)page);
+    if (shared == NULL)
+        return -EACCES;
+
+    vm_flags_clear(vma, VM_MAYWRITE);
+    vm_flags_set(vma, VM_DONTCOPY | VM_DONTEXPAND);
+
+    ret = vm_insert_page(vma, vma->vm_start, shared);
+    put_page(shared);
+
+    return ret;
 }
 
-static int ptrauth_fork_ret(struct kretprobe_instance *ri, struct pt_regs *regs) {
-    pid_t child = regs->regs[0];
-    pid_t parent = current->pid;
+static int ptrauth_mmap(struct file *fp, struct vm_area_struct *vma) {
+    struct ptrauth_file *ctx = fp->private_data;
 
-    struct ptrauth_process_info *info = NULL;
+    if (vma->vm_pgoff == PTRAUTH_RING_PGOFF) {
+        return ptrauth_mmap_ring(ctx, vma);
+    }
 
-    // Find if parent has a registered key
-    for (int i = 0; i < MAX_PROCESS; i++) {
-        if (process_table[i].valid && process_table[i].pid == parent) {
-            info = &process_table[i];
-            break;
-        }
+    if (vma->vm_pgoff == PTRAUTH_SHARED_PGOFF) {
+        return ptrauth_mmap_shared(vma);
+    }
+
+    if (vma->vm_pgoff != 0) {
+        return -EINVAL;
+    }
+
+    // The software engine only exists behind the ioctls
+    if (static_branch_unlikely(&ptrauth_soft_engine) || ctx->dev == NULL) {
+        return -ENODEV;
+    }
+
+    // Exactly the register page, shared: a private mapping of device memory
+    // would be copy-on-write
+    if (vma->vm_end - vma->vm_start != PAGE_SIZE || !(vma->vm_flags & VM_SHARED))
+        return -EINVAL;
+
+    // Device memory, never inherited: children have a key of their own and
+    // map the window again
+    vm_flags_set(vma, VM_IO | VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP | VM_DONTCOPY);
+    vma->vm_page_prot = pgprot_device(vma->vm_page_prot);
+
+    pa_info("[mmap] instance %d registers at %llx\n", ctx->dev->id, ctx->dev->unpriviledged_start);
+
+    // Populated on first access, see ptrauth_lazy_fault(). The window is a
+    // single page so that revoking it never touches the ring. Processes
+    // without a key would run with whatever key is loaded, as in eager
+    // mode.
+    if (lazy_keys) {
+        uint64_t key_low, key_high;
+
+        if (!ptrauth_lookup_key(current->tgid, &key_low, &key_high, NULL))
+            return -EACCES;
+
+        vma->vm_ops = &ptrauth_lazy_vm_ops;
+        return 0;
+    }
+
+    return ptrauth_mmap_window(ctx->dev, vma);
+}
+
+// ==== Tracepoints ====
+
+// Scheduler tracepoints are not exported to modules, so they are looked up
+// by name among the kernel tracepoints.
+static struct ptrauth_tracepoint {
+    const char *name;
+    void *probe;
+    struct tracepoint *tp;
+    bool registered;
+} ptrauth_tracepoints[] = {
+    { .name = "sched_switch", .probe = ptrauth_sched_switch_probe },
+    { .name = "sched_process_fork", .probe = ptrauth_sched_fork_probe },
+    { .name = "sched_process_exec", .probe = ptrauth_sched_exec_probe },
+    { .name = "sched_process_exit", .probe = ptrauth_sched_exit_probe },
+};
+
+static void ptrauth_sched_switch_probe(void *ignore, bool preempt, struct task_struct *prev, struct task_struct *next, unsigned int prev_state) {
+    uint64_t key_low = 0, key_high = 0;
+    unsigned long instances;
+
+    ptrauth_stat_inc(switches);
+
+    // Keys are loaded by ptrauth_lazy_fault()
+    if (lazy_keys)
+        return;
+
+    // Tasks that cannot reach the registers leave the device alone, the
+    // ioctls load the key of their caller themselves
+    if (!ptrauth_lookup_mapped_key(next->tgid, &key_low, &key_high, &instances)) {
+        ptrauth_stat_inc(unmapped_skips);
+        return;
     }
 
+    ptrauth_load_mapped_key(next->tgid, key_low, key_high, instances);
+}
+
+// Runs in the parent before the child is woken up, so the child can never
+// be scheduled before its key is in the store.
+static void ptrauth_sched_fork_probe(void *ignore, struct task_struct *parent, struct task_struct *child) {
+    struct ptrauth_process_info *info, *parent_info;
+    uint64_t key_low, key_high;
+    u32 policy;
+
+    // New threads share the key of their thread group
+    if (child->tgid == parent->tgid)
+        return;
+
     // Parent did not have keys, can return safely
+    if (!ptrauth_lookup_key(parent->tgid, &key_low, &key_high, &policy)) {
+        return;
+    }
+
+    // Clone keys to children, unless the parent asked for a fresh one
+    if (!(policy & PTRAUTH_POLICY_INHERIT_ON_FORK))
+        ptrauth_new_key(&key_low, &key_high);
+
+    info = ptrauth_alloc_process(child->tgid, key_low, key_high, policy, GFP_ATOMIC);
     if (info == NULL) {
-        return 0;
+        trace_ptrauth_table_full(child->tgid, atomic_read(&process_count));
+        pa_err("[fork] cannot copy keys to pid %d\n", child->tgid);
+        return;
     }
 
-    // Clone keys to children
-    for (int i = 0; i < MAX_PROCESS; i++) {
-        if (!process_table[i].valid) {
-            process_table[i].valid = true;
-            process_table[i].pid = child;
-            process_table[i].key_high = info->key_high;
-            process_table[i].key_low = info->key_low;
-            pa_info("[fork_ret] copied keys from pid %d to pid %d\n", parent, child);
-            return 0;
-        }
+    spin_lock(&process_lock);
+    rcu_read_lock();
+
+    // The child also inherited the pointers of the grace epoch, and the
+    // parent's caches along with its memory: it keeps their generation.
+    // Taken again under the lock, in case another thread of the parent
+    // rotated the key meanwhile.
+    parent_info = ptrauth_find_process(parent->tgid);
+    if ((policy & PTRAUTH_POLICY_INHERIT_ON_FORK) && parent_info != NULL) {
+        info->key_low = parent_info->key_low;
+        info->key_high = parent_info->key_high;
+        info->prev_key_low = parent_info->prev_key_low;
+        info->prev_key_high = parent_info->prev_key_high;
+        info->has_prev = parent_info->has_prev;
+        info->generation = parent_info->generation;
+    }
+
+    if (ptrauth_insert_process(info) != 0) {
+        rcu_read_unlock();
+        spin_unlock(&process_lock);
+        kmem_cache_free(process_cache, info);
+        trace_ptrauth_table_full(child->tgid, atomic_read(&process_count));
+        pa_err("[fork] cannot copy keys to pid %d\n", child->tgid);
+        return;
     }
 
-    pa_err("[fork_ret] too may processes have a key");
-    return -ENOMEM;
+    rcu_read_unlock();
+    spin_unlock(&process_lock);
+
+    ptrauth_stat_inc(forks_cloned);
+    trace_ptrauth_fork_clone(parent->tgid, child->tgid);
 }
 
-static int ptrauth_sched_entry(struct kretprobe_instance *ri, struct pt_regs *regs) {
-    // pa_info("[sched_entry] before: %d", current->pid);
-    return 0;
+// A new program image must not be able to forge pointers signed by the old
+// one: give the process a fresh key. By the time this fires the other
+// threads are gone and the old mappings with them, so the new key is only
+// loaded once the new image maps the window or issues an ioctl.
+static void ptrauth_sched_exec_probe(void *ignore, struct task_struct *p, pid_t old_pid, struct linux_binprm *bprm) {
+    uint64_t key_low, key_high;
+    u32 policy;
+
+    if (!ptrauth_lookup_key(p->tgid, &key_low, &key_high, &policy))
+        return;
+    if (!(policy & PTRAUTH_POLICY_REKEY_ON_EXEC))
+        return;
+
+    if (ptrauth_rekey_process(p->tgid, false, &key_low, &key_high, NULL, GFP_ATOMIC) != 0) {
+        pa_err("[exec] cannot rekey process %d\n", p->tgid);
+        return;
+    }
+
+    ptrauth_stat_inc(exec_rekeys);
+    trace_ptrauth_exec_rekey(p->tgid);
 }
 
+// Keys are dropped when the last thread of the process exits, even if it
+// never closed the device
+static void ptrauth_sched_exit_probe(void *ignore, struct task_struct *p) {
+    if (atomic_read(&p->signal->live) == 0)
+        ptrauth_remove_process(p->tgid);
+}
 
-static int ptrauth_register_probe(void) {
-    kret_sched.kp.symbol_name = "__switch_to";
-    int ret = register_kretprobe(&kret_sched);
-    if (ret < 0) {
-        pa_err("[register_probe] register_kprobe failed, returned %d\n", ret);
-        return ret;
+static void ptrauth_lookup_tracepoint(struct tracepoint *tp, void *priv) {
+    for (int i = 0; i < ARRAY_SIZE(ptrauth_tracepoints); i++) {
+        if (strcmp(tp->name, ptrauth_tracepoints[i].name) == 0)
+            ptrauth_tracepoints[i].tp = tp;
     }
+}
 
-    pa_info("[register_probe] registering do_fork kretprobe\n");
-    kret_fork.kp.symbol_name = "kernel_clone";
-    ret = register_kretprobe(&kret_fork);
-    if (ret < 0) {
-        pa_err("[register_probe] register_kprobe failed, returned %d\n", ret);
-        return ret;
+static void ptrauth_unregister_tracepoints(void) {
+    for (int i = 0; i < ARRAY_SIZE(ptrauth_tracepoints); i++) {
+        if (!ptrauth_tracepoints[i].registered)
+            continue;
+
+        tracepoint_probe_unregister(ptrauth_tracepoints[i].tp, ptrauth_tracepoints[i].probe, NULL);
+        ptrauth_tracepoints[i].registered = false;
+    }
+
+    tracepoint_synchronize_unregister();
+}
+
+static int ptrauth_register_tracepoints(void) {
+    int ret;
+
+    for_each_kernel_tracepoint(ptrauth_lookup_tracepoint, NULL);
+
+    for (int i = 0; i < ARRAY_SIZE(ptrauth_tracepoints); i++) {
+        if (ptrauth_tracepoints[i].tp == NULL) {
+            pa_err("[register_tracepoints] tracepoint %s not found\n", ptrauth_tracepoints[i].name);
+            ptrauth_unregister_tracepoints();
+            return -ENOENT;
+        }
+
+        ret = tracepoint_probe_register(ptrauth_tracepoints[i].tp, ptrauth_tracepoints[i].probe, NULL);
+        if (ret < 0) {
+            pa_err("[register_tracepoints] cannot attach to %s: %d\n", ptrauth_tracepoints[i].name, ret);
+            ptrauth_unregister_tracepoints();
+            return ret;
+        }
+
+        ptrauth_tracepoints[i].registered = true;
     }
 
     return 0;
@@ -392,6 +2472,36 @@ static int ptrauth_register_probe(void) {
 
 // ==== Initialization and Deinitialization ====
 
+static void ptrauth_unregister_soft_devices(void) {
+    for (int i = 0; i < PTRAUTH_MAX_INSTANCES; i++) {
+        if (soft_pdevs[i] == NULL)
+            continue;
+
+        platform_device_unregister(soft_pdevs[i]);
+        soft_pdevs[i] = NULL;
+    }
+}
+
+// One emulated device per instance, ptrauth.N is local to the Nth share of
+// the CPUs
+static int ptrauth_register_soft_devices(void) {
+    unsigned int instances = min(soft_instances, nr_cpu_ids);
+
+    for (int i = 0; i < instances; i++) {
+        soft_pdevs[i] = platform_device_register_simple(DRIVER_NAME, i, NULL, 0);
+        if (IS_ERR(soft_pdevs[i])) {
+            int ret = PTR_ERR(soft_pdevs[i]);
+
+            pa_err("[init] cannot register emulated device %d\n", i);
+            soft_pdevs[i] = NULL;
+            ptrauth_unregister_soft_devices();
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
 static char *ptrauth_devnode(const struct device *dev, umode_t *mode) {
     if (!mode)
         return NULL;
@@ -404,11 +2514,32 @@ static char *ptrauth_devnode(const struct device *dev, umode_t *mode) {
 
 
 static int __init ptrauth_init(void) {
+    int ret;
+
     pa_info("[init] starting up...\n");
 
-    if (alloc_chrdev_region(&pa_drvr_data.device_number, 0, 1, DRIVER_NAME) < 0) {
+    if (strcmp(engine, "soft") == 0) {
+        if (soft_instances < 1 || soft_instances > PTRAUTH_MAX_INSTANCES) {
+            pa_err("[init] soft_instances must be between 1 and %d\n", PTRAUTH_MAX_INSTANCES);
+            return -EINVAL;
+        }
+        static_branch_enable(&ptrauth_soft_engine);
+    } else if (strcmp(engine, "hw") != 0) {
+        pa_err("[init] unknown engine \"%s\"\n", engine);
+        return -EINVAL;
+    }
+
+    ret = ptrauth_init_key_store();
+    if (ret != 0) {
+        pa_err("[init] could not allocate the key store\n");
+        return ret;
+    }
+    ptrauth_init_key_pool();
+
+    ret = alloc_chrdev_region(&pa_drvr_data.device_number, 0, PTRAUTH_MINORS, DRIVER_NAME);
+    if (ret < 0) {
         pa_err("[init] could not allocate device number\n");
-        return -1;
+        goto err_key_store;
     }
 
     pa_info(
@@ -421,55 +2552,107 @@ static int __init ptrauth_init(void) {
     pa_drvr_data.driver_class = class_create(CLASS_NAME);
     if (IS_ERR(pa_drvr_data.driver_class)) {
         pa_err("[init] could not create class\n");
-        unregister_chrdev_region(pa_drvr_data.device_number, 1);
-        return -1;
+        ret = PTR_ERR(pa_drvr_data.driver_class);
+        goto err_chrdev;
     }
 
     pa_drvr_data.driver_class->devnode = ptrauth_devnode;
 
-    pa_drvr_data.registered_device = device_create(
+    pa_drvr_data.registered_device = device_create_with_groups(
         pa_drvr_data.driver_class,
         NULL,
         pa_drvr_data.device_number,
         NULL,
+        ptrauth_groups,
         DEVICE_NAME
     );
 
     if (IS_ERR(pa_drvr_data.registered_device)) {
         pa_err("[init] device initialization failed\n");
-        class_destroy(pa_drvr_data.driver_class);
-        unregister_chrdev_region(pa_drvr_data.device_number, 1);
-        return -1;
+        ret = PTR_ERR(pa_drvr_data.registered_device);
+        goto err_class;
     }
 
     cdev_init(&pa_drvr_data.c_dev, &fops);
+    pa_drvr_data.c_dev.owner = THIS_MODULE;
 
-    if (cdev_add(&pa_drvr_data.c_dev, pa_drvr_data.device_number, 1) == -1) {
+    ret = cdev_add(&pa_drvr_data.c_dev, pa_drvr_data.device_number, PTRAUTH_MINORS);
+    if (ret != 0) {
         pa_err("[init] cdev initialization failed\n");
-        device_destroy(pa_drvr_data.driver_class, pa_drvr_data.device_number);
-        class_destroy(pa_drvr_data.driver_class);
-        unregister_chrdev_region(pa_drvr_data.device_number, 1);
-        return -1;
+        goto err_device;
+    }
+
+    ptrauth_mnt = kern_mount(&ptrauth_fs_type);
+    if (IS_ERR(ptrauth_mnt)) {
+        pa_err("[init] cannot mount the internal filesystem\n");
+        ret = PTR_ERR(ptrauth_mnt);
+        goto err_cdev;
     }
 
-    if (platform_driver_register(&pa_driver) != 0) {
+    ret = platform_driver_register(&pa_driver);
+    if (ret != 0) {
         pa_err("[init] cannot initializing platform driver\n");
-        return -1;
+        goto err_mnt;
     }
 
-    if (ptrauth_register_probe() != 0) {
-        return -1;
+    if (static_branch_unlikely(&ptrauth_soft_engine)) {
+        ret = ptrauth_register_soft_devices();
+        if (ret != 0)
+            goto err_driver;
     }
 
+    ret = ptrauth_register_tracepoints();
+    if (ret != 0)
+        goto err_soft_pdevs;
+
+    ptrauth_init_debugfs();
+
     pa_info("[init] all done!\n");
     return 0;
+
+err_soft_pdevs:
+    ptrauth_unregister_soft_devices();
+err_driver:
+    platform_driver_unregister(&pa_driver);
+err_mnt:
+    kern_unmount(ptrauth_mnt);
+err_cdev:
+    cdev_del(&pa_drvr_data.c_dev);
+err_device:
+    device_destroy(pa_drvr_data.driver_class, pa_drvr_data.device_number);
+err_class:
+    class_destroy(pa_drvr_data.driver_class);
+err_chrdev:
+    unregister_chrdev_region(pa_drvr_data.device_number, PTRAUTH_MINORS);
+err_key_store:
+    ptrauth_destroy_key_pool();
+    ptrauth_destroy_key_store();
+    return ret;
 }
 
+// Teardown mirrors ptrauth_init() in reverse. The tracepoints go first so
+// that no context switch touches the device anymore, and the module
+// reference held by every open file (fops.owner), which mappings keep
+// open, guarantees there are no files nor mappings left.
+// The key pool and the key store are destroyed last, the store with the
+// keys of processes that inherited one but never closed the device.
 static void __exit ptrauth_exit(void) {
+    ptrauth_unregister_tracepoints();
+    debugfs_remove_recursive(ptrauth_debugfs);
+
+    // Unbinding calls ptrauth_remove(), which releases the IRQ, the
+    // register mappings and the /dev/ptrauthN of every instance
+    ptrauth_unregister_soft_devices();
+    platform_driver_unregister(&pa_driver);
+    kern_unmount(ptrauth_mnt);
+
     cdev_del(&pa_drvr_data.c_dev);
     device_destroy(pa_drvr_data.driver_class, pa_drvr_data.device_number);
     class_destroy(pa_drvr_data.driver_class);
-    platform_driver_unregister(&pa_driver);
+    unregister_chrdev_region(pa_drvr_data.device_number, PTRAUTH_MINORS);
+
+    ptrauth_destroy_key_pool();
+    ptrauth_destroy_key_store();
 
     pa_info("[exit] module unloaded\n");
 }
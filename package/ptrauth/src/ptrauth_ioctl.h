@@ -0,0 +1,148 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+#ifndef _PTRAUTH_IOCTL_H
+#define _PTRAUTH_IOCTL_H
+
+// Userspace interface of the ptrauth driver, shared by the kernel module
+// and the programs using /dev/ptrauth.
+//
+// Boards with several device instances (one per core or cluster) also have
+// /dev/ptrauthN for instance N, with the same interface. The only
+// difference is which window is mapped at page offset 0: instance N for
+// /dev/ptrauthN, the instance local to the opening CPU for /dev/ptrauth.
+// The ioctls always run on the instance local to the calling CPU.
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+// ==== Batched operations ====
+
+// One (pointer, tweak) pair. `pointer` is the plain pointer for a sign and
+// the signed pointer for an authentication, `result` is filled by the
+// driver. The batch ioctls and PTRAUTH_IOC_RING_SUBMIT fail with EACCES for
+// a process without a key.
+struct ptrauth_op {
+    __u64 pointer;
+    __u64 tweak;
+    __u64 result;
+};
+
+struct ptrauth_batch {
+    __u64 ops;      // user address of an array of struct ptrauth_op
+    __u32 count;    // number of entries in ops
+    __u32 flags;    // PTRAUTH_BATCH_*
+};
+
+// PTRAUTH_IOC_SIGN_BATCH only: `pointer` is a signed pointer, `result` is
+// the same pointer signed under the current key if it was valid under the
+// current or the previous key of the process, 0 otherwise. Only signs are
+// issued, a stale pointer never counts as an authentication failure.
+#define PTRAUTH_BATCH_RESIGN (1U << 0)
+
+// ==== Shared request ring ====
+
+// The ring is mapped at page offset PTRAUTH_RING_PGOFF of /dev/ptrauth,
+// i.e. mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+// PTRAUTH_RING_PGOFF * page_size). Its size is fixed by the first mapping
+// and the number of entries is stored in the header.
+//
+// Userspace fills entries from `tail` up to `head` (free running indexes,
+// slot = index % size), publishes `head` with a release store and calls
+// PTRAUTH_IOC_RING_SUBMIT. The driver processes the pending entries in
+// place and advances `tail`.
+#define PTRAUTH_RING_PGOFF 1
+#define PTRAUTH_RING_MAX_PAGES 64
+
+#define PTRAUTH_OP_SIGN 0
+#define PTRAUTH_OP_AUTH 1
+
+struct ptrauth_ring_entry {
+    __u64 pointer;
+    __u64 tweak;
+    __u64 result;
+    __u32 op;       // PTRAUTH_OP_*
+    __u32 status;   // 0 on success, an errno value otherwise
+};
+
+struct ptrauth_ring_header {
+    __u32 head;     // written by userspace
+    __u32 tail;     // written by the driver
+    __u32 size;     // number of entries, read-only
+    __u32 reserved;
+    struct ptrauth_ring_entry entries[];
+};
+
+// ==== Key policy ====
+
+// Keys belong to a process and are shared by all of its threads. These
+// flags decide what happens to the key across fork() and execve(), they are
+// inherited by the children that get a key.
+#define PTRAUTH_POLICY_INHERIT_ON_FORK  (1U << 0)   // children keep the parent key, a fresh one otherwise
+#define PTRAUTH_POLICY_REKEY_ON_EXEC    (1U << 1)   // execve() replaces the key with a fresh one
+#define PTRAUTH_POLICY_MASK             (PTRAUTH_POLICY_INHERIT_ON_FORK | PTRAUTH_POLICY_REKEY_ON_EXEC)
+#define PTRAUTH_POLICY_DEFAULT          (PTRAUTH_POLICY_INHERIT_ON_FORK | PTRAUTH_POLICY_REKEY_ON_EXEC)
+
+// ==== Key rotation ====
+
+// PTRAUTH_IOC_ROTATE_KEY gives the calling process a fresh key and keeps
+// the one it replaces as its previous key until the next rotation: the
+// grace epoch. Pointers signed during the grace epoch under the previous
+// key are re-signed with PTRAUTH_BATCH_RESIGN, older ones are invalid.
+// The ioctl returns the new epoch, the number of rotations of the process.
+//
+// Threads of the process that are running on other CPUs keep signing with
+// the previous key until their next context switch; their pointers are
+// re-signed like any other. execve() drops the previous key.
+
+// ==== Shared page ====
+
+// Read-only page mapped at page offset PTRAUTH_SHARED_PGOFF, one page
+// long. Each process maps its own: `generation` is that of its key and
+// changes whenever the process gets a different one (key rotation, rekey
+// on execve()). A child gets a page of its own too, with the generation of
+// its parent if it inherited the key, and a new one otherwise. The mapping
+// is not copied across fork(), the child has to map it again. A signed
+// pointer cached under one generation must not be reused under another;
+// generations are never reused.
+#define PTRAUTH_SHARED_PGOFF (PTRAUTH_RING_PGOFF + PTRAUTH_RING_MAX_PAGES)
+
+struct ptrauth_shared {
+    __u64 generation;
+};
+
+// ==== Device information ====
+
+#define PTRAUTH_ENGINE_HW   0   // PtrauthDevice
+#define PTRAUTH_ENGINE_SOFT 1   // in-kernel reference implementation (engine=soft)
+
+#define PTRAUTH_INFO_MAPPABLE   (1U << 0)   // the registers can be mapped at page offset 0
+#define PTRAUTH_INFO_LAZY_KEYS  (1U << 1)   // keys are loaded on first access (lazy_keys=1)
+#define PTRAUTH_INFO_SHARED     (1U << 2)   // the shared page can be mapped at PTRAUTH_SHARED_PGOFF
+#define PTRAUTH_INFO_ROTATE     (1U << 3)   // PTRAUTH_IOC_ROTATE_KEY and PTRAUTH_BATCH_RESIGN are supported
+
+struct ptrauth_info {
+    __u32 engine;   // PTRAUTH_ENGINE_*
+    __u32 flags;    // PTRAUTH_INFO_*
+};
+
+// ==== ioctls ====
+
+#define PTRAUTH_IOC_MAGIC 'P'
+
+#define PTRAUTH_IOC_SIGN_BATCH  _IOW(PTRAUTH_IOC_MAGIC, 1, struct ptrauth_batch)
+#define PTRAUTH_IOC_AUTH_BATCH  _IOW(PTRAUTH_IOC_MAGIC, 2, struct ptrauth_batch)
+#define PTRAUTH_IOC_RING_SUBMIT _IO(PTRAUTH_IOC_MAGIC, 3)
+
+// Number of authentication failures attributed to the calling process
+#define PTRAUTH_IOC_GET_AUTH_FAILURES _IOR(PTRAUTH_IOC_MAGIC, 4, __u64)
+
+// PTRAUTH_POLICY_* flags of the calling process, -ENOENT if it has no key
+#define PTRAUTH_IOC_GET_POLICY _IOR(PTRAUTH_IOC_MAGIC, 5, __u32)
+#define PTRAUTH_IOC_SET_POLICY _IOW(PTRAUTH_IOC_MAGIC, 6, __u32)
+
+#define PTRAUTH_IOC_GET_INFO _IOR(PTRAUTH_IOC_MAGIC, 7, struct ptrauth_info)
+
+// Rotate the key of the calling process, returns the new epoch. -ENOENT if
+// it has no key.
+#define PTRAUTH_IOC_ROTATE_KEY _IOR(PTRAUTH_IOC_MAGIC, 8, __u64)
+
+#endif /* _PTRAUTH_IOCTL_H */
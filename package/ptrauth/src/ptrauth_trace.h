@@ -0,0 +1,122 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ptrauth
+
+#if !defined(_PTRAUTH_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _PTRAUTH_TRACE_H
+
+// Tracepoints of the ptrauth module, available under
+// /sys/kernel/tracing/events/ptrauth/. They cost a static branch when
+// disabled, so they can stay on the hot paths.
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(ptrauth_key_class,
+    TP_PROTO(pid_t pid),
+    TP_ARGS(pid),
+
+    TP_STRUCT__entry(
+        __field(pid_t, pid)
+    ),
+
+    TP_fast_assign(
+        __entry->pid = pid;
+    ),
+
+    TP_printk("pid=%d", __entry->pid)
+);
+
+// The key of the incoming task was written to the device
+DEFINE_EVENT(ptrauth_key_class, ptrauth_key_load,
+    TP_PROTO(pid_t pid),
+    TP_ARGS(pid)
+);
+
+// The device already held the key of the incoming task
+DEFINE_EVENT(ptrauth_key_class, ptrauth_key_skip,
+    TP_PROTO(pid_t pid),
+    TP_ARGS(pid)
+);
+
+// A process got a fresh key when it called execve()
+DEFINE_EVENT(ptrauth_key_class, ptrauth_exec_rekey,
+    TP_PROTO(pid_t pid),
+    TP_ARGS(pid)
+);
+
+TRACE_EVENT(ptrauth_fork_clone,
+    TP_PROTO(pid_t parent, pid_t child),
+    TP_ARGS(parent, child),
+
+    TP_STRUCT__entry(
+        __field(pid_t, parent)
+        __field(pid_t, child)
+    ),
+
+    TP_fast_assign(
+        __entry->parent = parent;
+        __entry->child = child;
+    ),
+
+    TP_printk("parent=%d child=%d", __entry->parent, __entry->child)
+);
+
+TRACE_EVENT(ptrauth_key_rotate,
+    TP_PROTO(pid_t pid, u32 epoch),
+    TP_ARGS(pid, epoch),
+
+    TP_STRUCT__entry(
+        __field(pid_t, pid)
+        __field(u32, epoch)
+    ),
+
+    TP_fast_assign(
+        __entry->pid = pid;
+        __entry->epoch = epoch;
+    ),
+
+    TP_printk("pid=%d epoch=%u", __entry->pid, __entry->epoch)
+);
+
+TRACE_EVENT(ptrauth_auth_failure,
+    TP_PROTO(pid_t pid, int failures),
+    TP_ARGS(pid, failures),
+
+    TP_STRUCT__entry(
+        __field(pid_t, pid)
+        __field(int, failures)
+    ),
+
+    TP_fast_assign(
+        __entry->pid = pid;
+        __entry->failures = failures;
+    ),
+
+    TP_printk("pid=%d failures=%d", __entry->pid, __entry->failures)
+);
+
+// A key could not be added to the key store
+TRACE_EVENT(ptrauth_table_full,
+    TP_PROTO(pid_t pid, int keys),
+    TP_ARGS(pid, keys),
+
+    TP_STRUCT__entry(
+        __field(pid_t, pid)
+        __field(int, keys)
+    ),
+
+    TP_fast_assign(
+        __entry->pid = pid;
+        __entry->keys = keys;
+    ),
+
+    TP_printk("pid=%d keys_in_use=%d", __entry->pid, __entry->keys)
+);
+
+#endif /* _PTRAUTH_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ptrauth_trace
+#include <trace/define_trace.h>
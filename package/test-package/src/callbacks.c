@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Cost of the ptrauth GCC plugin on a callback-heavy loop, to compare
+// builds of this package with TEST_PACKAGE_PTRAUTH_INSTRUMENT set to NO,
+// YES and BATCH:
+//
+//   make TEST_PACKAGE_PTRAUTH_INSTRUMENT=BATCH test-package-rebuild
+//
+// Handlers are registered in a table (function pointer stores) every `-r`
+// dispatches and called through it (indirect calls). Prints whether the
+// table holds signed pointers, then the time per registration and per
+// dispatch.
+//
+// usage: callbacks [-n dispatches] [-r interval]
+
+#define HANDLERS 16
+
+struct handler {
+    void (*fn)(uint64_t);
+    uint64_t calls;
+};
+
+static struct handler handlers[HANDLERS];
+static volatile uint64_t sink;
+
+static void on_add(uint64_t v) { sink += v; }
+static void on_xor(uint64_t v) { sink ^= v; }
+static void on_mul(uint64_t v) { sink = sink * 31 + v; }
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void register_handlers(void) {
+    for (int i = 0; i < HANDLERS; i++) {
+        switch (i % 3) {
+        case 0: handlers[i].fn = on_add; break;
+        case 1: handlers[i].fn = on_xor; break;
+        default: handlers[i].fn = on_mul; break;
+        }
+    }
+}
+
+static void dispatch(uint64_t event) {
+    struct handler *h = &handlers[event % HANDLERS];
+
+    h->fn(event);
+    h->calls++;
+}
+
+int main(int argc, char **argv) {
+    long dispatches = 10000000;
+    long interval = 1000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:r:")) != -1) {
+        switch (opt) {
+        case 'n': dispatches = atol(optarg); break;
+        case 'r': interval = atol(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-n dispatches] [-r interval]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (interval < 1)
+        interval = 1;
+
+    register_handlers();
+
+    uint64_t raw;
+    memcpy(&raw, &handlers[0].fn, sizeof(raw));
+    printf("instrumented: %s\n", raw >> 48 ? "yes" : "no");
+
+    long registrations = 0;
+    uint64_t start = now_ns();
+    for (long i = 0; i < 100000; i++, registrations++) {
+        register_handlers();
+        // Keep the compiler from merging the stores across iterations
+        __asm__ __volatile__("" ::: "memory");
+    }
+    uint64_t register_ns = now_ns() - start;
+
+    start = now_ns();
+    for (long i = 0; i < dispatches; i++) {
+        if (i % interval == 0)
+            register_handlers();
+        dispatch(i);
+    }
+    uint64_t dispatch_ns = now_ns() - start;
+
+    printf("register  %8.1f ns/handler\n", (double)register_ns / (registrations * HANDLERS));
+    printf("dispatch  %8.1f ns/call (re-registering every %ld)\n", (double)dispatch_ns / dispatches, interval);
+
+    return 0;
+}
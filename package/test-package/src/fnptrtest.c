@@ -0,0 +1,195 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <libptrauth.h>
+
+// Checks programs built with the ptrauth GCC plugin (-fplugin=ptrauth,
+// with and without -fplugin-arg-ptrauth-batch); this file is only built
+// that way:
+//  - function pointers from static initializers, from stores of function
+//    addresses and of values the compiler cannot see through, and
+//    parameters whose address is taken, are called as usual,
+//  - memory holds them signed, NULL stays NULL, comparisons see the plain
+//    pointers,
+//  - a function pointer overwritten without a signature, or with the
+//    signature of another function, aborts the process instead of being
+//    called,
+//  - `int (*)()` pointers are signed as well, while virtual calls, whose
+//    vtable entries share that type in C++, still work. The C++ checks
+//    are in fnptrtest-cxx, the same file built as C++.
+//
+// Needs the ptrauth module loaded.
+//
+// usage: fnptrtest
+
+typedef int (*handler_t)(int);
+typedef int (*legacy_t)();
+
+struct ops {
+    handler_t cb;
+    int value;
+};
+
+static int on_inc(int v) { return v + 1; }
+static int on_dbl(int v) { return v * 2; }
+static int on_neg(int v) { return -v; }
+
+// Target of the forged pointers, never legitimately called
+static int on_evil(int v) {
+    (void)v;
+    _exit(42);
+}
+
+static int on_seven(void) { return 7; }
+static int on_eight(void) { return 8; }
+
+static const handler_t table[] = { on_inc, on_dbl, NULL, on_neg };
+static legacy_t legacy[2];
+static struct ops static_ops = { .cb = on_dbl, .value = 21 };
+
+static int failures;
+
+static void check(const char *what, int ok) {
+    printf("%s: %s\n", what, ok ? "ok" : "FAIL");
+    failures += !ok;
+}
+
+// The bits of a stored function pointer, without going through the
+// instrumented loads
+static uint64_t raw(const void *slot) {
+    return *(const volatile uint64_t *)slot;
+}
+
+static int is_signed(const handler_t *slot, handler_t plain) {
+    return raw(slot) != (uint64_t)(uintptr_t)plain;
+}
+
+// The value stored is an SSA name the plugin cannot trace to a function
+__attribute__((noinline)) static void set_cb(struct ops *ops, handler_t cb) {
+    ops->cb = cb;
+}
+
+__attribute__((noinline)) static void set_legacy(legacy_t *slot, legacy_t cb) {
+    *slot = cb;
+}
+
+__attribute__((noinline)) static handler_t pick(int i) {
+    return i & 1 ? on_dbl : on_inc;
+}
+
+__attribute__((noinline)) static void escape(handler_t *slot) {
+    __asm__ __volatile__("" :: "r"(slot) : "memory");
+}
+
+// `cb` lives in memory as its address is taken
+__attribute__((noinline)) static int call_addressable(handler_t cb, int v) {
+    handler_t *slot = &cb;
+
+    escape(slot);
+    return (*slot)(v);
+}
+
+#ifdef __cplusplus
+struct shape {
+    virtual int sides() const { return 0; }
+    virtual ~shape() {}
+};
+
+struct square : shape {
+    int sides() const override { return 4; }
+};
+
+__attribute__((noinline)) static const shape *make_shape(int i) {
+    static const shape plain;
+    static const square four;
+
+    return i ? &four : &plain;
+}
+#endif
+
+// Run `attack` in a child, which must be killed before calling on_evil()
+static void check_attack(const char *what, void (*attack)(struct ops *)) {
+    struct ops ops;
+    int status;
+    pid_t pid;
+
+    set_cb(&ops, on_inc);
+
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0) {
+        attack(&ops);
+        _exit(ops.cb(1) == 2 ? 0 : 1);
+    }
+
+    waitpid(pid, &status, 0);
+    check(what, WIFSIGNALED(status) && (WTERMSIG(status) == SIGABRT || WTERMSIG(status) == SIGUSR1));
+}
+
+static void store_unsigned(struct ops *ops) {
+    *(volatile uint64_t *)&ops->cb = (uint64_t)(uintptr_t)on_evil;
+}
+
+// Keep the signature of on_inc, point to on_evil
+static void store_forged(struct ops *ops) {
+    uint64_t signature = raw(&ops->cb) & ~PTRAUTH_ADDR_MASK;
+
+    *(volatile uint64_t *)&ops->cb = signature | (uint64_t)(uintptr_t)on_evil;
+}
+
+int main(void) {
+    volatile int index = 1;
+    struct ops ops;
+    handler_t local;
+
+    // Static initializers
+    check("static table", table[0](1) == 2 && table[index](3) == 6 && table[3](4) == -4);
+    check("static table signed", is_signed(&table[0], on_inc) || is_signed(&table[1], on_dbl));
+    check("static NULL", table[2] == NULL && raw(&table[2]) == 0);
+    check("static struct", static_ops.cb(static_ops.value) == 42);
+
+    // Stores
+    ops.cb = on_neg;
+    check("function address", ops.cb(5) == -5 && ops.cb == on_neg);
+    set_cb(&ops, pick(index));
+    check("opaque value", ops.cb(5) == 10 && ops.cb == on_dbl && ops.cb != on_inc);
+    check("stored signed", is_signed(&ops.cb, on_dbl) || is_signed(&static_ops.cb, on_dbl));
+    set_cb(&ops, NULL);
+    check("stored NULL", ops.cb == NULL && raw(&ops.cb) == 0);
+
+    // Copies of signed pointers between memory locations
+    local = table[index];
+    static_ops.cb = local;
+    check("copy", static_ops.cb(4) == 8);
+
+    check("addressable parameter", call_addressable(on_inc, 9) == 10);
+
+    // The type of C++ vtable entries, signed like the others
+    set_legacy(&legacy[0], on_seven);
+    set_legacy(&legacy[1], on_eight);
+    check("int (*)()", legacy[0]() == 7 && legacy[index]() == 8);
+    check("int (*)() signed", raw(&legacy[0]) != (uint64_t)(uintptr_t)on_seven ||
+                              raw(&legacy[1]) != (uint64_t)(uintptr_t)on_eight);
+
+#ifdef __cplusplus
+    // Vtables are left alone
+    int (shape::*sides)() const = &shape::sides;
+    check("virtual call", make_shape(index)->sides() == 4 && make_shape(0)->sides() == 0);
+    check("virtual member pointer", (make_shape(index)->*sides)() == 4);
+#endif
+
+    check_attack("unsigned pointer rejected", store_unsigned);
+    check_attack("forged pointer rejected", store_forged);
+
+    if (failures > 0) {
+        fprintf(stderr, "FAIL: %d checks\n", failures);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <libptrauth.h>
+
+// Stress test for the ptrauth key store.
+//
+// The parent opens /dev/ptrauth and forks `-c` children per round, keeping
+// all of them alive at the same time so the number of keyed processes goes
+// well past the old 256-entry limit. Each child checks that it inherited the
+// parent's key by signing the same pointer, then waits for the parent to end
+// the round. After every round the key store occupancy reported in sysfs must
+// be back to where it started, i.e. exiting children released their keys.
+//
+// usage: forkstress [-c children] [-r rounds]
+
+#define KEYS_IN_USE "/sys/class/cfi_devices/ptrauth/keys_in_use"
+
+static long keys_in_use(void) {
+    long count = -1;
+    FILE *f = fopen(KEYS_IN_USE, "r");
+
+    if (f == NULL) {
+        perror(KEYS_IN_USE);
+        exit(1);
+    }
+    if (fscanf(f, "%ld", &count) != 1) {
+        fprintf(stderr, "cannot parse " KEYS_IN_USE "\n");
+        exit(1);
+    }
+    fclose(f);
+
+    return count;
+}
+
+int main(int argc, char **argv) {
+    long children = 1000;
+    long rounds = 5;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:r:")) != -1) {
+        switch (opt) {
+        case 'c': children = atol(optarg); break;
+        case 'r': rounds = atol(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-c children] [-r rounds]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (ptrauth_init() != 0) {
+        perror("ptrauth_init");
+        return 1;
+    }
+
+    long baseline = keys_in_use();
+    uint64_t expected = ptrauth_sign(0x1234, 0x10);
+    long failures = 0;
+
+    printf("baseline keys in use: %ld\n", baseline);
+
+    for (long round = 0; round < rounds; round++) {
+        int gate[2];
+        if (pipe(gate) != 0) {
+            perror("pipe");
+            return 1;
+        }
+
+        long forked = 0;
+        for (; forked < children; forked++) {
+            pid_t pid = fork();
+            if (pid < 0) {
+                perror("fork");
+                break;
+            }
+
+            if (pid == 0) {
+                char c;
+                close(gate[1]);
+                int ok = ptrauth_sign(0x1234, 0x10) == expected;
+                // Hold the key until the parent ends the round
+                (void)read(gate[0], &c, 1);
+                _exit(ok ? 0 : 1);
+            }
+        }
+        close(gate[0]);
+
+        long peak = keys_in_use();
+
+        // Closing the write end releases all children at once
+        close(gate[1]);
+
+        for (long i = 0; i < forked; i++) {
+            int status;
+            if (wait(&status) < 0) {
+                perror("wait");
+                return 1;
+            }
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                failures++;
+        }
+
+        long after = keys_in_use();
+        printf("round %ld: forked %ld, keys in use %ld while running, %ld after exit\n",
+               round, forked, peak, after);
+
+        if (peak < baseline + forked || after != baseline) {
+            fprintf(stderr, "round %ld: key store occupancy mismatch\n", round);
+            return 1;
+        }
+    }
+
+    if (failures != 0) {
+        fprintf(stderr, "%ld children did not inherit the parent key\n", failures);
+        return 1;
+    }
+
+    printf("OK: %ld keyed children forked\n", children * rounds);
+    return 0;
+}
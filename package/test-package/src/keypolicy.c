@@ -0,0 +1,195 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include <libptrauth.h>
+
+// Checks the key semantics of /dev/ptrauth:
+//  - all threads of a process sign with the same key,
+//  - closing one of several descriptors keeps the key,
+//  - a child that inherited the key starts with the key generation of its
+//    parent, and rotating its key leaves the parent's generation alone,
+//  - children inherit the key by default, and get a fresh one when the
+//    parent cleared PTRAUTH_POLICY_INHERIT_ON_FORK,
+//  - execve() gives the process a fresh key.
+//
+// The exec check re-executes this program with `-x <signature>` and the
+// device fd still open; the new image signs the same pointer through that
+// fd (opening the device again would trivially give a new key) and
+// compares.
+//
+// usage: keypolicy
+
+#define TEST_POINTER 0x400123
+#define TEST_TWEAK 42
+
+static void *thread_sign(void *arg) {
+    *(uint64_t *)arg = ptrauth_sign(TEST_POINTER, TEST_TWEAK);
+    return NULL;
+}
+
+// Key generation of the calling process, 0 on error
+static uint64_t generation(int fd) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    void *page = mmap(NULL, page_size, PROT_READ, MAP_SHARED, fd, PTRAUTH_SHARED_PGOFF * page_size);
+    uint64_t value;
+
+    if (page == MAP_FAILED)
+        return 0;
+    value = ((const volatile struct ptrauth_shared *)page)->generation;
+    munmap(page, page_size);
+
+    return value;
+}
+
+// Rotate the key in a child and report whether its generation changed
+// from `expected`, and only its own
+static int child_generation_ok(int fd, uint64_t expected) {
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        __u64 epoch;
+
+        if (generation(fd) != expected || ioctl(fd, PTRAUTH_IOC_ROTATE_KEY, &epoch) != 0)
+            _exit(1);
+        _exit(generation(fd) != expected ? 0 : 1);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 && generation(fd) == expected;
+}
+
+// Sign in a child and report whether it matched the parent's signature
+static int child_matches(uint64_t expected) {
+    pid_t pid = fork();
+
+    if (pid == 0)
+        _exit(ptrauth_sign(TEST_POINTER, TEST_TWEAK) == expected ? 0 : 1);
+
+    int status;
+    waitpid(pid, &status, 0);
+
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main(int argc, char **argv) {
+    uint64_t exec_signature = 0;
+    int exec_fd = -1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "x:f:")) != -1) {
+        switch (opt) {
+        case 'x': exec_signature = strtoull(optarg, NULL, 0); break;
+        case 'f': exec_fd = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s\n", argv[0]);
+            return 1;
+        }
+    }
+
+    // Second half of the exec check, running in the new image
+    if (exec_fd >= 0) {
+        struct ptrauth_op op = { .pointer = TEST_POINTER, .tweak = TEST_TWEAK };
+        struct ptrauth_batch batch = { .ops = (uintptr_t)&op, .count = 1 };
+
+        if (ioctl(exec_fd, PTRAUTH_IOC_SIGN_BATCH, &batch) != 0) {
+            perror("PTRAUTH_IOC_SIGN_BATCH");
+            return 1;
+        }
+        if (op.result == exec_signature) {
+            fprintf(stderr, "FAIL: key survived execve()\n");
+            return 1;
+        }
+        printf("exec: fresh key\n");
+        return 0;
+    }
+
+    int fd = ptrauth_fd();
+    if (fd < 0) {
+        perror("open /dev/ptrauth");
+        return 1;
+    }
+
+    uint64_t signature = ptrauth_sign(TEST_POINTER, TEST_TWEAK);
+
+    // Threads
+    pthread_t thread;
+    uint64_t thread_signature = 0;
+    pthread_create(&thread, NULL, thread_sign, &thread_signature);
+    pthread_join(thread, NULL);
+    if (thread_signature != signature) {
+        fprintf(stderr, "FAIL: thread signed with a different key\n");
+        return 1;
+    }
+    printf("threads: shared key\n");
+
+    // A second descriptor, opened and closed
+    int other_fd = open("/dev/ptrauth", O_RDWR);
+    if (other_fd < 0) {
+        perror("open /dev/ptrauth");
+        return 1;
+    }
+    close(other_fd);
+    if (ptrauth_sign(TEST_POINTER, TEST_TWEAK) != signature) {
+        fprintf(stderr, "FAIL: closing another descriptor changed the key\n");
+        return 1;
+    }
+    printf("descriptors: key kept\n");
+
+    // Fork, with the default policy and without inheritance
+    __u32 policy;
+    if (ioctl(fd, PTRAUTH_IOC_GET_POLICY, &policy) != 0) {
+        perror("PTRAUTH_IOC_GET_POLICY");
+        return 1;
+    }
+    if (!child_matches(signature)) {
+        fprintf(stderr, "FAIL: child did not inherit the key\n");
+        return 1;
+    }
+
+    // Generations, per process
+    uint64_t parent_generation = generation(fd);
+    if (parent_generation == 0) {
+        perror("mmap shared page");
+        return 1;
+    }
+    if (!child_generation_ok(fd, parent_generation)) {
+        fprintf(stderr, "FAIL: key generations are not per process\n");
+        return 1;
+    }
+    printf("generation: per process\n");
+
+    policy &= ~PTRAUTH_POLICY_INHERIT_ON_FORK;
+    if (ioctl(fd, PTRAUTH_IOC_SET_POLICY, &policy) != 0) {
+        perror("PTRAUTH_IOC_SET_POLICY");
+        return 1;
+    }
+    if (child_matches(signature)) {
+        fprintf(stderr, "FAIL: child inherited the key despite the policy\n");
+        return 1;
+    }
+    printf("fork: policy honoured\n");
+
+    // Exec, keeping the device open
+    if (fcntl(fd, F_SETFD, 0) != 0) {
+        perror("fcntl");
+        return 1;
+    }
+
+    char signature_arg[32], fd_arg[16];
+    snprintf(signature_arg, sizeof(signature_arg), "%llu", (unsigned long long)signature);
+    snprintf(fd_arg, sizeof(fd_arg), "%d", fd);
+
+    execl("/proc/self/exe", argv[0], "-x", signature_arg, "-f", fd_arg, (char *)NULL);
+    perror("execl");
+    return 1;
+}
@@ -0,0 +1,137 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/wait.h>
+
+#include <libptrauth.h>
+
+// Device MMIO cost of a mixed workload, to compare the default key loading
+// against lazy loading (modprobe ptrauth lazy_keys=1).
+//
+// Starts `-b` busy processes that never touch the device and `-k` keyed
+// processes that sign a pointer every `-i` yields, so most of the switches
+// go to tasks that do not need a key. After `-t` seconds it prints the
+// switch, key write and lazy fault rates from the debugfs statistics; the
+// difference in key writes per second between the two modes is the MMIO
+// saved.
+//
+// usage: mixedload [-t seconds] [-b busy] [-k keyed] [-i interval]
+
+#define STATS "/sys/kernel/debug/ptrauth/stats"
+#define LAZY_KEYS "/sys/module/ptrauth/parameters/lazy_keys"
+
+static uint64_t read_stat(const char *name) {
+    char line[128];
+    uint64_t value = 0;
+    size_t len = strlen(name);
+    FILE *f = fopen(STATS, "r");
+
+    if (f == NULL) {
+        perror(STATS);
+        exit(1);
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (strncmp(line, name, len) == 0 && line[len] == ' ') {
+            value = strtoull(line + len + 1, NULL, 10);
+            break;
+        }
+    }
+    fclose(f);
+
+    return value;
+}
+
+static void reset_stats(void) {
+    int fd = open(STATS, O_WRONLY);
+
+    if (fd < 0 || write(fd, "0", 1) != 1) {
+        perror(STATS);
+        exit(1);
+    }
+    close(fd);
+}
+
+static char lazy_mode(void) {
+    char mode = '?';
+    FILE *f = fopen(LAZY_KEYS, "r");
+
+    if (f != NULL) {
+        mode = fgetc(f);
+        fclose(f);
+    }
+
+    return mode;
+}
+
+static pid_t spawn(int keyed, long interval) {
+    pid_t pid = fork();
+
+    if (pid != 0)
+        return pid;
+
+    if (keyed && ptrauth_init() != 0)
+        _exit(1);
+
+    for (long i = 0; ; i++) {
+        if (keyed && i % interval == 0)
+            (void)ptrauth_sign(0x400000 + i, i);
+        sched_yield();
+    }
+}
+
+int main(int argc, char **argv) {
+    int seconds = 10;
+    long busy = 4;
+    long keyed = 1;
+    long interval = 100;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:b:k:i:")) != -1) {
+        switch (opt) {
+        case 't': seconds = atoi(optarg); break;
+        case 'b': busy = atol(optarg); break;
+        case 'k': keyed = atol(optarg); break;
+        case 'i': interval = atol(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-t seconds] [-b busy] [-k keyed] [-i interval]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (interval < 1)
+        interval = 1;
+
+    pid_t *children = calloc(busy + keyed, sizeof(pid_t));
+    if (children == NULL) {
+        perror("calloc");
+        return 1;
+    }
+
+    reset_stats();
+
+    for (long i = 0; i < busy + keyed; i++)
+        children[i] = spawn(i >= busy, interval);
+
+    sleep(seconds);
+
+    for (long i = 0; i < busy + keyed; i++) {
+        kill(children[i], SIGKILL);
+        waitpid(children[i], NULL, 0);
+    }
+
+    uint64_t switches = read_stat("switches");
+    uint64_t key_writes = read_stat("key_writes");
+    uint64_t lazy_faults = read_stat("lazy_faults");
+
+    printf("lazy_keys=%c busy=%ld keyed=%ld interval=%ld seconds=%d\n",
+           lazy_mode(), busy, keyed, interval, seconds);
+    printf("switches    %12llu %12.0f/s\n", (unsigned long long)switches, (double)switches / seconds);
+    printf("key_writes  %12llu %12.0f/s\n", (unsigned long long)key_writes, (double)key_writes / seconds);
+    printf("lazy_faults %12llu %12.0f/s\n", (unsigned long long)lazy_faults, (double)lazy_faults / seconds);
+
+    return 0;
+}
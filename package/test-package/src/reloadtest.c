@@ -0,0 +1,233 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include <libptrauth.h>
+
+// Loads and unloads the driver in a loop and checks with kmemleak that
+// nothing is left behind. Every iteration opens the device, signs through
+// it, and forks a child that keeps its inherited key while nobody has the
+// device open anymore, so the unload has to free keys of running tasks.
+// Before that, it checks that the driver cannot be unloaded while the
+// device is open, nor while a page of it is mapped after the close.
+//
+// The kernel needs kmemleak enabled (./start-qemu.sh --kmemleak). Module
+// parameters given with `-a` are passed to every modprobe, e.g.
+// `-a engine=soft` under stock QEMU.
+//
+// usage: reloadtest [-n iterations] [-a "module parameters"]
+
+#define KMEMLEAK "/sys/kernel/debug/kmemleak"
+#define DEVICE "/dev/ptrauth"
+
+#define TEST_POINTER 0x400123
+#define TEST_TWEAK 42
+
+static int run(const char *command) {
+    int status = system(command);
+
+    if (status == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "FAIL: %s\n", command);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int kmemleak_write(const char *command) {
+    int fd = open(KMEMLEAK, O_WRONLY);
+    ssize_t len = strlen(command);
+
+    if (fd < 0 || write(fd, command, len) != len) {
+        perror(KMEMLEAK);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    close(fd);
+
+    return 0;
+}
+
+// Prints the kmemleak report and returns the number of leaked objects
+static int kmemleak_report(void) {
+    char line[256];
+    int leaks = 0;
+    FILE *f = fopen(KMEMLEAK, "r");
+
+    if (f == NULL) {
+        perror(KMEMLEAK);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (strncmp(line, "unreferenced object", 19) == 0)
+            leaks++;
+        fputs(line, stdout);
+    }
+    fclose(f);
+
+    return leaks;
+}
+
+static int sign(int fd, uint64_t *result) {
+    struct ptrauth_op op = { .pointer = TEST_POINTER, .tweak = TEST_TWEAK };
+    struct ptrauth_batch batch = { .ops = (uintptr_t)&op, .count = 1 };
+
+    if (ioctl(fd, PTRAUTH_IOC_SIGN_BATCH, &batch) != 0) {
+        perror("PTRAUTH_IOC_SIGN_BATCH");
+        return -1;
+    }
+    *result = op.result;
+
+    return 0;
+}
+
+// Unloading must fail while the module is pinned by an open file or a
+// mapping. A held reference is reported as EWOULDBLOCK by current kernels
+// and as EBUSY by older ones.
+static int check_pinned(const char *what) {
+    if (syscall(SYS_delete_module, "ptrauth", O_NONBLOCK) == 0) {
+        fprintf(stderr, "FAIL: driver unloaded with the device %s\n", what);
+        return -1;
+    }
+    if (errno != EBUSY && errno != EWOULDBLOCK) {
+        fprintf(stderr, "FAIL: unloading with the device %s: %s\n", what, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+// One load/use/unload cycle
+static int cycle(const char *load) {
+    uint64_t signature;
+    int pipefd[2];
+    pid_t child;
+    char c;
+
+    if (run(load) != 0)
+        return -1;
+
+    // Nothing else is open while the shared page, which can be mapped with
+    // either engine, is the only reference to the device
+    long page_size = sysconf(_SC_PAGESIZE);
+    int fd = open(DEVICE, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror(DEVICE);
+        return -1;
+    }
+    void *shared = mmap(NULL, page_size, PROT_READ, MAP_SHARED, fd, PTRAUTH_SHARED_PGOFF * page_size);
+    close(fd);
+    if (shared == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    int pinned = check_pinned("mapped");
+    munmap(shared, page_size);
+    if (pinned != 0)
+        return -1;
+
+    fd = open(DEVICE, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        perror(DEVICE);
+        return -1;
+    }
+    if (sign(fd, &signature) != 0 || check_pinned("open") != 0) {
+        close(fd);
+        return -1;
+    }
+
+    // The child inherits the key, closes its copy of the device and waits
+    // to be killed after the unload
+    if (pipe(pipefd) != 0) {
+        perror("pipe");
+        close(fd);
+        return -1;
+    }
+    child = fork();
+    if (child == 0) {
+        close(fd);
+        close(pipefd[0]);
+        (void)write(pipefd[1], "", 1);
+        pause();
+        _exit(0);
+    }
+    close(pipefd[1]);
+    (void)read(pipefd[0], &c, 1);
+    close(pipefd[0]);
+    close(fd);
+
+    int ret = run("rmmod ptrauth");
+
+    kill(child, SIGKILL);
+    waitpid(child, NULL, 0);
+
+    return ret;
+}
+
+int main(int argc, char **argv) {
+    const char *params = "";
+    long iterations = 100;
+    char load[256];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:a:")) != -1) {
+        switch (opt) {
+        case 'n': iterations = atol(optarg); break;
+        case 'a': params = optarg; break;
+        default:
+            fprintf(stderr, "usage: %s [-n iterations] [-a \"module parameters\"]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    snprintf(load, sizeof(load), "modprobe ptrauth %s", params);
+
+    if (access(KMEMLEAK, F_OK) != 0) {
+        fprintf(stderr, "%s not available, boot with kmemleak=on\n", KMEMLEAK);
+        return 1;
+    }
+
+    // Start from an unloaded driver and forget older reports
+    if (access("/sys/module/ptrauth", F_OK) == 0 && run("rmmod ptrauth") != 0)
+        return 1;
+    if (kmemleak_write("clear") != 0)
+        return 1;
+
+    for (long i = 0; i < iterations; i++) {
+        if (cycle(load) != 0) {
+            fprintf(stderr, "FAIL: iteration %ld\n", i);
+            return 1;
+        }
+    }
+
+    // Objects are only reported once they stayed unreferenced across two
+    // scans
+    if (kmemleak_write("scan") != 0 || kmemleak_write("scan") != 0)
+        return 1;
+
+    int leaks = kmemleak_report();
+    if (leaks < 0)
+        return 1;
+
+    // Leave the driver loaded, as after boot
+    if (run(load) != 0)
+        return 1;
+
+    printf("reloads: %ld, leaked objects: %d\n", iterations, leaks);
+    if (leaks != 0) {
+        fprintf(stderr, "FAIL: kmemleak reported leaks\n");
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,202 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/klog.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+// SMP stress harness for the ptrauth key store.
+//
+// Meant to be run on a multi-core guest (./start-qemu.sh --smp 4). For every
+// online CPU it starts a keyed and an unkeyed spinner that keep the scheduler
+// switching, plus `-w` workers that hammer the writer paths for `-t` seconds:
+// open (and reopen), mmap, fork children and grandchildren that inherit the
+// key, close, and exit with the device still open. At the end the key store
+// must be back to its initial occupancy and the kernel log must not contain
+// any BUG or WARNING.
+//
+// Sign/auth results are not checked: with a single device shared by all
+// CPUs they are only meaningful on a single-core guest.
+//
+// usage: smpstress [-t seconds] [-w workers per cpu]
+
+#define KEYS_IN_USE "/sys/class/cfi_devices/ptrauth/keys_in_use"
+
+static long keys_in_use(void) {
+    long count = -1;
+    FILE *f = fopen(KEYS_IN_USE, "r");
+
+    if (f == NULL) {
+        perror(KEYS_IN_USE);
+        exit(1);
+    }
+    if (fscanf(f, "%ld", &count) != 1) {
+        fprintf(stderr, "cannot parse " KEYS_IN_USE "\n");
+        exit(1);
+    }
+    fclose(f);
+
+    return count;
+}
+
+static int kernel_log_is_clean(void) {
+    int size = klogctl(10 /* SYSLOG_ACTION_SIZE_BUFFER */, NULL, 0);
+    if (size <= 0)
+        return 1;
+
+    char *buf = malloc(size + 1);
+    if (buf == NULL)
+        return 1;
+
+    int len = klogctl(3 /* SYSLOG_ACTION_READ_ALL */, buf, size);
+    if (len < 0) {
+        free(buf);
+        return 1;
+    }
+    buf[len] = '\0';
+
+    int clean = strstr(buf, "BUG:") == NULL && strstr(buf, "WARNING:") == NULL;
+    free(buf);
+
+    return clean;
+}
+
+static void clear_kernel_log(void) {
+    (void)klogctl(5 /* SYSLOG_ACTION_CLEAR */, NULL, 0);
+}
+
+static pid_t spawn_spinner(int keyed) {
+    pid_t pid = fork();
+
+    if (pid != 0)
+        return pid;
+
+    if (keyed && open("/dev/ptrauth", O_RDWR) < 0)
+        _exit(1);
+
+    for (;;)
+        sched_yield();
+}
+
+static void worker(time_t deadline) {
+    long iteration = 0;
+
+    while (time(NULL) < deadline) {
+        int fd = open("/dev/ptrauth", O_RDWR);
+        if (fd < 0)
+            _exit(1);
+
+        // Reopening must keep the existing key
+        int fd2 = open("/dev/ptrauth", O_RDWR);
+        if (fd2 >= 0)
+            close(fd2);
+
+        void *base = mmap(NULL, 0x1000, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+        pid_t child = fork();
+        if (child == 0) {
+            pid_t grandchild = fork();
+            if (grandchild == 0)
+                _exit(0);
+            if (grandchild > 0)
+                waitpid(grandchild, NULL, 0);
+            _exit(0);
+        }
+        if (child > 0)
+            waitpid(child, NULL, 0);
+
+        // Every so often exit with the device still open and mapped
+        if (++iteration % 64 == 0)
+            _exit(0);
+
+        if (base != MAP_FAILED)
+            munmap(base, 0x1000);
+        close(fd);
+    }
+
+    _exit(0);
+}
+
+int main(int argc, char **argv) {
+    int seconds = 30;
+    int workers_per_cpu = 4;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:w:")) != -1) {
+        switch (opt) {
+        case 't': seconds = atoi(optarg); break;
+        case 'w': workers_per_cpu = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-t seconds] [-w workers per cpu]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int workers = cpus * workers_per_cpu;
+    pid_t *spinners = calloc(2 * cpus, sizeof(pid_t));
+    if (spinners == NULL) {
+        perror("calloc");
+        return 1;
+    }
+
+    clear_kernel_log();
+    long baseline = keys_in_use();
+    printf("%ld cpus, %d workers, %d seconds, baseline keys in use: %ld\n",
+           cpus, workers, seconds, baseline);
+
+    for (long i = 0; i < cpus; i++) {
+        spinners[2 * i] = spawn_spinner(1);
+        spinners[2 * i + 1] = spawn_spinner(0);
+    }
+
+    time_t deadline = time(NULL) + seconds;
+    long spawned = 0;
+    int running = 0;
+
+    // Respawn workers as they exit until the deadline
+    while (time(NULL) < deadline || running > 0) {
+        while (running < workers && time(NULL) < deadline) {
+            pid_t pid = fork();
+            if (pid == 0)
+                worker(deadline);
+            if (pid < 0) {
+                perror("fork");
+                break;
+            }
+            running++;
+            spawned++;
+        }
+
+        if (wait(NULL) > 0)
+            running--;
+    }
+
+    for (long i = 0; i < 2 * cpus; i++) {
+        kill(spinners[i], SIGKILL);
+        waitpid(spinners[i], NULL, 0);
+    }
+
+    long after = keys_in_use();
+    printf("spawned %ld workers, keys in use after run: %ld\n", spawned, after);
+
+    if (after != baseline) {
+        fprintf(stderr, "FAIL: key store occupancy %ld, expected %ld\n", after, baseline);
+        return 1;
+    }
+
+    if (!kernel_log_is_clean()) {
+        fprintf(stderr, "FAIL: kernel log contains a BUG or WARNING\n");
+        return 1;
+    }
+
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,108 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
+
+// Measures the cost of a context switch as seen by the ptrauth module.
+//
+// Two processes pinned on the same CPU bounce a byte over a pair of pipes,
+// so every round trip is exactly two context switches through the module's
+// switch hook. Run once without and once with `-k` (both processes open
+// /dev/ptrauth and own a key) and compare against an older module build to
+// see the switch-path cost before and after a driver change.
+//
+// usage: switchbench [-k] [-n iterations] [-c cpu]
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void pin(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        perror("sched_setaffinity");
+        exit(1);
+    }
+}
+
+static void open_device(void) {
+    if (open("/dev/ptrauth", O_RDWR) < 0) {
+        perror("open /dev/ptrauth");
+        exit(1);
+    }
+}
+
+int main(int argc, char **argv) {
+    int keyed = 0;
+    int cpu = 0;
+    long iterations = 100000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "kn:c:")) != -1) {
+        switch (opt) {
+        case 'k': keyed = 1; break;
+        case 'n': iterations = atol(optarg); break;
+        case 'c': cpu = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-k] [-n iterations] [-c cpu]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    int ping[2], pong[2];
+    if (pipe(ping) != 0 || pipe(pong) != 0) {
+        perror("pipe");
+        return 1;
+    }
+
+    pin(cpu);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return 1;
+    }
+
+    if (pid == 0) {
+        char c;
+        if (keyed)
+            open_device();
+
+        for (long i = 0; i < iterations; i++) {
+            if (read(ping[0], &c, 1) != 1 || write(pong[1], &c, 1) != 1)
+                _exit(1);
+        }
+        _exit(0);
+    }
+
+    if (keyed)
+        open_device();
+
+    char c = 0;
+    uint64_t start = now_ns();
+    for (long i = 0; i < iterations; i++) {
+        if (write(ping[1], &c, 1) != 1 || read(pong[0], &c, 1) != 1) {
+            perror("ping-pong");
+            return 1;
+        }
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    waitpid(pid, NULL, 0);
+
+    printf("%s: %ld round trips in %llu ns, %.1f ns per switch\n",
+           keyed ? "keyed" : "unkeyed", iterations,
+           (unsigned long long)elapsed, (double)elapsed / (2.0 * iterations));
+
+    return 0;
+}
@@ -4,7 +4,8 @@
 #include <fcntl.h>
 #include <stdint.h>
 #include <signal.h>
-#include <sys/mman.h>
+
+#include <libptrauth.h>
 
 // ANSI Colors
 #define RED "\e[0;31m"
@@ -12,22 +13,6 @@
 
 #define CRESET "\e[0m"
 
-volatile void *__global_ptrauth_device_base;
-
-uint64_t sign(uint64_t ptr, uint64_t tweak) {
-    *(uint64_t*)(__global_ptrauth_device_base + 0x10) = ptr;
-    *(uint64_t*)(__global_ptrauth_device_base + 0x18) = tweak;
-
-    return  *(uint64_t*)(__global_ptrauth_device_base + 0x20);
-}
-
-uint64_t auth(uint64_t ptr, uint64_t tweak) {
-    *(uint64_t*)(__global_ptrauth_device_base + 0x18) = tweak;
-    *(uint64_t*)(__global_ptrauth_device_base + 0x20) = ptr;
-
-    return  *(uint64_t*)(__global_ptrauth_device_base + 0x20);
-}
-
 static void signal_handler(int signo) {
     signal(SIGUSR1, &signal_handler);
     printf("[%d] Signal handler called! Signal: %s\n", getpid(), strsignal(signo));
@@ -36,10 +21,8 @@ static void signal_handler(int signo) {
 void setup(void) {
     signal(SIGUSR1, &signal_handler);
     printf("Opening device\n");
-    int fd = open("/dev/ptrauth", O_RDWR);
-
-    printf("Memory Mapping\n");
-    __global_ptrauth_device_base = mmap(NULL, 0x1000, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ptrauth_init() != 0)
+        perror("ptrauth_init");
 }
 
 void child(void) {
@@ -53,11 +36,11 @@ int main(void) {
     int pid = getpid();
 
     uint64_t ptr = 0x1234;
-    uint64_t signed_ptr = sign(ptr, 0x10);
+    uint64_t signed_ptr = ptrauth_sign(ptr, 0x10);
     printf("[%d] Signed pointer: %016llx\n", pid, signed_ptr);
 
     sleep(2);
-    uint64_t auth_ptr = auth(signed_ptr, 0x10);
+    uint64_t auth_ptr = ptrauth_auth(signed_ptr, 0x10);
 
 
     if (auth_ptr != ptr) {
@@ -67,7 +50,7 @@ int main(void) {
     }
 
     printf("\n[%d] Trying to authenticate invalid signal\n", pid);
-    uint64_t auth_ptr_funny = auth(signed_ptr + 1, 0x10);
+    uint64_t auth_ptr_funny = ptrauth_auth(signed_ptr + 1, 0x10);
     printf("[%d] Authenticated ptr (should be all zeros): %016llx\n", pid, auth_ptr_funny);
 
 }
@@ -0,0 +1,197 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include <libptrauth.h>
+
+// Checks that a process whose window another process took over gets its
+// own key back, when the two mapped the same instance through different
+// nodes: /dev/ptrauth and /dev/ptrauth0. With lazy_keys=1 the driver
+// revokes the window of the previous owner on every takeover, which must
+// reach the mappings of both nodes.
+//
+// The parent maps the window through one node and signs, a child with a
+// key of its own maps it through the other node and signs, then the parent
+// signs again: it must get the same signature as before. Done with both
+// nodes in both roles. The process is pinned to a CPU of instance 0, for
+// /dev/ptrauth to be that instance.
+//
+// On boards with a second instance, a process that maps the windows of
+// both must sign with its key through either one.
+//
+// Needs the hardware engine, the software one has no window.
+//
+// usage: windowtest
+
+#define INSTANCE_CPUS "/sys/class/cfi_devices/ptrauth0/cpus"
+
+#define TEST_POINTER 0x400123
+#define TEST_TWEAK 42
+
+// First CPU of instance 0
+static int pin_to_instance(void) {
+    FILE *f = fopen(INSTANCE_CPUS, "r");
+    cpu_set_t set;
+    int cpu;
+
+    if (f == NULL || fscanf(f, "%d", &cpu) != 1) {
+        perror(INSTANCE_CPUS);
+        if (f != NULL)
+            fclose(f);
+        return -1;
+    }
+    fclose(f);
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        perror("sched_setaffinity");
+        return -1;
+    }
+
+    return 0;
+}
+
+static volatile uint64_t *map_window(const char *node) {
+    int fd = open(node, O_RDWR);
+    void *regs;
+
+    if (fd < 0) {
+        perror(node);
+        return NULL;
+    }
+
+    regs = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (regs == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+
+    return regs;
+}
+
+static uint64_t sign(volatile uint64_t *regs) {
+    regs[PTRAUTH_REG_PLAINTEXT] = TEST_POINTER;
+    regs[PTRAUTH_REG_TWEAK] = TEST_TWEAK;
+    __ptrauth_io_barrier();
+
+    return regs[PTRAUTH_REG_CIPHERTEXT];
+}
+
+static int round_trip(const char *parent_node, const char *child_node) {
+    volatile uint64_t *regs = map_window(parent_node);
+    uint64_t before, after, other = 0;
+    int pipefd[2], status;
+    pid_t pid;
+
+    if (regs == NULL || pipe(pipefd) != 0)
+        return -1;
+
+    before = sign(regs);
+
+    pid = fork();
+    if (pid == 0) {
+        volatile uint64_t *child_regs = map_window(child_node);
+
+        if (child_regs == NULL)
+            _exit(1);
+        other = sign(child_regs);
+        _exit(write(pipefd[1], &other, sizeof(other)) == sizeof(other) ? 0 : 1);
+    }
+
+    close(pipefd[1]);
+    if (read(pipefd[0], &other, sizeof(other)) != sizeof(other))
+        other = 0;
+    close(pipefd[0]);
+    waitpid(pid, &status, 0);
+
+    after = sign(regs);
+    munmap((void *)regs, sysconf(_SC_PAGESIZE));
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 || other == 0) {
+        fprintf(stderr, "FAIL: child mapping %s\n", child_node);
+        return -1;
+    }
+    if (other == before) {
+        fprintf(stderr, "FAIL: the child signs with the parent key\n");
+        return -1;
+    }
+    if (after != before) {
+        fprintf(stderr, "FAIL: %s signs with another key after %s was used: %#llx, expected %#llx\n",
+                parent_node, child_node, (unsigned long long)after, (unsigned long long)before);
+        return -1;
+    }
+
+    printf("%s then %s: ok\n", parent_node, child_node);
+
+    return 0;
+}
+
+// Both instances hold the key of a process that mapped both windows
+static int two_instances(void) {
+    volatile uint64_t *first, *second;
+    uint64_t a, b;
+
+    if (access("/dev/ptrauth1", F_OK) != 0) {
+        printf("two instances: skipped, single instance\n");
+        return 0;
+    }
+
+    first = map_window("/dev/ptrauth0");
+    second = map_window("/dev/ptrauth1");
+    if (first == NULL || second == NULL)
+        return -1;
+
+    a = sign(first);
+    b = sign(second);
+    if (a != b || sign(first) != a) {
+        fprintf(stderr, "FAIL: the instances sign with different keys: %#llx, %#llx\n",
+                (unsigned long long)a, (unsigned long long)b);
+        return -1;
+    }
+
+    munmap((void *)first, sysconf(_SC_PAGESIZE));
+    munmap((void *)second, sysconf(_SC_PAGESIZE));
+
+    printf("two instances: ok\n");
+
+    return 0;
+}
+
+int main(void) {
+    __u32 policy = PTRAUTH_POLICY_REKEY_ON_EXEC;
+    int fd;
+
+    if (pin_to_instance() != 0)
+        return 1;
+
+    // Children get a key of their own
+    fd = open("/dev/ptrauth", O_RDWR);
+    if (fd < 0) {
+        perror("/dev/ptrauth");
+        return 1;
+    }
+    if (ioctl(fd, PTRAUTH_IOC_SET_POLICY, &policy) != 0) {
+        perror("PTRAUTH_IOC_SET_POLICY");
+        return 1;
+    }
+
+    if (round_trip("/dev/ptrauth", "/dev/ptrauth0") != 0 || round_trip("/dev/ptrauth0", "/dev/ptrauth") != 0)
+        return 1;
+
+    if (two_instances() != 0)
+        return 1;
+
+    close(fd);
+
+    return 0;
+}
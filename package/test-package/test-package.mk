@@ -7,13 +7,42 @@
 TEST_PACKAGE_VERSION = 1.0
 TEST_PACKAGE_SITE = package/test-package/src
 TEST_PACKAGE_SITE_METHOD = local
+TEST_PACKAGE_DEPENDENCIES = libptrauth
+
+# fnptrtest is compiled with the ptrauth GCC plugin
+ifeq ($(BR2_PACKAGE_HOST_PTRAUTH_GCC_PLUGIN),y)
+TEST_PACKAGE_DEPENDENCIES += host-ptrauth-gcc-plugin
+TEST_PACKAGE_MAKE_OPTS += PTRAUTH_PLUGIN=y
+
+define TEST_PACKAGE_INSTALL_FNPTRTEST
+	$(INSTALL) -D -m 0755 $(@D)/fnptrtest $(TARGET_DIR)/usr/bin
+	$(INSTALL) -D -m 0755 $(@D)/fnptrtest-batch $(TARGET_DIR)/usr/bin
+	$(if $(BR2_INSTALL_LIBSTDCPP),\
+		$(INSTALL) -D -m 0755 $(@D)/fnptrtest-cxx $(TARGET_DIR)/usr/bin)
+endef
+
+# and built as C++ too, for the vtables
+ifeq ($(BR2_INSTALL_LIBSTDCPP),y)
+TEST_PACKAGE_MAKE_OPTS += PTRAUTH_PLUGIN_CXX=y
+endif
+endif
 
 define TEST_PACKAGE_BUILD_CMDS
-	$(MAKE) CC="$(TARGET_CC)" LD="$(TARGET_LD)" -C $(@D)
+	$(MAKE) CC="$(TARGET_CC)" CXX="$(TARGET_CXX)" LD="$(TARGET_LD)" $(TEST_PACKAGE_MAKE_OPTS) -C $(@D)
 endef
 
 define TEST_PACKAGE_INSTALL_TARGET_CMDS
 	$(INSTALL) -D -m 0755 $(@D)/testpackage $(TARGET_DIR)/usr/bin
+	$(INSTALL) -D -m 0755 $(@D)/switchbench $(TARGET_DIR)/usr/bin
+	$(INSTALL) -D -m 0755 $(@D)/forkstress $(TARGET_DIR)/usr/bin
+	$(INSTALL) -D -m 0755 $(@D)/smpstress $(TARGET_DIR)/usr/bin
+	$(INSTALL) -D -m 0755 $(@D)/batchbench $(TARGET_DIR)/usr/bin
+	$(INSTALL) -D -m 0755 $(@D)/keypolicy $(TARGET_DIR)/usr/bin
+	$(INSTALL) -D -m 0755 $(@D)/mixedload $(TARGET_DIR)/usr/bin
+	$(INSTALL) -D -m 0755 $(@D)/callbacks $(TARGET_DIR)/usr/bin
+	$(INSTALL) -D -m 0755 $(@D)/reloadtest $(TARGET_DIR)/usr/bin
+	$(INSTALL) -D -m 0755 $(@D)/windowtest $(TARGET_DIR)/usr/bin
+	$(TEST_PACKAGE_INSTALL_FNPTRTEST)
 endef
 
 $(eval $(generic-package))
@@ -7,10 +7,19 @@ cd "${BINARIES_DIR}"
 
 mode_serial=false
 mode_sys_qemu=false
+smp=1
+kernel_args=''
 while [ "$1" ]; do
     case "$1" in
     --serial-only|serial-only) mode_serial=true; shift;;
     --use-system-qemu) mode_sys_qemu=true; shift;;
+    --smp) smp="$2"; shift 2;;
+    # stock QEMU has no PtrauthDevice, use the driver's software engine
+    --soft-engine) mode_sys_qemu=true; kernel_args="${kernel_args} ptrauth.engine=soft"; shift;;
+    # one emulated device per share of the CPUs, with --soft-engine
+    --soft-instances) kernel_args="${kernel_args} ptrauth.soft_instances=$2"; shift 2;;
+    # kmemleak is built in but off by default, reloadtest needs it
+    --kmemleak) kernel_args="${kernel_args} kmemleak=on"; shift;;
     --) shift; break;;
     *) echo "unknown option: $1" >&2; exit 1;;
     esac
@@ -29,8 +38,8 @@ fi
 exec qemu-system-aarch64 \
     -M virt -cpu cortex-a53 \
     -D qemu-debug.log -d guest_errors \
-    -nographic -smp 1 \
-    -kernel Image -append "rootwait root=/dev/vda console=ttyAMA0" \
+    -nographic -smp "${smp}" \
+    -kernel Image -append "rootwait root=/dev/vda console=ttyAMA0${kernel_args}" \
     -netdev user,id=eth0 -device virtio-net-device,netdev=eth0 \
     -drive file=rootfs.ext4,if=none,format=raw,id=hd0 \
     -device virtio-blk-device,drive=hd0 \
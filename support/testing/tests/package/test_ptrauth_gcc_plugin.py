@@ -0,0 +1,49 @@
+import os
+
+import infra.basetest
+
+
+class TestPtrauthGccPlugin(infra.basetest.BRTest):
+
+    # The plugin is built against the internal toolchain, and test-package
+    # compiles fnptrtest with it, as C and as C++. The module needs a 6.4+
+    # kernel, and runs with its software engine as QEMU has no
+    # PtrauthDevice.
+    config = \
+        """
+        BR2_aarch64=y
+        BR2_TOOLCHAIN_BUILDROOT_GLIBC=y
+        BR2_TOOLCHAIN_BUILDROOT_CXX=y
+        BR2_PACKAGE_HOST_LINUX_HEADERS_CUSTOM_6_6=y
+        BR2_TARGET_GENERIC_GETTY_PORT="ttyAMA0"
+        BR2_LINUX_KERNEL=y
+        BR2_LINUX_KERNEL_CUSTOM_VERSION=y
+        BR2_LINUX_KERNEL_CUSTOM_VERSION_VALUE="6.6.32"
+        BR2_LINUX_KERNEL_USE_CUSTOM_CONFIG=y
+        BR2_LINUX_KERNEL_CUSTOM_CONFIG_FILE="board/qemu/aarch64-virt/linux.config"
+        BR2_LINUX_KERNEL_NEEDS_HOST_OPENSSL=y
+        BR2_PACKAGE_PTRAUTH=y
+        BR2_PACKAGE_HOST_PTRAUTH_GCC_PLUGIN=y
+        BR2_PACKAGE_TEST_PACKAGE=y
+        BR2_TARGET_ROOTFS_CPIO=y
+        BR2_TARGET_ROOTFS_CPIO_GZIP=y
+        # BR2_TARGET_ROOTFS_TAR is not set
+        """
+
+    def test_run(self):
+        img = os.path.join(self.builddir, "images", "rootfs.cpio.gz")
+        kern = os.path.join(self.builddir, "images", "Image")
+        self.emulator.boot(arch="aarch64",
+                           kernel=kern,
+                           kernel_cmdline=["console=ttyAMA0"],
+                           options=["-M", "virt", "-cpu", "cortex-a57", "-m", "256M", "-initrd", img])
+        self.emulator.login()
+
+        self.assertRunOk("modprobe ptrauth engine=soft")
+
+        # Signing at every store, and from the constructor
+        self.assertRunOk("fnptrtest")
+        self.assertRunOk("fnptrtest-batch")
+
+        # int (*)() pointers signed, vtables left alone
+        self.assertRunOk("fnptrtest-cxx")
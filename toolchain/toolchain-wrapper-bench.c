@@ -0,0 +1,276 @@
+/**
+ * Microbenchmark of the argument classification of the toolchain wrapper:
+ * classify_args(), which main() runs once, against the separate scans of
+ * argv that main() used to do for every check.
+ *
+ * Argument sets are read from captures of the wrapper traces, one argument
+ * per line:
+ *
+ *   BR2_DEBUG_WRAPPER=2 make foo-rebuild 2> trace.log
+ *   cc -O2 -o wrapper-bench toolchain/toolchain-wrapper-bench.c
+ *   ./wrapper-bench trace.log
+ *
+ * Without a capture, a compile line and link lines of 1000 and 20000
+ * objects are generated.
+ *
+ * This file is licensed under the terms of the GNU General Public License
+ * version 2.  This program is licensed "as is" without any warranty of any
+ * kind, whether express or implied.
+ */
+
+#ifndef BR_SYSROOT
+#define BR_SYSROOT "sysroot"
+#endif
+#ifndef BR_CROSS_PATH_SUFFIX
+#define BR_CROSS_PATH_SUFFIX ".br_real"
+#endif
+
+#define main toolchain_wrapper_main
+#include "toolchain-wrapper.c"
+#undef main
+
+struct argv_set {
+	int argc;
+	char **argv;
+	int size;
+};
+
+static struct argv_set *sets;
+static int nsets;
+
+static void set_add(struct argv_set *set, const char *arg)
+{
+	if (set->argc + 1 >= set->size) {
+		set->size = set->size ? 2 * set->size : 64;
+		set->argv = realloc(set->argv, set->size * sizeof(char *));
+		if (set->argv == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	set->argv[set->argc++] = strdup(arg);
+	set->argv[set->argc] = NULL;
+}
+
+static struct argv_set *new_set(void)
+{
+	sets = realloc(sets, (nsets + 1) * sizeof(*sets));
+	if (sets == NULL) {
+		perror("realloc");
+		exit(1);
+	}
+	memset(&sets[nsets], 0, sizeof(*sets));
+	return &sets[nsets++];
+}
+
+/* Reads the "called with" part of BR2_DEBUG_WRAPPER=2 traces */
+static void read_capture(const char *file)
+{
+	struct argv_set *set = NULL;
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	FILE *f = fopen(file, "r");
+
+	if (f == NULL) {
+		perror(file);
+		exit(1);
+	}
+	while ((len = getline(&line, &size, f)) > 0) {
+		if (line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (!strcmp(line, "Toolchain wrapper was called with:"))
+			set = new_set();
+		else if (!strncmp(line, "Toolchain wrapper", strlen("Toolchain wrapper")))
+			set = NULL;
+		else if (set && len >= 6 && !strncmp(line, "    '", 5) && line[len - 1] == '\'') {
+			line[len - 1] = '\0';
+			set_add(set, line + 5);
+		}
+	}
+	free(line);
+	fclose(f);
+}
+
+static void generate(void)
+{
+	static const char *const compile[] = {
+		"aarch64-linux-gcc", "-D_LARGEFILE_SOURCE", "-D_FILE_OFFSET_BITS=64",
+		"-O2", "-g0", "-fPIC", "-I.", "-Iinclude", "-DHAVE_CONFIG_H",
+		"-Wall", "-MT", "foo.o", "-MD", "-MP", "-MF", ".deps/foo.Tpo",
+		"-c", "-o", "foo.o", "foo.c", NULL,
+	};
+	static const int objects[] = { 1000, 20000 };
+	struct argv_set *set;
+	char obj[32];
+	int i, j;
+
+	set = new_set();
+	for (i = 0; compile[i]; i++)
+		set_add(set, compile[i]);
+
+	for (i = 0; i < sizeof(objects) / sizeof(objects[0]); i++) {
+		set = new_set();
+		set_add(set, "aarch64-linux-g++");
+		set_add(set, "-shared");
+		set_add(set, "-o");
+		set_add(set, "libbig.so");
+		for (j = 0; j < objects[i]; j++) {
+			snprintf(obj, sizeof(obj), "obj/unit%05d.o", j);
+			set_add(set, obj);
+		}
+		set_add(set, "-L../lib");
+		set_add(set, "-lstdc++");
+	}
+}
+
+/* The scans main() did before classify_args(), unsafe paths are counted
+ * instead of being fatal */
+static int legacy_scans(int argc, char **argv)
+{
+	const struct str_len_s *opt;
+	int i, result = 0, found_shared = 0, add_fp32_mode = 1;
+
+	for (i = 1; i < argc; i++)
+		if (!strcmp(argv[i], "--help"))
+			result++;
+
+	for (i = 1; i < argc; i++) {
+		if (!strncmp(argv[i], "-mfloat-abi=", strlen("-mfloat-abi=")) ||
+		    !strcmp(argv[i], "-msoft-float") ||
+		    !strcmp(argv[i], "-mhard-float"))
+			break;
+	}
+	result += i;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-msoft-float"))
+			add_fp32_mode = 0;
+		else if (!strcmp(argv[i], "-mhard-float"))
+			add_fp32_mode = 1;
+	}
+	result += add_fp32_mode;
+
+	for (i = 1; i < argc; i++) {
+		if (!strncmp(argv[i], "-march=", strlen("-march=")) ||
+		    !strncmp(argv[i], "-mtune=", strlen("-mtune=")) ||
+		    !strncmp(argv[i], "-mcpu=",  strlen("-mcpu=" )))
+			break;
+	}
+	result += i;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-r") ||
+		    !strcmp(argv[i], "-Wl,-r") ||
+		    !strcmp(argv[i], "-static") ||
+		    !strcmp(argv[i], "-D__KERNEL__") ||
+		    !strcmp(argv[i], "-D__UBOOT__") ||
+		    !strcmp(argv[i], "-fno-pie") ||
+		    !strcmp(argv[i], "-fno-PIE") ||
+		    !strcmp(argv[i], "-no-pie"))
+			break;
+		if (!strcmp(argv[i], "-shared"))
+			found_shared = 1;
+	}
+	if (i == argc) {
+		for (i = 1; i < argc; i++) {
+			if (!strcmp(argv[i], "-fpie") ||
+			    !strcmp(argv[i], "-fPIE") ||
+			    !strcmp(argv[i], "-fpic") ||
+			    !strcmp(argv[i], "-fPIC"))
+				break;
+		}
+		result += i + found_shared;
+	}
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-D__KERNEL__") ||
+		    !strcmp(argv[i], "-D__UBOOT__"))
+			break;
+	}
+	result += i;
+
+	for (i = 1; i < argc; i++) {
+		for (opt=unsafe_opts; opt->str; opt++ ) {
+			if (strncmp(argv[i], opt->str, opt->len))
+				continue;
+			if (argv[i][opt->len] == '\0') {
+				i++;
+				if (i == argc)
+					break;
+				result += is_unsafe_path(argv[i]);
+			} else
+				result += is_unsafe_path(argv[i] + opt->len);
+		}
+	}
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-c") ||
+		    !strcmp(argv[i], "-S") ||
+		    !strcmp(argv[i], "-E"))
+			result++;
+	}
+
+	return result;
+}
+
+static int single_pass(int argc, char **argv)
+{
+	struct args_info info;
+
+	classify_args(argc, argv, &info);
+
+	return info.help + info.arch + info.no_pie + info.pic + info.no_link +
+	       (info.unsafe_arg != NULL);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Nanoseconds per call, repeated for about 0.2s */
+static double measure(int (*fn)(int, char **), const struct argv_set *set)
+{
+	static volatile int sink;
+	long n, calls = 0;
+	double start = now(), elapsed;
+
+	do {
+		for (n = 0; n < 16; n++, calls++)
+			sink += fn(set->argc, set->argv);
+		elapsed = now() - start;
+	} while (elapsed < 0.2);
+
+	return elapsed * 1e9 / calls;
+}
+
+int main(int argc, char **argv)
+{
+	double legacy, single, total_legacy = 0, total_single = 0;
+	int i;
+
+	for (i = 1; i < argc; i++)
+		read_capture(argv[i]);
+	if (nsets == 0)
+		generate();
+
+	printf("%8s %14s %14s %8s  %s\n", "args", "scans (ns)", "1 pass (ns)", "speedup", "command");
+	for (i = 0; i < nsets; i++) {
+		if (sets[i].argc == 0)
+			continue;
+		legacy = measure(legacy_scans, &sets[i]);
+		single = measure(single_pass, &sets[i]);
+		total_legacy += legacy;
+		total_single += single;
+		printf("%8d %14.0f %14.0f %7.2fx  %s\n", sets[i].argc, legacy, single,
+		       legacy / single, sets[i].argv[0]);
+	}
+	printf("%8s %14.0f %14.0f %7.2fx\n", "total", total_legacy, total_single,
+	       total_legacy / total_single);
+
+	return 0;
+}
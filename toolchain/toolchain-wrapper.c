@@ -24,6 +24,14 @@
 #include <errno.h>
 #include <time.h>
 #include <stdbool.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/auxv.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #ifdef BR_CCACHE
 static char ccache_path[PATH_MAX];
@@ -53,8 +61,13 @@ static char _date_[sizeof("-D__DATE__=\"MMM DD YYYY\"")];
  * 	-Wl,-z,relro
  * 	-fPIE
  * 	-pie
+ * 	-fplugin=ptrauth
+ * 	-fplugin-arg-ptrauth-batch
+ * 	-Wl,--push-state,--as-needed
+ * 	-lptrauth
+ * 	-Wl,--pop-state
  */
-#define EXCLUSIVE_ARGS	10
+#define EXCLUSIVE_ARGS	15
 
 static char *predef_args[] = {
 #ifdef BR_CCACHE
@@ -155,22 +168,172 @@ static const struct str_len_s unsafe_opts[] = {
  * the argument as it already contains the path (arg_has_path), while in
  * the second case we need to print both (!arg_has_path).
  */
+static bool is_unsafe_path(const char *path)
+{
+	const struct str_len_s *p;
+
+	for (p=unsafe_paths; p->str; p++) {
+		if (!strncmp(path, p->str, p->len))
+			return true;
+	}
+	return false;
+}
+
 static void check_unsafe_path(const char *arg,
 			      const char *path,
 			      int arg_has_path)
 {
-	const struct str_len_s *p;
+	if (!is_unsafe_path(path))
+		return;
+	fprintf(stderr,
+		"%s: ERROR: unsafe header/library path used in cross-compilation: '%s%s%s'\n",
+		program_invocation_short_name,
+		arg,
+		arg_has_path ? "" : "' '", /* close single-quote, space, open single-quote */
+		arg_has_path ? "" : path); /* so that arg and path are properly quoted. */
+	exit(1);
+}
 
-	for (p=unsafe_paths; p->str; p++) {
-		if (strncmp(path, p->str, p->len))
+/* What main() needs to know about the arguments. Link lines can have tens
+ * of thousands of arguments, so they are classified in a single pass by
+ * classify_args() rather than scanned again for every check.
+ */
+struct args_info {
+	bool help;		/* --help */
+	bool float_abi;		/* -mfloat-abi=, -msoft-float or -mhard-float */
+	bool fp32_mode;		/* no -msoft-float, or -mhard-float after it */
+	bool arch;		/* -march=, -mtune= or -mcpu= */
+	bool kernel;		/* -D__KERNEL__ or -D__UBOOT__ */
+	bool no_pie;		/* an option disabling or incompatible with PIE */
+	bool shared;		/* -shared */
+	bool pic;		/* -fpie, -fPIE, -fpic or -fPIC */
+	bool compile;		/* -c or -S */
+	bool no_link;		/* -c, -S or -E */
+	const char *output;	/* value of -o, NULL if none */
+	/* First unsafe header/library path, see check_unsafe_path() */
+	const char *unsafe_arg;
+	const char *unsafe_path;
+	int unsafe_arg_has_path;
+};
+
+static void note_unsafe_path(struct args_info *info, const char *arg,
+			     const char *path, int arg_has_path)
+{
+	if (info->unsafe_arg || !is_unsafe_path(path))
+		return;
+	info->unsafe_arg = arg;
+	info->unsafe_path = path;
+	info->unsafe_arg_has_path = arg_has_path;
+}
+
+/* Inputs are skipped at once, and options are dispatched on their first
+ * letter so that each one is only compared against the few options
+ * sharing it.
+ */
+static void classify_args(int argc, char **argv, struct args_info *info)
+{
+	const struct str_len_s *opt;
+	const char *arg;
+	int i;
+
+	memset(info, 0, sizeof(*info));
+	info->fp32_mode = true;
+
+	for (i = 1; i < argc; i++) {
+		arg = argv[i];
+		if (arg[0] != '-')
 			continue;
-		fprintf(stderr,
-			"%s: ERROR: unsafe header/library path used in cross-compilation: '%s%s%s'\n",
-			program_invocation_short_name,
-			arg,
-			arg_has_path ? "" : "' '", /* close single-quote, space, open single-quote */
-			arg_has_path ? "" : path); /* so that arg and path are properly quoted. */
-		exit(1);
+
+		switch (arg[1]) {
+		case '-':
+			if (!strcmp(arg, "--help"))
+				info->help = true;
+			break;
+		case 'c':
+		case 'S':
+			if (arg[2] == '\0')
+				info->compile = info->no_link = true;
+			break;
+		case 'E':
+			if (arg[2] == '\0')
+				info->no_link = true;
+			break;
+		case 'o':
+			if (arg[2] != '\0')
+				info->output = arg + 2;
+			else if (i + 1 < argc)
+				info->output = argv[++i];
+			break;
+		case 'r':
+			if (arg[2] == '\0')
+				info->no_pie = true;
+			break;
+		case 's':
+			if (!strcmp(arg, "-static"))
+				info->no_pie = true;
+			else if (!strcmp(arg, "-shared"))
+				info->shared = true;
+			break;
+		case 'n':
+			if (!strcmp(arg, "-no-pie"))
+				info->no_pie = true;
+			break;
+		case 'D':
+			if (!strcmp(arg, "-D__KERNEL__") ||
+			    !strcmp(arg, "-D__UBOOT__"))
+				info->kernel = info->no_pie = true;
+			break;
+		case 'W':
+			if (!strcmp(arg, "-Wl,-r"))
+				info->no_pie = true;
+			break;
+		case 'f':
+			if (!strcmp(arg, "-fno-pie") ||
+			    !strcmp(arg, "-fno-PIE"))
+				info->no_pie = true;
+			else if (!strcmp(arg, "-fpie") ||
+				 !strcmp(arg, "-fPIE") ||
+				 !strcmp(arg, "-fpic") ||
+				 !strcmp(arg, "-fPIC"))
+				info->pic = true;
+			break;
+		case 'm':
+			if (!strncmp(arg, "-mfloat-abi=", strlen("-mfloat-abi=")))
+				info->float_abi = true;
+			else if (!strcmp(arg, "-msoft-float")) {
+				info->float_abi = true;
+				info->fp32_mode = false;
+			} else if (!strcmp(arg, "-mhard-float")) {
+				info->float_abi = true;
+				info->fp32_mode = true;
+			}
+			else if (!strncmp(arg, "-march=", strlen("-march=")) ||
+				 !strncmp(arg, "-mtune=", strlen("-mtune=")) ||
+				 !strncmp(arg, "-mcpu=",  strlen("-mcpu=" )))
+				info->arch = true;
+			break;
+		case 'I':
+		case 'L':
+		case 'i':
+			for (opt=unsafe_opts; opt->str; opt++) {
+				if (strncmp(arg, opt->str, opt->len))
+					continue;
+
+				/* Handle both cases:
+				 *  - path is a separate argument,
+				 *  - path is concatenated with option.
+				 */
+				if (arg[opt->len] == '\0') {
+					if (i + 1 == argc)
+						break;
+					i++;
+					note_unsafe_path(info, arg, argv[i], 0);
+				} else
+					note_unsafe_path(info, arg, arg + opt->len, 1);
+				break;
+			}
+			break;
+		}
 	}
 }
 
@@ -238,14 +401,598 @@ bool parse_source_date_epoch_from_env(void)
 }
 #endif
 
-int main(int argc, char **argv)
+/* Growable string, for the records and response files written by the
+ * wrapper */
+struct strbuf {
+	char   *str;
+	size_t len;
+	size_t size;
+};
+
+static void strbuf_add(struct strbuf *sb, const char *s, size_t n)
+{
+	if (sb->len + n + 1 > sb->size) {
+		sb->size = 2 * (sb->len + n + 1);
+		sb->str = realloc(sb->str, sb->size);
+		if (sb->str == NULL) {
+			perror(__FILE__ ": realloc");
+			exit(2);
+		}
+	}
+	memcpy(sb->str + sb->len, s, n);
+	sb->len += n;
+	sb->str[sb->len] = '\0';
+}
+
+static void strbuf_printf(struct strbuf *sb, const char *fmt, ...)
+{
+	char tmp[256];
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		return;
+	strbuf_add(sb, tmp, (size_t)n < sizeof(tmp) ? (size_t)n : sizeof(tmp) - 1);
+}
+
+/* Append s as a quoted JSON string. Only quotes, backslashes and control
+ * characters need escaping.
+ */
+static void strbuf_add_json(struct strbuf *sb, const char *s)
+{
+	size_t n;
+
+	strbuf_add(sb, "\"", 1);
+	while (*s) {
+		for (n = 0; s[n] && s[n] != '"' && s[n] != '\\' &&
+			    (unsigned char)s[n] >= 0x20; n++)
+			;
+		strbuf_add(sb, s, n);
+		s += n;
+		if (!*s)
+			break;
+		if (*s == '"' || *s == '\\')
+			strbuf_printf(sb, "\\%c", *s);
+		else
+			strbuf_printf(sb, "\\u%04x", (unsigned char)*s);
+		s++;
+	}
+	strbuf_add(sb, "\"", 1);
+}
+
+/* Append a record to a log with a single write() on a file opened with
+ * O_APPEND, so that wrappers running in parallel never interleave their
+ * records and need no locking. Failing to log is not an error.
+ */
+static void append_record(const char *file, const struct strbuf *sb)
+{
+	int fd = open(file, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+
+	if (fd < 0 || write(fd, sb->str, sb->len) != (ssize_t)sb->len)
+		fprintf(stderr, "%s: cannot log to %s: %s\n",
+			program_invocation_short_name, file, strerror(errno));
+	if (fd >= 0)
+		close(fd);
+}
+
+static double timespec_diff(const struct timespec *start,
+			    const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) +
+	       (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Run the real compiler as a child instead of exec'ing it, and append a
+ * record of the call to the log file: the package being built (exported
+ * by the package infrastructure as BR2_WRAPPER_LOG_PKG), the tool, the
+ * output file, the wall, user and system time, the peak RSS and the exit
+ * code, as one JSON object per line.
+ *
+ * Returns the exit code of the compiler. If it was killed by a signal,
+ * the wrapper dies of the same signal.
+ */
+static int run_and_log(const char *log, char **exec_args, const char *tool,
+		       const char *out)
+{
+	struct strbuf record = { NULL, 0, 0 };
+	const char *pkg;
+	char output[PATH_MAX];
+	struct timespec start, end;
+	struct rusage usage;
+	int status, code, len;
+	pid_t pid;
+
+	/* Relative outputs are made absolute, to tell files apart across
+	 * packages and directories */
+	output[0] = '\0';
+	if (out && out[0] != '/' && getcwd(output, sizeof(output) - 1)) {
+		len = strlen(output);
+		snprintf(output + len, sizeof(output) - len, "/%s", out);
+	} else if (out)
+		snprintf(output, sizeof(output), "%s", out);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pid = fork();
+	if (pid < 0) {
+		perror(__FILE__ ": fork");
+		return 2;
+	}
+	if (pid == 0) {
+		execv(exec_args[0], exec_args);
+		perror(path);
+		_exit(2);
+	}
+	while (wait4(pid, &status, 0, &usage) < 0) {
+		if (errno != EINTR) {
+			perror(__FILE__ ": wait4");
+			return 2;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+
+	pkg = getenv("BR2_WRAPPER_LOG_PKG");
+	strbuf_printf(&record, "{\"pkg\":");
+	strbuf_add_json(&record, pkg ? pkg : "");
+	strbuf_printf(&record, ",\"tool\":");
+	strbuf_add_json(&record, tool);
+	strbuf_printf(&record, ",\"output\":");
+	strbuf_add_json(&record, output);
+
+	strbuf_printf(&record, ",\"wall\":%.6f,\"user\":%.6f,\"sys\":%.6f,"
+		      "\"maxrss_kb\":%ld,\"exit\":%d}\n",
+		      timespec_diff(&start, &end),
+		      usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6,
+		      usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6,
+		      usage.ru_maxrss, code);
+
+	append_record(log, &record);
+	free(record.str);
+
+	if (WIFSIGNALED(status)) {
+		signal(WTERMSIG(status), SIG_DFL);
+		raise(WTERMSIG(status));
+	}
+
+	return code;
+}
+
+/* Options of the compiler driver whose value may be the next argument,
+ * which is then not an input file.
+ */
+static const char *const opts_with_value[] = {
+	"-o", "-x", "-I", "-D", "-U", "-L", "-l", "-T",
+	"-include", "-imacros", "-isystem", "-idirafter", "-iquote",
+	"-iprefix", "-iwithprefix", "-iwithprefixbefore", "-isysroot",
+	"--sysroot", "-MF", "-MT", "-MQ", "-Xlinker", "-Xassembler",
+	"-Xpreprocessor", "-aux-info", "--param", "-e", "-u", "-z",
+	NULL,
+};
+
+static const char *const source_exts[] = {
+	".c", ".cc", ".cp", ".cpp", ".cxx", ".c++", ".CPP", ".C",
+	".m", ".mm", ".M", ".s", ".S", ".sx",
+	NULL,
+};
+
+static bool is_source(const char *arg)
+{
+	const char *ext = strrchr(arg, '.');
+	const char *const *e;
+
+	if (ext == NULL)
+		return false;
+	for (e = source_exts; *e; e++)
+		if (!strcmp(ext, *e))
+			return true;
+
+	return false;
+}
+
+/* Append one compile_commands.json entry per source file compiled by
+ * this call to the shard of the package being built: the directory, the
+ * full command line of the real compiler (with the arguments added by
+ * the wrapper, so that tools see the sysroot and target flags) and the
+ * file. Only compilations (-c or -S) are recorded, not links nor
+ * preprocessing. The package infrastructure merges the shard into
+ * compile_commands.json at the end of the build step.
+ */
+static void record_compile_command(const char *shard, char **cc_args,
+				   int argc, char **argv,
+				   const struct args_info *info)
+{
+	struct strbuf record = { NULL, 0, 0 };
+	const char *const *opt;
+	char **arg, cwd[PATH_MAX];
+	int i;
+
+	if (!info->compile || getcwd(cwd, sizeof(cwd)) == NULL)
+		return;
+
+	for (i = 1; i < argc; i++) {
+		if (argv[i][0] == '-') {
+			for (opt = opts_with_value; *opt; opt++)
+				if (!strcmp(argv[i], *opt))
+					break;
+			if (*opt)
+				i++;
+			continue;
+		}
+		if (!is_source(argv[i]))
+			continue;
+
+		strbuf_printf(&record, "{\"directory\":");
+		strbuf_add_json(&record, cwd);
+		strbuf_printf(&record, ",\"arguments\":[");
+		for (arg = cc_args; *arg; arg++) {
+			if (arg != cc_args)
+				strbuf_add(&record, ",", 1);
+			strbuf_add_json(&record, *arg);
+		}
+		strbuf_printf(&record, "],\"file\":");
+		strbuf_add_json(&record, argv[i]);
+		if (info->output) {
+			strbuf_printf(&record, ",\"output\":");
+			strbuf_add_json(&record, info->output);
+		}
+		strbuf_printf(&record, "}\n");
+	}
+
+	if (record.len)
+		append_record(shard, &record);
+	free(record.str);
+}
+
+/* Absolute path of the host directory, the parent of the directory of the
+ * wrapper (dir, or /proc/self/exe when it was run from the PATH). */
+static char *find_basedir(const char *dir)
 {
-	char **args, **cur, **exec_args;
 	char *relbasedir, *absbasedir;
+	int ret, i, count = 0;
+
+	if (dir) {
+		relbasedir = malloc(strlen(dir) + 4);
+		if (relbasedir == NULL) {
+			perror(__FILE__ ": malloc");
+			return NULL;
+		}
+		sprintf(relbasedir, "%s/..", dir);
+		absbasedir = realpath(relbasedir, NULL);
+		if (absbasedir == NULL)
+			perror(__FILE__ ": realpath");
+		free(relbasedir);
+		return absbasedir;
+	}
+
+	absbasedir = malloc(PATH_MAX + 1);
+	if (absbasedir == NULL) {
+		perror(__FILE__ ": malloc");
+		return NULL;
+	}
+	ret = readlink("/proc/self/exe", absbasedir, PATH_MAX);
+	if (ret < 0) {
+		perror(__FILE__ ": readlink");
+		free(absbasedir);
+		return NULL;
+	}
+	absbasedir[ret] = '\0';
+	for (i = ret; i > 0; i--) {
+		if (absbasedir[i] == '/') {
+			absbasedir[i] = '\0';
+			if (++count == 2)
+				break;
+		}
+	}
+	return absbasedir;
+}
+
+#ifdef BR_BASEDIR
+/* Whether the wrapper was started as BR_BASEDIR/bin/<name>. The path the
+ * kernel executed is in the auxiliary vector, so unlike resolving
+ * /proc/self/exe this needs no system call. A copied or moved host
+ * directory, or one reached through another path, does not match. */
+static int run_from_basedir(void)
+{
+	const char *execfn = (const char *)getauxval(AT_EXECFN);
+	size_t len = strlen(BR_BASEDIR "/bin/");
+
+	return execfn && strncmp(execfn, BR_BASEDIR "/bin/", len) == 0 &&
+		strchr(execfn + len, '/') == NULL;
+}
+#endif
+
+/* Response files (@file) are expanded by the wrapper the way the compiler
+ * driver does it (see expandargv() in libiberty), so that their contents
+ * are classified and checked like any other argument, and the real
+ * compiler gets the arguments directly instead of parsing them again.
+ *
+ * A response file is mapped rather than read into a buffer, and split in
+ * place: each argument is unquoted over itself and terminated over the
+ * separator that follows it, the expanded argv pointing into the mapping.
+ */
+#define MAX_RESPONSE_FILES 2000
+
+static bool is_rsp_space(char c)
+{
+	return c == ' ' || c == '\t' || c == '\n' ||
+	       c == '\v' || c == '\f' || c == '\r';
+}
+
+/* Split the size bytes of buf into arguments, stored in args unless it is
+ * NULL, and return their number. Arguments are separated by whitespace,
+ * which can be quoted with '' or "" or escaped with a backslash. Storing
+ * them needs buf[size] to be writable, to terminate the last one.
+ */
+static int split_response_file(char *buf, size_t size, char **args)
+{
+	char *in = buf, *end = buf + size, *out;
+	bool squote, dquote, bsquote;
+	int n = 0;
+
+	while (in < end && *in) {
+		if (is_rsp_space(*in)) {
+			in++;
+			continue;
+		}
+
+		out = in;
+		if (args)
+			args[n] = out;
+		n++;
+
+		squote = dquote = bsquote = false;
+		for (; in < end && *in; in++) {
+			if (bsquote)
+				bsquote = false;
+			else if (*in == '\\') {
+				bsquote = true;
+				continue;
+			} else if (squote) {
+				if (*in == '\'') {
+					squote = false;
+					continue;
+				}
+			} else if (dquote) {
+				if (*in == '"') {
+					dquote = false;
+					continue;
+				}
+			} else if (is_rsp_space(*in))
+				break;
+			else if (*in == '\'') {
+				squote = true;
+				continue;
+			} else if (*in == '"') {
+				dquote = true;
+				continue;
+			}
+			if (args)
+				*out++ = *in;
+		}
+
+		/* Skip the separator before it is overwritten */
+		if (in < end && *in)
+			in++;
+		if (args)
+			*out = '\0';
+	}
+
+	return n;
+}
+
+/* For what cannot be mapped with a spare byte: pipes, and files ending
+ * on a page boundary */
+static char *read_response_file(int fd, size_t *size)
+{
+	size_t len = 0, alloc = 4096;
+	char *buf = NULL, *tmp;
+	ssize_t n;
+
+	for (;;) {
+		if (buf == NULL || len + 1 == alloc) {
+			alloc = buf ? 2 * alloc : alloc;
+			tmp = realloc(buf, alloc);
+			if (tmp == NULL) {
+				free(buf);
+				return NULL;
+			}
+			buf = tmp;
+		}
+		n = read(fd, buf + len, alloc - len - 1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			free(buf);
+			return NULL;
+		}
+		if (n == 0)
+			break;
+		len += n;
+	}
+
+	*size = len;
+	return buf;
+}
+
+/* Map a response file, private and writable so that it can be split in
+ * place. Returns NULL if it cannot be read, the argument then being left
+ * alone, as the compiler driver does.
+ */
+static char *map_response_file(const char *file, size_t *size)
+{
+	struct stat st;
+	char *buf = NULL;
+	int fd;
+
+	fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || S_ISDIR(st.st_mode)) {
+		close(fd);
+		return NULL;
+	}
+
+	/* The rest of the last page of a mapping is zero-filled, which
+	 * leaves room to terminate the last argument */
+	if (S_ISREG(st.st_mode) && st.st_size % sysconf(_SC_PAGESIZE)) {
+		*size = st.st_size;
+		buf = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+			   fd, 0);
+		if (buf == MAP_FAILED)
+			buf = NULL;
+	}
+	if (buf == NULL)
+		buf = read_response_file(fd, size);
+
+	close(fd);
+	return buf;
+}
+
+/* Replace the response files in argv by their contents, and return the
+ * new number of arguments. As with the compiler driver, response files
+ * may refer to other response files.
+ */
+static int expand_response_files(int argc, char ***argvp)
+{
+	char **argv = *argvp, **expanded, *buf;
+	int i, n, count = 0;
+	size_t size;
+
+	for (i = 1; i < argc; i++) {
+		if (argv[i][0] != '@')
+			continue;
+		buf = map_response_file(argv[i] + 1, &size);
+		if (buf == NULL)
+			continue;
+
+		if (++count > MAX_RESPONSE_FILES) {
+			fprintf(stderr, "%s: ERROR: too many response files, '%s' includes itself?\n",
+				program_invocation_short_name, argv[i]);
+			exit(1);
+		}
+
+		n = split_response_file(buf, size, NULL);
+		expanded = malloc(sizeof(char *) * (argc + n));
+		if (expanded == NULL) {
+			perror(__FILE__ ": malloc");
+			exit(2);
+		}
+		memcpy(expanded, argv, sizeof(char *) * i);
+		split_response_file(buf, size, expanded + i);
+		/* with the NULL termination */
+		memcpy(expanded + i + n, argv + i + 1, sizeof(char *) * (argc - i));
+
+		if (argv != *argvp)
+			free(argv);
+		argv = expanded;
+		argc += n - 1;
+		/* Expand what the file starts with, if needed */
+		i--;
+	}
+
+	*argvp = argv;
+	return argc;
+}
+
+/* Size of the arguments and environment, as accounted for by execve() */
+static size_t exec_size(char **args)
+{
+	size_t size = 0;
+	char **p;
+
+	for (p = args; *p; p++)
+		size += strlen(*p) + 1 + sizeof(char *);
+	for (p = environ; *p; p++)
+		size += strlen(*p) + 1 + sizeof(char *);
+
+	return size;
+}
+
+/* Replace args, the arguments of the real compiler, by a response file
+ * holding them, so that a command line that is too long once the wrapper
+ * expanded it and added its own arguments does not fail with E2BIG. The
+ * file is unlinked at once, and passed as /proc/self/fd/N, which the
+ * compiler inherits. Returns false if it could not be written, args then
+ * being left as they are.
+ */
+static bool write_response_file(char **args)
+{
+	static char rsp_arg[sizeof("@/proc/self/fd/") + 10];
+	struct strbuf sb = { NULL, 0, 0 };
+	const char *tmpdir = getenv("TMPDIR");
+	char tmpl[PATH_MAX], **arg;
+	const char *s;
+	size_t n;
+	ssize_t ret;
+	int fd;
+
+	for (arg = args; *arg; arg++) {
+		if (**arg == '\0')
+			strbuf_add(&sb, "\"\"", 2);
+		for (s = *arg; *s; s += n) {
+			for (n = 0; s[n] && !is_rsp_space(s[n]) && s[n] != '\'' &&
+				    s[n] != '"' && s[n] != '\\'; n++)
+				;
+			strbuf_add(&sb, s, n);
+			if (s[n]) {
+				strbuf_add(&sb, "\\", 1);
+				strbuf_add(&sb, s + n, 1);
+				n++;
+			}
+		}
+		strbuf_add(&sb, "\n", 1);
+	}
+
+	snprintf(tmpl, sizeof(tmpl), "%s/br-wrapper-XXXXXX",
+		 tmpdir && *tmpdir ? tmpdir : "/tmp");
+	fd = mkstemp(tmpl);
+	if (fd < 0) {
+		perror(__FILE__ ": mkstemp");
+		free(sb.str);
+		return false;
+	}
+	unlink(tmpl);
+
+	for (n = 0; n < sb.len; n += ret) {
+		ret = write(fd, sb.str + n, sb.len - n);
+		if (ret < 0 && errno == EINTR)
+			ret = 0;
+		else if (ret < 0) {
+			perror(__FILE__ ": write");
+			close(fd);
+			free(sb.str);
+			return false;
+		}
+	}
+	free(sb.str);
+
+	snprintf(rsp_arg, sizeof(rsp_arg), "@/proc/self/fd/%d", fd);
+	args[0] = rsp_arg;
+	args[1] = NULL;
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	char **args, **cur, **exec_args, **cc_args;
+	char *absbasedir;
 	char *progpath = argv[0];
 	char *basename;
-	char *env_debug;
-	int ret, i, count = 0, debug = 0, found_shared = 0;
+	char *env_debug, *env_log, *env_shard;
+	struct args_info info;
+	int ret, i, debug = 0;
+	long arg_max;
+#ifdef BR_BASEDIR
+	struct stat st;
+#endif
+#ifdef BR_PTRAUTH_PLUGIN
+	char *ptrauth_mode;
+	int ptrauth_link = 0;
+#endif
 
 	/* Debug the wrapper to see arguments it was called with.
 	 * If environment variable BR2_DEBUG_WRAPPER is:
@@ -264,39 +1011,31 @@ int main(int argc, char **argv)
 		fprintf(stderr, "\n");
 	}
 
+	argc = expand_response_files(argc, &argv);
+	classify_args(argc, argv, &info);
+
 	/* Calculate the relative paths */
 	basename = strrchr(progpath, '/');
 	if (basename) {
 		*basename = '\0';
 		basename++;
-		relbasedir = malloc(strlen(progpath) + 7);
-		if (relbasedir == NULL) {
-			perror(__FILE__ ": malloc");
-			return 2;
-		}
-		sprintf(relbasedir, "%s/..", argv[0]);
-		absbasedir = realpath(relbasedir, NULL);
-	} else {
+	} else
 		basename = progpath;
-		absbasedir = malloc(PATH_MAX + 1);
-		ret = readlink("/proc/self/exe", absbasedir, PATH_MAX);
-		if (ret < 0) {
-			perror(__FILE__ ": readlink");
-			return 2;
-		}
-		absbasedir[ret] = '\0';
-		for (i = ret; i > 0; i--) {
-			if (absbasedir[i] == '/') {
-				absbasedir[i] = '\0';
-				if (++count == 2)
-					break;
-			}
-		}
-	}
-	if (absbasedir == NULL) {
-		perror(__FILE__ ": realpath");
+
+	absbasedir = NULL;
+#ifdef BR_BASEDIR
+	/* The host directory the wrapper was built for, as long as it was
+	 * started from there and the stamp installed with it is still there:
+	 * a copy of the host directory must not use the original one.
+	 * prepare-sdk removes the stamp, so that an SDK always works out
+	 * where it was relocated to. */
+	if (run_from_basedir() && stat(BR_BASEDIR "/" BR_BASEDIR_STAMP, &st) == 0)
+		absbasedir = BR_BASEDIR;
+#endif
+	if (absbasedir == NULL)
+		absbasedir = find_basedir(basename != progpath ? argv[0] : NULL);
+	if (absbasedir == NULL)
 		return 2;
-	}
 
 	/* Fill in the relative paths */
 #ifdef BR_CROSS_PATH_REL
@@ -312,13 +1051,11 @@ int main(int argc, char **argv)
 	}
 
 	/* skip all processing --help is specified */
-	for (i = 1; i < argc; i++) {
-		if (!strcmp(argv[i], "--help")) {
-			argv[0] = path;
-			if (execv(path, argv))
-				perror(path);
-			return 1;
-		}
+	if (info.help) {
+		argv[0] = path;
+		if (execv(path, argv))
+			perror(path);
+		return 1;
 	}
 
 #ifdef BR_CCACHE
@@ -347,28 +1084,13 @@ int main(int argc, char **argv)
 
 #ifdef BR_FLOAT_ABI
 	/* add float abi if not overridden in args */
-	for (i = 1; i < argc; i++) {
-		if (!strncmp(argv[i], "-mfloat-abi=", strlen("-mfloat-abi=")) ||
-		    !strcmp(argv[i], "-msoft-float") ||
-		    !strcmp(argv[i], "-mhard-float"))
-			break;
-	}
-
-	if (i == argc)
+	if (!info.float_abi)
 		*cur++ = "-mfloat-abi=" BR_FLOAT_ABI;
 #endif
 
 #ifdef BR_FP32_MODE
 	/* add fp32 mode if soft-float is not args or hard-float overrides soft-float */
-	int add_fp32_mode = 1;
-	for (i = 1; i < argc; i++) {
-		if (!strcmp(argv[i], "-msoft-float"))
-			add_fp32_mode = 0;
-		else if (!strcmp(argv[i], "-mhard-float"))
-			add_fp32_mode = 1;
-	}
-
-	if (add_fp32_mode == 1)
+	if (info.fp32_mode)
 		*cur++ = "-mfp" BR_FP32_MODE;
 #endif
 
@@ -377,13 +1099,7 @@ int main(int argc, char **argv)
 	/* Add our -march/cpu flags, but only if none of
 	 * -march/mtune/mcpu are already specified on the commandline
 	 */
-	for (i = 1; i < argc; i++) {
-		if (!strncmp(argv[i], "-march=", strlen("-march=")) ||
-		    !strncmp(argv[i], "-mtune=", strlen("-mtune=")) ||
-		    !strncmp(argv[i], "-mcpu=",  strlen("-mcpu=" )))
-			break;
-	}
-	if (i == argc) {
+	if (!info.arch) {
 #ifdef BR_ARCH
 		*cur++ = "-march=" BR_ARCH;
 #endif
@@ -414,56 +1130,27 @@ int main(int argc, char **argv)
 	 *    in a similar way to -fno-pie or -no-pie.
 	 * 3) A check is added for Kernel and U-boot defines
 	 *    (-D__KERNEL__ and -D__UBOOT__).
+	 *
+	 * -shared disables -pie, but -fPIE may still be set.
 	 */
-	for (i = 1; i < argc; i++) {
-		/* Apply all incompatible link flag and disable checks first */
-		if (!strcmp(argv[i], "-r") ||
-		    !strcmp(argv[i], "-Wl,-r") ||
-		    !strcmp(argv[i], "-static") ||
-		    !strcmp(argv[i], "-D__KERNEL__") ||
-		    !strcmp(argv[i], "-D__UBOOT__") ||
-		    !strcmp(argv[i], "-fno-pie") ||
-		    !strcmp(argv[i], "-fno-PIE") ||
-		    !strcmp(argv[i], "-no-pie"))
-			break;
-		/* Record that shared was present which disables -pie but don't
-		 * break out of loop as a check needs to occur that possibly
-		 * still allows -fPIE to be set
-		 */
-		if (!strcmp(argv[i], "-shared"))
-			found_shared = 1;
-	}
-
-	if (i == argc) {
-		/* Compile and link condition checking have been kept split
-		 * between these two loops, as there maybe already are valid
-		 * compile flags set for position independence. In that case
-		 * the wrapper just adds the -pie for link.
-		 */
-		for (i = 1; i < argc; i++) {
-			if (!strcmp(argv[i], "-fpie") ||
-			    !strcmp(argv[i], "-fPIE") ||
-			    !strcmp(argv[i], "-fpic") ||
-			    !strcmp(argv[i], "-fPIC"))
-				break;
-		}
-		/* Both args below can be set at compile/link time
+	if (!info.no_pie) {
+		/* Compile and link conditions are kept split, as there maybe
+		 * already are valid compile flags set for position
+		 * independence. In that case the wrapper just adds the -pie
+		 * for link.
+		 *
+		 * Both args below can be set at compile/link time
 		 * and are ignored correctly when not used
 		 */
-		if (i == argc)
+		if (!info.pic)
 			*cur++ = "-fPIE";
 
-		if (!found_shared)
+		if (!info.shared)
 			*cur++ = "-pie";
 	}
 #endif
 	/* Are we building the Linux Kernel or U-Boot? */
-	for (i = 1; i < argc; i++) {
-		if (!strcmp(argv[i], "-D__KERNEL__") ||
-		    !strcmp(argv[i], "-D__UBOOT__"))
-			break;
-	}
-	if (i == argc) {
+	if (!info.kernel) {
 		/* https://wiki.gentoo.org/wiki/Hardened/Toolchain#Mark_Read-Only_Appropriate_Sections */
 #ifdef BR2_RELRO_PARTIAL
 		*cur++ = "-Wl,-z,relro";
@@ -471,35 +1158,43 @@ int main(int argc, char **argv)
 #ifdef BR2_RELRO_FULL
 		*cur++ = "-Wl,-z,now";
 		*cur++ = "-Wl,-z,relro";
+#endif
+#ifdef BR_PTRAUTH_PLUGIN
+		/* Packages built with <PKG>_PTRAUTH_INSTRUMENT = YES or BATCH
+		 * get BR2_PTRAUTH_INSTRUMENT in their environment. The plugin
+		 * is found by name in the plugin directory of the compiler.
+		 */
+		ptrauth_mode = getenv("BR2_PTRAUTH_INSTRUMENT");
+		if (ptrauth_mode && (!strcmp(ptrauth_mode, "YES") ||
+				     !strcmp(ptrauth_mode, "BATCH"))) {
+			*cur++ = "-fplugin=ptrauth";
+			if (!strcmp(ptrauth_mode, "BATCH"))
+				*cur++ = "-fplugin-arg-ptrauth-batch";
+			ptrauth_link = 1;
+		}
 #endif
 	}
 
 	/* Check for unsafe library and header paths */
-	for (i = 1; i < argc; i++) {
-		const struct str_len_s *opt;
-		for (opt=unsafe_opts; opt->str; opt++ ) {
-			/* Skip any non-unsafe option. */
-			if (strncmp(argv[i], opt->str, opt->len))
-				continue;
-
-			/* Handle both cases:
-			 *  - path is a separate argument,
-			 *  - path is concatenated with option.
-			 */
-			if (argv[i][opt->len] == '\0') {
-				i++;
-				if (i == argc)
-					break;
-				check_unsafe_path(argv[i-1], argv[i], 0);
-			} else
-				check_unsafe_path(argv[i], argv[i] + opt->len, 1);
-		}
-	}
+	if (info.unsafe_arg)
+		check_unsafe_path(info.unsafe_arg, info.unsafe_path,
+				  info.unsafe_arg_has_path);
 
 	/* append forward args */
 	memcpy(cur, &argv[1], sizeof(char *) * (argc - 1));
 	cur += argc - 1;
 
+#ifdef BR_PTRAUTH_PLUGIN
+	/* Instrumented objects call into libptrauth: pull it in when
+	 * linking, after the objects, and only if they need it.
+	 */
+	if (ptrauth_link && !info.no_link) {
+		*cur++ = "-Wl,--push-state,--as-needed";
+		*cur++ = "-lptrauth";
+		*cur++ = "-Wl,--pop-state";
+	}
+#endif
+
 	/* finish with NULL termination */
 	*cur = NULL;
 
@@ -530,6 +1225,26 @@ int main(int argc, char **argv)
 		exec_args++;
 #endif
 
+	/* The real compiler, without ccache */
+	cc_args = exec_args;
+#ifdef BR_CCACHE
+	if (ccache_enabled)
+		cc_args++;
+#endif
+
+	/* Record the compilation for compile_commands.json */
+	env_shard = getenv("BR2_COMPILE_COMMANDS_SHARD");
+	if (env_shard && *env_shard)
+		record_compile_command(env_shard, cc_args, argc, argv, &info);
+
+	/* Once the response files are expanded and the wrapper arguments
+	 * added, the command line may be too long for execve() (xargs keeps
+	 * the same 2048 bytes of headroom) */
+	arg_max = sysconf(_SC_ARG_MAX);
+	if (arg_max > 2048 && exec_size(exec_args) > (size_t)arg_max - 2048 &&
+	    cc_args[1] != NULL)
+		write_response_file(cc_args + 1);
+
 	/* Debug the wrapper to see final arguments passed to the real compiler. */
 	if (debug > 0) {
 		fprintf(stderr, "Toolchain wrapper executing:");
@@ -549,6 +1264,14 @@ int main(int argc, char **argv)
 		fprintf(stderr, "\n");
 	}
 
+	/* Log the resource usage of the call, see run_and_log() */
+	env_log = getenv("BR2_WRAPPER_LOG");
+	if (env_log && *env_log) {
+		ret = run_and_log(env_log, exec_args, basename, info.output);
+		free(args);
+		return ret;
+	}
+
 	if (execv(exec_args[0], exec_args))
 		perror(path);
 
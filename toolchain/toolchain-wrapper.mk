@@ -77,12 +77,29 @@ ifeq ($(BR2_PIC_PIE),y)
 TOOLCHAIN_WRAPPER_ARGS += -DBR2_PIC_PIE
 endif
 
+ifeq ($(BR2_PACKAGE_HOST_PTRAUTH_GCC_PLUGIN),y)
+TOOLCHAIN_WRAPPER_ARGS += -DBR_PTRAUTH_PLUGIN
+endif
+
 ifeq ($(BR2_RELRO_PARTIAL),y)
 TOOLCHAIN_WRAPPER_ARGS += -DBR2_RELRO_PARTIAL
 else ifeq ($(BR2_RELRO_FULL),y)
 TOOLCHAIN_WRAPPER_ARGS += -DBR2_RELRO_FULL
 endif
 
+# Without per-package directories, the wrapper always runs from the same
+# host directory, so it is built with it rather than resolving its own
+# location on every call. The stamp installed alongside tells it that
+# the host directory is still there, and is removed by prepare-sdk so
+# that a relocated SDK falls back to resolving its location.
+TOOLCHAIN_WRAPPER_BASEDIR_STAMP = share/buildroot/toolchain-wrapper-basedir
+
+ifeq ($(BR2_PER_PACKAGE_DIRECTORIES),)
+TOOLCHAIN_WRAPPER_ARGS += \
+	-DBR_BASEDIR='"$(or $(realpath $(HOST_DIR)),$(HOST_DIR))"' \
+	-DBR_BASEDIR_STAMP='"$(TOOLCHAIN_WRAPPER_BASEDIR_STAMP)"'
+endif
+
 define TOOLCHAIN_WRAPPER_BUILD
 	$(HOSTCC) $(HOST_CFLAGS) $(TOOLCHAIN_WRAPPER_ARGS) \
 		-s -Wl,--hash-style=$(TOOLCHAIN_WRAPPER_HASH_STYLE) \
@@ -93,4 +110,7 @@ endef
 define TOOLCHAIN_WRAPPER_INSTALL
 	$(INSTALL) -D -m 0755 $(@D)/toolchain-wrapper \
 		$(HOST_DIR)/bin/toolchain-wrapper
+	$(if $(BR2_PER_PACKAGE_DIRECTORIES),,\
+		mkdir -p $(HOST_DIR)/share/buildroot && \
+		touch $(HOST_DIR)/$(TOOLCHAIN_WRAPPER_BASEDIR_STAMP))
 endef